@@ -0,0 +1,74 @@
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+/**
+ * \file
+ * Header file for the size-classed message buffer pool of libsess.
+ *
+ * Buffers are allocated by the thread owning the pool, but may be released
+ * from any thread (in particular the ZeroMQ I/O thread calling the free
+ * callback of a message), without locks.
+ *
+ */
+
+#include <stddef.h>
+
+#define BUFPOOL_NR_OF_CLASSES 8 // 64 bytes to 1MB, a factor of 4 apart.
+#define BUFPOOL_MIN_SIZE      64
+
+typedef struct bufpool bufpool;
+
+// Pool statistics.
+typedef struct {
+  unsigned long allocs; // Number of bufpool_alloc calls
+  unsigned long hits;   // Allocations served from a free list
+  size_t bytes_in_use;  // Bytes currently handed out
+  size_t peak_bytes;    // Maximum of bytes_in_use
+} bufpool_stats;
+
+
+/**
+ * \brief Create a buffer pool.
+ *
+ * \returns New pool, or NULL if out of memory.
+ */
+bufpool *bufpool_new();
+
+
+/**
+ * \brief Destroy a buffer pool.
+ * Buffers still in use are returned to the system when released, and
+ * the pool itself is freed with the last of them.
+ *
+ * @param[in] pool Pool to destroy
+ */
+void bufpool_free(bufpool *pool);
+
+
+/**
+ * \brief Allocate a buffer from the pool (owner thread only).
+ *
+ * @param[in] pool Pool to allocate from
+ * @param[in] size Size of buffer in bytes
+ *
+ * \returns Allocated buffer, or NULL if out of memory.
+ */
+void *bufpool_alloc(bufpool *pool, size_t size);
+
+
+/**
+ * \brief Return a buffer to the pool it was allocated from (any thread).
+ *
+ * @param[in] data Buffer from \ref bufpool_alloc
+ */
+void bufpool_release(void *data);
+
+
+/**
+ * \brief Get statistics of a pool.
+ *
+ * @param[in]  pool  Pool to inspect
+ * @param[out] stats Statistics of pool
+ */
+void bufpool_get_stats(const bufpool *pool, bufpool_stats *stats);
+
+#endif // __BUFPOOL_H__
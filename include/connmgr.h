@@ -6,15 +6,24 @@
  *
  */
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define MAX_NR_OF_ROLES 100 // Maximum number of endpoint roles.
 #define MAX_HOSTNAME_LENGTH 256
 
+// Transports of a connection.
+#define CONN_TCP    0 // tcp://host:port
+#define CONN_IPC    1 // ipc://, both roles on the same host.
+#define CONN_INPROC 2 // inproc://, both roles are threads of one process.
+
 // A connection record.
 typedef struct {
   char *from;
   char *to;
   char *host;
   unsigned port;
+  int transport;
 } conn_rec;
 
 // A role-host map.
@@ -23,6 +32,46 @@ typedef struct {
   char *host;
 } host_map;
 
+// Binary connection configuration, in host byte order:
+// header, role records (sorted by name), connection records, adjacency
+// index (uint32_t connection record indexes, grouped by role), string table.
+#define CONN_BIN_MAGIC   0x424e4353 // "SCNB"
+#define CONN_BIN_VERSION 2
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nr_of_roles;
+  uint32_t nr_of_conns;
+  uint32_t strings_size; // Size of the string table.
+} conn_bin_header;
+
+typedef struct {
+  uint32_t role; // Offset in the string table.
+  uint32_t host; // Offset in the string table.
+  uint32_t first_conn; // First entry of the role in the adjacency index.
+  uint32_t nr_of_conns; // Number of entries of the role.
+} conn_bin_role;
+
+typedef struct {
+  uint32_t from; // Index of the role record.
+  uint32_t to;   // Index of the role record.
+  uint32_t host; // Offset in the string table.
+  uint32_t port;
+  uint32_t transport;
+} conn_bin_conn;
+
+// A mapped binary connection configuration.
+typedef struct {
+  void *addr;
+  size_t size;
+  const conn_bin_header *header;
+  const conn_bin_role *roles;
+  const conn_bin_conn *conns;
+  const uint32_t *adjacency;
+  const char *strings;
+} conn_map;
+
 /**
  * \brief Load a hosts file.
  *
@@ -48,6 +97,8 @@ int connmgr_load_roles(const char *scribble, char ***roles);
 /**
  * \brief Create a connection record array using given parameters.
  *
+ * Connections between roles mapped to the same host use CONN_IPC.
+ *
  * @param[out] conns       Connection record array
  * @param[out] role_hosts  Role-to-host mapping
  * @param[in]  roles       Roles array
@@ -64,9 +115,31 @@ int connmgr_init(conn_rec **conns, host_map **role_hosts,
                  int start_port);
 
 
+/**
+ * \brief Get the name of a transport, as used in connection record files.
+ *
+ * @param[in] transport Transport (CONN_TCP, CONN_IPC or CONN_INPROC)
+ *
+ * \returns Name of transport ("tcp", "ipc" or "inproc").
+ */
+const char *connmgr_transport_name(int transport);
+
+
 /**
  * \brief Read a connection record file.
  *
+ * The file holds a line "nr_of_roles nr_of_conns", a line "role host" per
+ * role, and a line "from to host port transport" per connection. The
+ * transport column of connection records is optional, CONN_TCP if
+ * missing. The address of a connection is:
+ *
+ *  - tcp:    tcp://host:port, bound by the to role on all interfaces
+ *  - ipc:    ipc://dir/sess-to-port, where dir is the SESS_IPC_DIR
+ *            environment variable of the job (default /tmp/sess-<uid>).
+ *            Jobs running on the same host at the same time must use
+ *            different directories, or their sockets collide.
+ *  - inproc: inproc://sess-to-port
+ *
  * @param[in]  infile      Input file path
  * @param[out] conns       Connection record array to write to
  * @param[out] role_hosts  Role-to-host mapping
@@ -89,4 +162,66 @@ int connmgr_read(const char *infile, conn_rec **conns, host_map **role_hosts, in
 void connmgr_write(const char *outfile, const conn_rec conns[], int nr_of_conns,
                                         const host_map role_hosts[], int nr_of_roles);
 
+
+/**
+ * \brief Write a connection record array to file in the binary format.
+ *
+ * @param[in] outfile     Output file path
+ * @param[in] conns       Connection record array
+ * @param[in] nr_of_conns Number of items in connection record array
+ * @param[in] role_hosts  Role-to-host mapping
+ * @param[in] nr_of_roles Number of roles in connection record
+ *
+ * \returns 0 if successful, -1 otherwise.
+ */
+int connmgr_write_binary(const char *outfile, const conn_rec conns[], int nr_of_conns,
+                                              const host_map role_hosts[], int nr_of_roles);
+
+
+/**
+ * \brief Map a binary connection configuration file into memory.
+ *
+ * @param[in] infile Input file path
+ *
+ * \returns Mapped configuration, or NULL if infile is not a valid binary
+ *          connection configuration.
+ */
+conn_map *connmgr_map(const char *infile);
+
+
+/**
+ * \brief Unmap a binary connection configuration.
+ *
+ * @param[in] map Mapped configuration
+ */
+void connmgr_unmap(conn_map *map);
+
+
+/**
+ * \brief Lookup a role in a mapped configuration.
+ *
+ * @param[in] map  Mapped configuration
+ * @param[in] role Role name
+ *
+ * \returns Index of the role record, or -1 if not found.
+ */
+int connmgr_map_role(const conn_map *map, const char *role);
+
+
+/**
+ * \brief Get the connection records of a role from a mapped configuration.
+ *
+ * Only the records of the role are read, from the adjacency index.
+ *
+ * The strings of the records point into the mapping, only the array is
+ * allocated (free() it before connmgr_unmap).
+ *
+ * @param[in]  map      Mapped configuration
+ * @param[in]  role_idx Index of the role record
+ * @param[out] conns    Connection record array of the role
+ *
+ * \returns Number of items in the connection record array.
+ */
+int connmgr_map_conns(const conn_map *map, int role_idx, conn_rec **conns);
+
 #endif // __CONNMGR_H__
@@ -7,34 +7,158 @@
  */
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <zmq.h>
 
+#include "bufpool.h"
+
 #define _Others_idx -1
 #define _Others(sess) _Others_idx, sess
 
 typedef void role; ///< Type representing a participant/role
 
+/**
+ * A send buffer that can be reused across iterations.
+ * The buffer is in use until every send referring to it has been released
+ * by ZeroMQ (see \ref sess_buf_busy and \ref sess_buf_wait).
+ */
+typedef struct {
+  void *data;
+  size_t size;
+  volatile int inflight; // Number of messages not yet released by ZeroMQ.
+} sess_buf;
+
+/**
+ * A received message lent to the application without copying
+ * (see \ref recv_view). The data stays valid until \ref sess_msg_release.
+ */
+typedef struct {
+  zmq_msg_t msg;
+  size_t offset; // Start of payload in msg.
+  size_t size;   // Size of payload.
+} sess_msg;
+
+struct session_t;
+
+/**
+ * Handle of a non-blocking send or receive (see \ref sess_wait).
+ */
+typedef struct sess_req_t sess_req;
+
+/**
+ * Receive handler of a session reactor (see \ref sess_on_recv).
+ * Returns 0 to keep receiving from r, non-zero to stop.
+ */
+typedef int (sess_handler)(struct session_t *s, role *r, sess_msg *m, void *arg);
+
 typedef struct {
   char *role_name;
   role *role_ptr;
-  char uri[6+255+7]; // tcp:// + FQDN + :port + \0
+  char uri[16+255+12]; // tcp:// + FQDN + :port, longer than an ipc:// path can be (see connmgr.h)
+  struct session_t *sess; // Session this endpoint belongs to.
+  int cond_pending; // cond waits for the next send (see sess_piggyback_conds).
+  int cond;
+  int stashed; // stash was received ahead of time (by inwhile, or a batch).
+  int stash_batched; // stash is a batch, stash.offset is its next message.
+  sess_msg stash;
+  void *batch; // Small sends not yet sent (see sess_batch).
+  void *batch_hint;
+  size_t batch_used;
+  size_t batch_limit; // 0 if not batching.
+  unsigned batch_usecs;
+  uint64_t batch_start;
+  struct sess_req_t *sends, *sends_tail; // Queued isends.
+  struct sess_req_t *recvs, *recvs_tail; // Posted irecvs.
+  sess_handler *handler; // Called by sess_run for each message received.
+  void *handler_arg;
 } endpoint_t;
 
 struct session_t {
   endpoint_t **endpoints; // Array of endpoint pointers.
   unsigned endpoints_count;
+  bufpool *pool; // Send buffer pool.
 
   role *(*get_role)(struct session_t *, char *); // lookup function.
   char *all_roles[255];
   unsigned all_roles_count;
-  void *ctx; // Extra data.
+  role *roles_by_id[255]; // Role of all_roles[id] (see sess_role_id).
+  char *role_name; // Role of this endpoint.
+  unsigned *role_table; // Hash index of role names (endpoint index + 1).
+  unsigned role_table_size; // Power of 2.
+  char **rank_names; // Names of all roles in the session, sorted.
+  role **ranks; // Role of each rank (NULL for this role).
+  unsigned nr_of_ranks;
+  unsigned rank; // Rank of this role.
+  int piggyback_conds; // Loop conditions travel with the next send.
+  unsigned nr_of_pending_conds;
+  unsigned nr_of_pending_batches;
+  unsigned nr_of_pending_reqs; // Queued isends and posted irecvs.
+  unsigned nr_of_handlers;
+  volatile int running; // sess_run is active (cleared by sess_stop).
+  int end_timeout; // Max. time (ms) end_session waits for peers.
+  uint64_t startup_usecs; // Time join_session took, including the barrier.
+  void *ctx; // ZeroMQ context, shared by all sessions (see sess_runtime_init).
 };
 typedef struct session_t session;
 
+/**
+ * Reduction operators of collective operations.
+ */
+typedef enum {
+  SESS_SUM,
+  SESS_MIN,
+  SESS_MAX
+} sess_op;
+
+
+/**
+ * \brief Start the process-wide runtime shared by all sessions.
+ *
+ * The runtime owns one ZeroMQ context, so joining and ending sessions does
+ * not create contexts or I/O threads. Calling this is optional: the first
+ * \ref join_session starts the runtime with the number of I/O threads
+ * given by its --io-threads option, the SESS_IO_THREADS environment
+ * variable, or 1.
+ *
+ * @param[in] io_threads Number of ZeroMQ I/O threads, 0 for the default
+ *
+ * \returns 0 if successful, -1 if already started and set errno
+ */
+int sess_runtime_init(int io_threads);
+
+
+/**
+ * \brief Terminate the process-wide runtime.
+ *
+ * All sessions must have ended. Otherwise the runtime is terminated at
+ * exit, if all sessions have ended by then.
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ */
+int sess_runtime_term();
+
 
 /**
  * \brief Create and join a session.
  *
+ * Returns once the connections to all roles are established (every role
+ * has exchanged a hello with this one). If they are not within the startup
+ * timeout (option --start-timeout or the SESS_START_TIMEOUT environment
+ * variable, in ms, default 30000), the program exits with an error. The
+ * time taken is kept in (*s)->startup_usecs.
+ *
+ * Each connection uses the transport of its record in the connection
+ * configuration: tcp://, ipc:// for roles on the same host, or inproc://
+ * for roles running as threads of one process. The ipc:// sockets are in
+ * the directory named by the SESS_IPC_DIR environment variable (default
+ * /tmp/sess-<uid>), which must be the same for all roles of a job and
+ * different for jobs running on the same host at the same time.
+ *
+ * The endpoint Scribble is parsed once. If the SESS_SCRIBBLE_CACHE
+ * environment variable names a directory, the parsed protocol is cached
+ * there (see parse_protocol_cached) and later launches skip the parser.
+ * If it cannot be parsed, the program exits with an error.
+ *
  * @param[in,out] argc     Command line argument count
  * @param[in,out] argv     Command line argument list
  * @param[out]    s        Pointer to session varible to create
@@ -44,6 +168,71 @@ typedef struct session_t session;
 void join_session(int *argc, char ***argv, session **s, const char *scribble);
 
 
+/**
+ * \brief Create and join a session of a protocol embedded in the program.
+ *
+ * Same as \ref join_session, but the endpoint Scribble is parsed from
+ * memory, so no Scribble file is needed at run time. The source can be
+ * compiled in, eg. with `xxd -i Protocol_A.spr > Protocol_A.h` and
+ *
+ *   join_session_embedded(&argc, &argv, &s, (char *)Protocol_A_spr, Protocol_A_spr_len);
+ *
+ * @param[in,out] argc     Command line argument count
+ * @param[in,out] argv     Command line argument list
+ * @param[out]    s        Pointer to session varible to create
+ * @param[in]     protocol Endpoint Scribble source (need not be
+ *                         NUL-terminated)
+ * @param[in]     size     Size of protocol in bytes
+ */
+void join_session_embedded(int *argc, char ***argv, session **s,
+                           const char *protocol, size_t size);
+
+
+/**
+ * \brief Get the id of a role declared in the endpoint Scribble.
+ *
+ * @param[in] s         Session
+ * @param[in] role_name Role name
+ *
+ * \returns Role id (index in s->all_roles and s->roles_by_id),
+ *          -1 if not found.
+ */
+int sess_role_id(const session *s, const char *role_name);
+
+
+/**
+ * \brief Get a role by its id, without a lookup by name.
+ *
+ * Role ids are positions in the role declarations of the endpoint Scribble.
+ * Get the ids once with \ref sess_role_id, eg. after join_session, and
+ * keep them with the session:
+ *
+ *   int B_id = sess_role_id(s, "B");
+ *   ...
+ *   send_int(sess_role_by_id(s, B_id), val);
+ *
+ * @param[in] s  Session
+ * @param[in] id Role id returned by sess_role_id for s
+ *
+ * \returns Role, or NULL if id is not a role of s.
+ */
+role *sess_role_by_id(const session *s, int id);
+
+
+/**
+ * \brief Let loop conditions travel with the data of the next iteration.
+ *
+ * When enabled, \ref outwhile does not send a non-zero condition on its
+ * own, but as header frame of the next message sent to each role in the
+ * same ZeroMQ message. Conditions still pending when this role receives
+ * are sent first. The receiving side (\ref inwhile) needs no setting.
+ *
+ * @param[in] s      Session
+ * @param[in] enable 1 to piggyback loop conditions, 0 to send them at once
+ */
+void sess_piggyback_conds(session *s, int enable);
+
+
 /**
  * \brief Dump content of an established session.
  *
@@ -54,11 +243,47 @@ void dump_session(const session *s);
 /**
  * \brief Terminate a session.
  *
+ * Sends what is still batched or queued, then exchanges an end message
+ * with every peer, so it returns as soon as all peers have ended too, or
+ * after s->end_timeout ms (SESS_END_TIMEOUT environment variable,
+ * default 5000).
+ *
  * @param[in] s Session to terminate
  */
 void end_session(session *s);
 
 
+/**
+ * \brief Entry function of a role run by sess_spawn_local.
+ *
+ * The session is joined before, and ended after, the entry function.
+ * Returns 0 on success.
+ */
+typedef int (sess_entry)(session *s, void *arg);
+
+
+/**
+ * \brief Run roles as threads of this process.
+ *
+ * Each role gets its own session, connected to the others through
+ * inproc:// on the shared runtime, and runs entry_fns[i](s, args[i]) in
+ * its own thread. Returns when all roles have ended.
+ *
+ * @param[in] nr_of_roles Number of roles
+ * @param[in] scribbles   Endpoint Scribble file path of each role
+ * @param[in] entry_fns   Entry function of each role
+ * @param[in] args        Argument of each entry function (or NULL)
+ *
+ * \returns 0 if all entry functions returned 0, otherwise the first
+ *          non-zero value (or -1 if a Scribble could not be parsed, in
+ *          which case no role is run, if a thread could not be started, or a
+ *          role was not connected to all others within the startup
+ *          timeout, in which case its entry function is not run).
+ */
+int sess_spawn_local(int nr_of_roles, const char *scribbles[],
+                     sess_entry *entry_fns[], void *args[]);
+
+
 /**
  * \brief Session initiation for the server-side of the communication.
  * \deprecated 
@@ -191,6 +416,142 @@ int send_float(role *r, float val);
  */
 int send_float_array(role *r, const float arr[], size_t length);
 
+
+/**
+ * \brief Send an integer array without copying.
+ *
+ * The array is handed to ZeroMQ as is and must not be modified or freed
+ * until ffn is called (possibly from the ZeroMQ I/O thread).
+ *
+ * @param[in] r      Role to send to
+ * @param[in] arr    Array to send
+ * @param[in] length Size of array
+ * @param[in] ffn    Function to call when ZeroMQ releases arr (or NULL)
+ * @param[in] hint   Extra argument to ffn
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_send)
+ */
+int send_int_array_nocopy(role *r, const int arr[], size_t length,
+                          zmq_free_fn *ffn, void *hint);
+
+
+/**
+ * \brief Send a double array without copying.
+ *
+ * The array is handed to ZeroMQ as is and must not be modified or freed
+ * until ffn is called (possibly from the ZeroMQ I/O thread).
+ *
+ * @param[in] r      Role to send to
+ * @param[in] arr    Array to send
+ * @param[in] length Size of array
+ * @param[in] ffn    Function to call when ZeroMQ releases arr (or NULL)
+ * @param[in] hint   Extra argument to ffn
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_send)
+ */
+int send_double_array_nocopy(role *r, const double arr[], size_t length,
+                             zmq_free_fn *ffn, void *hint);
+
+
+/**
+ * \brief Send a float array without copying.
+ *
+ * The array is handed to ZeroMQ as is and must not be modified or freed
+ * until ffn is called (possibly from the ZeroMQ I/O thread).
+ *
+ * @param[in] r      Role to send to
+ * @param[in] arr    Array to send
+ * @param[in] length Size of array
+ * @param[in] ffn    Function to call when ZeroMQ releases arr (or NULL)
+ * @param[in] hint   Extra argument to ffn
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_send)
+ */
+int send_float_array_nocopy(role *r, const float arr[], size_t length,
+                            zmq_free_fn *ffn, void *hint);
+
+
+/**
+ * \brief Allocate a reusable send buffer.
+ *
+ * @param[in] size Size of buffer in bytes
+ *
+ * \returns Allocated buffer, or NULL if out of memory.
+ */
+sess_buf *sess_buf_alloc(size_t size);
+
+
+/**
+ * \brief Free a reusable send buffer, waiting for pending sends first.
+ *
+ * @param[in] buf Buffer to free
+ */
+void sess_buf_free(sess_buf *buf);
+
+
+/**
+ * \brief Check if a reusable send buffer is still used by ZeroMQ.
+ *
+ * @param[in] buf Buffer to check
+ *
+ * \returns Number of sends of buf not yet released, 0 if buf can be reused.
+ */
+int sess_buf_busy(const sess_buf *buf);
+
+
+/**
+ * \brief Wait until a reusable send buffer can be modified again.
+ *
+ * @param[in] buf Buffer to wait for
+ */
+void sess_buf_wait(sess_buf *buf);
+
+
+/**
+ * \brief Send the content of a reusable send buffer without copying.
+ *
+ * @param[in] r    Role to send to
+ * @param[in] buf  Buffer to send
+ * @param[in] size Number of bytes of buf to send
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_send)
+ */
+int send_buf(role *r, sess_buf *buf, size_t size);
+
+
+/**
+ * \brief Collect small sends to a role and send them as one message.
+ *
+ * Sends smaller than max_size are appended to a batch, which is sent when
+ * it reaches max_size, when a send finds it older than max_usecs, at
+ * \ref sess_flush, or before this role receives from any role of the
+ * session. Messages keep their order, and the receiver takes them out of
+ * the batch one by one in its recv_* calls without further settings.
+ *
+ * @param[in] r         Role to send to
+ * @param[in] max_size  Batch size in bytes, 0 to stop batching
+ * @param[in] max_usecs Maximum age of a batch in microseconds, 0 for none
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ */
+int sess_batch(role *r, size_t max_size, unsigned max_usecs);
+
+
+/**
+ * \brief Send the batch of a role now (see \ref sess_batch).
+ *
+ * @param[in] r Role to flush
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_send)
+ */
+int sess_flush(role *r);
+
+
 int __send_blob(role *r, const void *blob, size_t length);
 int __receive_blob(role *r, void **dst, size_t *length);
 int __recv_blob(role *r, void *dst, size_t *length);
@@ -385,11 +746,283 @@ int receive_float_array(role *r, float **arr, size_t *length);
 int recv_float_array(role *r, float *arr, size_t *arr_size);
 
 
+/**
+ * \brief Receive a message without copying.
+ *
+ * The received data is lent to the caller, and must be released with
+ * \ref sess_msg_release after use. On error m is left empty, and can be
+ * released all the same.
+ *
+ * @param[in]  r Role to receive from
+ * @param[out] m Message handle to hold received message
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_recv)
+ */
+int recv_view(role *r, sess_msg *m);
+
+
+/**
+ * \brief Get the payload of a message lent by \ref recv_view.
+ *
+ * @param[in] m Message handle
+ *
+ * \returns Pointer to payload, valid until \ref sess_msg_release.
+ */
+void *sess_msg_data(sess_msg *m);
+
+
+/**
+ * \brief Get the payload size (in bytes) of a message lent by \ref recv_view.
+ *
+ * @param[in] m Message handle
+ *
+ * \returns Size of payload.
+ */
+size_t sess_msg_size(const sess_msg *m);
+
+
+/**
+ * \brief Return a message lent by \ref recv_view to the runtime.
+ *
+ * @param[in] m Message handle to release
+ */
+void sess_msg_release(sess_msg *m);
+
+
+/**
+ * \brief Receive an integer array without copying.
+ *
+ * @param[in]  r      Role to receive from
+ * @param[out] m      Message handle, release with \ref sess_msg_release
+ * @param[out] arr    Pointer to received array (valid until m is released)
+ * @param[out] length Variable storing size of received array
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_recv)
+ */
+int recv_int_array_view(role *r, sess_msg *m, const int **arr, size_t *length);
+
+
+/**
+ * \brief Receive a double array without copying.
+ *
+ * @param[in]  r      Role to receive from
+ * @param[out] m      Message handle, release with \ref sess_msg_release
+ * @param[out] arr    Pointer to received array (valid until m is released)
+ * @param[out] length Variable storing size of received array
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_recv)
+ */
+int recv_double_array_view(role *r, sess_msg *m, const double **arr, size_t *length);
+
+
+/**
+ * \brief Receive a float array without copying.
+ *
+ * @param[in]  r      Role to receive from
+ * @param[out] m      Message handle, release with \ref sess_msg_release
+ * @param[out] arr    Pointer to received array (valid until m is released)
+ * @param[out] length Variable storing size of received array
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_recv)
+ */
+int recv_float_array_view(role *r, sess_msg *m, const float **arr, size_t *length);
+
+
+/**
+ * \brief Post a send of an integer without blocking.
+ *
+ * The value is copied, the send completes in the background. Messages to
+ * the same role are sent in the order they were posted, together with
+ * blocking sends.
+ *
+ * @param[in] r   Role to send to
+ * @param[in] val Value to send
+ *
+ * \returns Request handle, to be completed by \ref sess_wait.
+ */
+sess_req *isend_int(role *r, int val);
+
+
+/**
+ * \brief Post a send of an integer array without blocking.
+ *
+ * The array is copied, it can be modified as soon as this returns.
+ *
+ * @param[in] r      Role to send to
+ * @param[in] arr    Array to send
+ * @param[in] length Number of elements in arr
+ *
+ * \returns Request handle, to be completed by \ref sess_wait.
+ */
+sess_req *isend_int_array(role *r, const int arr[], size_t length);
+
+
+/**
+ * \brief Post a send of a double without blocking (see \ref isend_int).
+ */
+sess_req *isend_double(role *r, double val);
+
+
+/**
+ * \brief Post a send of a double array without blocking
+ * (see \ref isend_int_array).
+ */
+sess_req *isend_double_array(role *r, const double arr[], size_t length);
+
+
+/**
+ * \brief Post a send of a float without blocking (see \ref isend_int).
+ */
+sess_req *isend_float(role *r, float val);
+
+
+/**
+ * \brief Post a send of a float array without blocking
+ * (see \ref isend_int_array).
+ */
+sess_req *isend_float_array(role *r, const float arr[], size_t length);
+
+
+/**
+ * \brief Post a receive of an integer.
+ *
+ * Receives from the same role complete in the order they were posted; a
+ * blocking receive from the role completes all posted ones first.
+ *
+ * @param[in]  r   Role to receive from
+ * @param[out] dst Variable to store the value in, once completed
+ *
+ * \returns Request handle, to be completed by \ref sess_wait.
+ */
+sess_req *irecv_int(role *r, int *dst);
+
+
+/**
+ * \brief Post a receive of an integer array.
+ *
+ * @param[in]     r        Role to receive from
+ * @param[out]    arr      Pre-allocated array to store the data in
+ * @param[in,out] arr_size Capacity of arr, set to the number of elements
+ *                         received once completed
+ *
+ * \returns Request handle, to be completed by \ref sess_wait.
+ */
+sess_req *irecv_int_array(role *r, int *arr, size_t *arr_size);
+
+
+/**
+ * \brief Post a receive of a double (see \ref irecv_int).
+ */
+sess_req *irecv_double(role *r, double *dst);
+
+
+/**
+ * \brief Post a receive of a double array (see \ref irecv_int_array).
+ */
+sess_req *irecv_double_array(role *r, double *arr, size_t *arr_size);
+
+
+/**
+ * \brief Post a receive of a float (see \ref irecv_int).
+ */
+sess_req *irecv_float(role *r, float *dst);
+
+
+/**
+ * \brief Post a receive of a float array (see \ref irecv_int_array).
+ */
+sess_req *irecv_float_array(role *r, float *arr, size_t *arr_size);
+
+
+/**
+ * \brief Check whether a request has completed, without blocking.
+ *
+ * Makes progress on all requests of the session of req.
+ * A completed request must still be released by \ref sess_wait.
+ *
+ * @param[in] req Request to check
+ *
+ * \returns 1 if completed, 0 if not, -1 on error.
+ */
+int sess_test(sess_req *req);
+
+
+/**
+ * \brief Wait for a request to complete and release it.
+ *
+ * @param[in] req Request to wait for (invalid afterwards)
+ *
+ * \returns 0 if the send or receive succeeded, -1 otherwise and set errno
+ */
+int sess_wait(sess_req *req);
+
+
+/**
+ * \brief Wait for all requests to complete and release them.
+ *
+ * @param[in] reqs       Requests to wait for
+ * @param[in] nr_of_reqs Number of requests in reqs
+ *
+ * \returns 0 if all succeeded, -1 otherwise
+ */
+int sess_waitall(sess_req *reqs[], int nr_of_reqs);
+
+
+/**
+ * \brief Register a receive handler for a role.
+ *
+ * While \ref sess_run is active, handler is called with every message
+ * received from r, in the order r sent them. The message is released when
+ * the handler returns. Handlers may send and receive themselves. Messages
+ * of irecvs posted on r are not passed to the handler; they complete first.
+ * A handler returning non-zero is removed, unless it has registered
+ * another handler for r.
+ *
+ * @param[in] s       Session
+ * @param[in] r       Role to receive from
+ * @param[in] handler Handler, or NULL to remove the handler of r
+ * @param[in] arg     Passed to handler unchanged
+ *
+ * \returns 0 if successful, -1 if r is not a role of s and set errno
+ */
+int sess_on_recv(session *s, role *r, sess_handler *handler, void *arg);
+
+
+/**
+ * \brief Serve all roles with receive handlers as their messages arrive.
+ *
+ * Polls the roles of all registered handlers and dispatches messages in
+ * whatever order the roles become ready, so one thread serves many peers
+ * whose interactions may interleave. Returns when \ref sess_stop is
+ * called or no handlers are left.
+ *
+ * @param[in] s Session
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ */
+int sess_run(session *s);
+
+
+/**
+ * \brief Make \ref sess_run return after the current handler.
+ *
+ * @param[in] s Session
+ */
+void sess_stop(session *s);
+
+
 /**
  * \brief Send an integer to multiple roles.
  *
+ * The message is encoded once and shared by all roles, and is sent to
+ * each role as soon as its socket is ready.
+ *
  * @param[in] val         Value to send
- * @param[in] nr_of_roles Number of roles to send to 
+ * @param[in] nr_of_roles Number of roles to send to (or _Others)
  * @param[in] ...         Variable number (subject to nr_of_roles)
  *                        of role variables
  *
@@ -399,12 +1032,102 @@ int recv_float_array(role *r, float *arr, size_t *arr_size);
 int msend_int(int val, int nr_of_roles, ...);
 
 
+/**
+ * \brief Send an integer array to multiple roles.
+ *
+ * @param[in] arr         Array to send (copied once for all roles)
+ * @param[in] length      Size of array
+ * @param[in] nr_of_roles Number of roles to send to (or _Others)
+ * @param[in] ...         Variable number (subject to nr_of_roles)
+ *                        of role variables
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_send)
+ */
+int msend_int_array(const int arr[], size_t length, int nr_of_roles, ...);
+
+
+/**
+ * \brief Send a string to multiple roles.
+ *
+ * @param[in] str         NULL-terminated string to send
+ * @param[in] nr_of_roles Number of roles to send to (or _Others)
+ * @param[in] ...         Variable number (subject to nr_of_roles)
+ *                        of role variables
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_send)
+ */
+int msend_string(const char *str, int nr_of_roles, ...);
+
+
+/**
+ * \brief Send a double to multiple roles.
+ *
+ * @param[in] val         Value to send
+ * @param[in] nr_of_roles Number of roles to send to (or _Others)
+ * @param[in] ...         Variable number (subject to nr_of_roles)
+ *                        of role variables
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_send)
+ */
+int msend_double(double val, int nr_of_roles, ...);
+
+
+/**
+ * \brief Send a double array to multiple roles.
+ *
+ * @param[in] arr         Array to send (copied once for all roles)
+ * @param[in] length      Size of array
+ * @param[in] nr_of_roles Number of roles to send to (or _Others)
+ * @param[in] ...         Variable number (subject to nr_of_roles)
+ *                        of role variables
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_send)
+ */
+int msend_double_array(const double arr[], size_t length, int nr_of_roles, ...);
+
+
+/**
+ * \brief Send a float to multiple roles.
+ *
+ * @param[in] val         Value to send
+ * @param[in] nr_of_roles Number of roles to send to (or _Others)
+ * @param[in] ...         Variable number (subject to nr_of_roles)
+ *                        of role variables
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_send)
+ */
+int msend_float(float val, int nr_of_roles, ...);
+
+
+/**
+ * \brief Send a float array to multiple roles.
+ *
+ * @param[in] arr         Array to send (copied once for all roles)
+ * @param[in] length      Size of array
+ * @param[in] nr_of_roles Number of roles to send to (or _Others)
+ * @param[in] ...         Variable number (subject to nr_of_roles)
+ *                        of role variables
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_send)
+ */
+int msend_float_array(const float arr[], size_t length, int nr_of_roles, ...);
+
+
 /**
  * \brief Receive an integer from multiple roles.
  *
- * @param[out] dst         Pointer-of-pointer to array storing received value
+ * Values are received in the order they arrive, and stored in the
+ * position of their role in the argument list.
+ *
+ * @param[out] dst         Array storing received values
  *                         This has to be at least the size of nr_of_roles.
- * @param[in]  nr_of_roles Number of roles to receive from
+ * @param[in]  nr_of_roles Number of roles to receive from (or _Others)
  * @param[in]  ...         Variable number (subject to nr_of_roles)
  *                         of role variables
  *
@@ -414,6 +1137,236 @@ int msend_int(int val, int nr_of_roles, ...);
 int mrecv_int(int *dst, int nr_of_roles, ...);
 
 
+/**
+ * \brief Receive an integer array from multiple roles.
+ *
+ * Values are received in the order they arrive, and stored in the
+ * position of their role in the argument list.
+ *
+ * @param[out] dst         Array storing pointers to received (allocated) arrays
+ * @param[out] length      Array storing sizes of received arrays
+ *                         Both have to be at least the size of nr_of_roles.
+ * @param[in]  nr_of_roles Number of roles to receive from (or _Others)
+ * @param[in]  ...         Variable number (subject to nr_of_roles)
+ *                         of role variables
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_recv)
+ */
+int mrecv_int_array(int *dst[], size_t length[], int nr_of_roles, ...);
+
+
+/**
+ * \brief Receive a string from multiple roles.
+ *
+ * Values are received in the order they arrive, and stored in the
+ * position of their role in the argument list.
+ *
+ * @param[out] dst         Array storing pointers to received (allocated) strings
+ *                         This has to be at least the size of nr_of_roles.
+ * @param[in]  nr_of_roles Number of roles to receive from (or _Others)
+ * @param[in]  ...         Variable number (subject to nr_of_roles)
+ *                         of role variables
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_recv)
+ */
+int mrecv_string(char *dst[], int nr_of_roles, ...);
+
+
+/**
+ * \brief Receive a double from multiple roles.
+ *
+ * Values are received in the order they arrive, and stored in the
+ * position of their role in the argument list.
+ *
+ * @param[out] dst         Array storing received values
+ *                         This has to be at least the size of nr_of_roles.
+ * @param[in]  nr_of_roles Number of roles to receive from (or _Others)
+ * @param[in]  ...         Variable number (subject to nr_of_roles)
+ *                         of role variables
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_recv)
+ */
+int mrecv_double(double *dst, int nr_of_roles, ...);
+
+
+/**
+ * \brief Receive a double array from multiple roles.
+ *
+ * Values are received in the order they arrive, and stored in the
+ * position of their role in the argument list.
+ *
+ * @param[out] dst         Array storing pointers to received (allocated) arrays
+ * @param[out] length      Array storing sizes of received arrays
+ *                         Both have to be at least the size of nr_of_roles.
+ * @param[in]  nr_of_roles Number of roles to receive from (or _Others)
+ * @param[in]  ...         Variable number (subject to nr_of_roles)
+ *                         of role variables
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_recv)
+ */
+int mrecv_double_array(double *dst[], size_t length[], int nr_of_roles, ...);
+
+
+/**
+ * \brief Receive a float from multiple roles.
+ *
+ * Values are received in the order they arrive, and stored in the
+ * position of their role in the argument list.
+ *
+ * @param[out] dst         Array storing received values
+ *                         This has to be at least the size of nr_of_roles.
+ * @param[in]  nr_of_roles Number of roles to receive from (or _Others)
+ * @param[in]  ...         Variable number (subject to nr_of_roles)
+ *                         of role variables
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_recv)
+ */
+int mrecv_float(float *dst, int nr_of_roles, ...);
+
+
+/**
+ * \brief Receive a float array from multiple roles.
+ *
+ * Values are received in the order they arrive, and stored in the
+ * position of their role in the argument list.
+ *
+ * @param[out] dst         Array storing pointers to received (allocated) arrays
+ * @param[out] length      Array storing sizes of received arrays
+ *                         Both have to be at least the size of nr_of_roles.
+ * @param[in]  nr_of_roles Number of roles to receive from (or _Others)
+ * @param[in]  ...         Variable number (subject to nr_of_roles)
+ *                         of role variables
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_recv)
+ */
+int mrecv_float_array(float *dst[], size_t length[], int nr_of_roles, ...);
+
+
+/**
+ * \brief Receive a message from multiple roles without copying.
+ *
+ * @param[out] msgs        Array of message handles, one per role, each to be
+ *                         released with \ref sess_msg_release
+ *                         (also on error, they are then empty)
+ *                         This has to be at least the size of nr_of_roles.
+ * @param[in]  nr_of_roles Number of roles to receive from (or _Others)
+ * @param[in]  ...         Variable number (subject to nr_of_roles)
+ *                         of role variables
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ *          (See man page of zmq_recv)
+ */
+int mrecv_view(sess_msg msgs[], int nr_of_roles, ...);
+
+
+/**
+ * \brief Broadcast an integer array from root to all roles of the session.
+ *
+ * Every role of the session must call this with the same root and length.
+ * Small messages are forwarded down a binomial tree, large messages are
+ * pipelined along a chain of roles, so the root sends at most log2(N)
+ * messages instead of N-1.
+ *
+ * @param[in]     s      Session
+ * @param[in]     root   Name of the role holding the data
+ * @param[in,out] arr    Array to send (at root) or to receive into
+ * @param[in]     length Number of elements in arr
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ */
+int mbcast_int(session *s, const char *root, int arr[], size_t length);
+
+
+/**
+ * \brief Broadcast a double array from root to all roles of the session.
+ *
+ * See \ref mbcast_int.
+ */
+int mbcast_double(session *s, const char *root, double arr[], size_t length);
+
+
+/**
+ * \brief Broadcast a float array from root to all roles of the session.
+ *
+ * See \ref mbcast_int.
+ */
+int mbcast_float(session *s, const char *root, float arr[], size_t length);
+
+
+/**
+ * \brief Reduce integer arrays of all roles of the session to root.
+ *
+ * Every role of the session must call this with the same root, length and
+ * op. Partial results are combined up a binomial tree.
+ *
+ * @param[in]  s      Session
+ * @param[in]  root   Name of the role receiving the result
+ * @param[in]  src    Contribution of this role
+ * @param[out] dst    Result (only used at root, may be src)
+ * @param[in]  length Number of elements in src and dst
+ * @param[in]  op     Element-wise reduction operator
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ */
+int mreduce_int(session *s, const char *root, const int src[], int dst[], size_t length, sess_op op);
+
+
+/**
+ * \brief Reduce double arrays of all roles of the session to root.
+ *
+ * See \ref mreduce_int.
+ */
+int mreduce_double(session *s, const char *root, const double src[], double dst[], size_t length, sess_op op);
+
+
+/**
+ * \brief Reduce float arrays of all roles of the session to root.
+ *
+ * See \ref mreduce_int.
+ */
+int mreduce_float(session *s, const char *root, const float src[], float dst[], size_t length, sess_op op);
+
+
+/**
+ * \brief Reduce integer arrays of all roles and give the result to all roles.
+ *
+ * Every role of the session must call this with the same length and op.
+ * Small messages use recursive doubling, large messages a ring
+ * reduce-scatter followed by a ring allgather.
+ *
+ * @param[in]  s      Session
+ * @param[in]  src    Contribution of this role
+ * @param[out] dst    Result (may be src)
+ * @param[in]  length Number of elements in src and dst
+ * @param[in]  op     Element-wise reduction operator
+ *
+ * \returns 0 if successful, -1 otherwise and set errno
+ */
+int mallreduce_int(session *s, const int src[], int dst[], size_t length, sess_op op);
+
+
+/**
+ * \brief Allreduce of double arrays.
+ *
+ * See \ref mallreduce_int.
+ */
+int mallreduce_double(session *s, const double src[], double dst[], size_t length, sess_op op);
+
+
+/**
+ * \brief Allreduce of float arrays.
+ *
+ * See \ref mallreduce_int.
+ */
+int mallreduce_float(session *s, const float src[], float dst[], size_t length, sess_op op);
+
+
 int outbranch(role *r, int choice);
 
 
@@ -7,33 +7,180 @@
  * \headerfile "st_node.h"
  */
 
+#include <stddef.h>
 #include <antlr3interfaces.h>
 #include "st_node.h"
+#include "stack.h"
 
-void visit_protocol_node(pANTLR3_BASE_TREE node);
-void visit_role_decl(pANTLR3_BASE_TREE node);
-void visit_inbranch_node(pANTLR3_BASE_TREE node);
-void visit_inbranch_branch_node(pANTLR3_BASE_TREE node);
-void visit_outbranch_node(pANTLR3_BASE_TREE node);
-void visit_outbranch_branch_node(pANTLR3_BASE_TREE node);
-void visit_send_node(pANTLR3_BASE_TREE node);
-void visit_recv_node(pANTLR3_BASE_TREE node);
-void visit_rec_node(pANTLR3_BASE_TREE node);
-void visit_node(pANTLR3_BASE_TREE node);
-void visit_inwhile_node(pANTLR3_BASE_TREE node);
-void visit_outwhile_node(pANTLR3_BASE_TREE node);
+#define MAX_PROTOCOL_ROLES 255 // Maximum number of roles declared by a protocol.
+
+/**
+ * Chunk of interned strings.
+ */
+typedef struct string_chunk_t {
+  struct string_chunk_t *next;
+  size_t size;
+  size_t used;
+  char chars[];
+} string_chunk;
+
+/**
+ * String table, the node texts of a parse (each text is stored once).
+ */
+typedef struct {
+  string_chunk *chunks;
+  char **slots;    // Open addressing hash table of strings in chunks.
+  size_t nr_of_slots;
+  size_t nr_of_strings;
+} scribble_strtab;
+
+/**
+ * Parser context, all state of a parse (one per thread).
+ */
+typedef struct {
+  st_node *root;   // Tree of the last parse.
+  st_arena *arena; // Nodes of root (owned by root).
+  stackli *parents;
+  char **roles;    // Roles declared by the last parsed protocol.
+  int roles_count;
+  int errors;      // Errors of the last parse, -1 if the input cannot be read.
+  scribble_strtab strings; // Node texts of the last parse.
+} scribble_parser;
+
+void visit_protocol_node(scribble_parser *ctx, pANTLR3_BASE_TREE node);
+void visit_role_decl(scribble_parser *ctx, pANTLR3_BASE_TREE node);
+void visit_inbranch_node(scribble_parser *ctx, pANTLR3_BASE_TREE node);
+void visit_inbranch_branch_node(scribble_parser *ctx, pANTLR3_BASE_TREE node);
+void visit_outbranch_node(scribble_parser *ctx, pANTLR3_BASE_TREE node);
+void visit_outbranch_branch_node(scribble_parser *ctx, pANTLR3_BASE_TREE node);
+void visit_send_node(scribble_parser *ctx, pANTLR3_BASE_TREE node);
+void visit_recv_node(scribble_parser *ctx, pANTLR3_BASE_TREE node);
+void visit_rec_node(scribble_parser *ctx, pANTLR3_BASE_TREE node);
+void visit_node(scribble_parser *ctx, pANTLR3_BASE_TREE node);
+void visit_inwhile_node(scribble_parser *ctx, pANTLR3_BASE_TREE node);
+void visit_outwhile_node(scribble_parser *ctx, pANTLR3_BASE_TREE node);
+
+/**
+ * \brief Create a parser context.
+ *
+ * A context can parse any number of files, one at a time. Different
+ * contexts can be used by different threads at the same time.
+ *
+ * \returns new parser context.
+ */
+scribble_parser *scribble_parser_new();
+
+/**
+ * \brief Parse a Scribble file with a parser context.
+ *
+ * The roles declared in the file are kept in ctx->roles until the next
+ * parse with ctx.
+ *
+ * @param[in,out] ctx      Parser context.
+ * @param[in]     filename Scribble filename.
+ *
+ * \returns parsed st_node (owned by the caller), or NULL on errors
+ *          (see ctx->errors).
+ */
+st_node *scribble_parse(scribble_parser *ctx, const char *filename);
+
+/**
+ * \brief Parse Scribble source in memory with a parser context.
+ *
+ * The source is read in place (not copied), no file is involved.
+ *
+ * @param[in,out] ctx  Parser context.
+ * @param[in]     src  Scribble source (need not be NUL-terminated).
+ * @param[in]     len  Length of src.
+ * @param[in]     name Name of the source in error messages (or NULL).
+ *
+ * \returns parsed st_node (owned by the caller), or NULL on errors
+ *          (see ctx->errors).
+ */
+st_node *scribble_parse_buffer(scribble_parser *ctx, const char *src, size_t len, const char *name);
+
+/**
+ * \brief Free a parser context.
+ *
+ * @param[in] ctx Parser context.
+ */
+void scribble_parser_free(scribble_parser *ctx);
 
 /**
  * \brief Parse the scribble file for a st_node.
  *
+ * Exits if the file cannot be read, see scribble_parse.
+ *
  * @param[in] filename Scribble filename.
  * 
  * \returns parsed st_node.
  */
 st_node *parse(const char *filename);
 
+/**
+ * \brief Parse Scribble source in memory for a st_node.
+ *
+ * @param[in] src Scribble source.
+ * @param[in] len Length of src.
+ *
+ * \returns parsed st_node, or NULL on errors.
+ */
+st_node *parse_buffer(const char *src, size_t len);
+
 int parse_roles(const char *filename, char *roles[]);
 
 void parse_rolename(const char *filename, char **rolename);
 
+/**
+ * A parsed Scribble protocol.
+ */
+typedef struct {
+  char *role_name; // Role of an endpoint protocol, "" if global.
+  char **roles;    // Roles declared by the protocol.
+  int nr_of_roles;
+  st_node *tree;   // NULL if the protocol has errors.
+} scribble_protocol;
+
+/**
+ * \brief Parse a Scribble file once for its role name, roles and tree.
+ *
+ * @param[in] filename Scribble filename.
+ *
+ * \returns parsed protocol (free with free_protocol).
+ */
+scribble_protocol *parse_protocol(const char *filename);
+
+/**
+ * \brief Parse Scribble source in memory once for its role name, roles
+ * and tree, eg. a protocol embedded in the program.
+ *
+ * @param[in] src  Scribble source.
+ * @param[in] len  Length of src.
+ * @param[in] name Name of the source in error messages (or NULL).
+ *
+ * \returns parsed protocol (free with free_protocol).
+ */
+scribble_protocol *parse_protocol_buffer(const char *src, size_t len, const char *name);
+
+/**
+ * \brief Parse a Scribble file, using a cache of parsed protocols.
+ *
+ * The cache file of filename in cache_dir is used if the size, mtime and
+ * content hash of filename still match, otherwise the file is parsed and
+ * the cache file (re)written.
+ *
+ * @param[in] filename  Scribble filename.
+ * @param[in] cache_dir Cache directory (NULL to always parse).
+ *
+ * \returns parsed protocol (free with free_protocol).
+ */
+scribble_protocol *parse_protocol_cached(const char *filename, const char *cache_dir);
+
+/**
+ * \brief Free a parsed protocol and its tree.
+ *
+ * @param[in] protocol Parsed protocol.
+ */
+void free_protocol(scribble_protocol *protocol);
+
 #endif // __PARSER_H__
@@ -7,6 +7,9 @@
  *
  */
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -22,26 +25,110 @@ extern "C" {
 #define INBRANCH_NODE 8
 #define RECUR_NODE    9
 
+/**
+ * Interned string (role, datatype or branchtag), 0 is "".
+ * Equal strings have equal symbols in the whole process.
+ */
+typedef uint32_t st_sym;
+
+#define ST_ANY_DATATYPE "*" // Datatype of untyped messages, matches any datatype.
+#define ST_SYM_ANY 1        // Symbol of ST_ANY_DATATYPE.
+
+typedef struct st_arena_t st_arena; ///< Node allocator (see st_arena_new).
+
 /**
  * A node in the session type flow graph (internal use).
  */
 struct __st_node {
     unsigned type;
-    char role[255]; // XXX 255 chars enough for type name?
-    char datatype[255]; // XXX 255 chars enough for type name?
-    char branchtag[255];
+    st_sym role;      // See st_sym_name.
+    st_sym datatype;
+    st_sym branchtag;
     unsigned next_sz; // Number of elements in next[]
+    unsigned next_cap; // Capacity of next[]
     /* unsigned ref_cnt; */
     struct __st_node **next;
+    st_arena *arena; // Arena of the node, NULL if allocated with malloc.
+    uint64_t hash; // Structural hash, as of the last hash_st_node.
 };
 
 
 typedef struct __st_node st_node; ///< Alias to the struct.
 
 
+/**
+ * \brief Intern a string as a symbol.
+ *
+ * Symbols are never freed, there is one per distinct string.
+ * Thread-safe.
+ *
+ * @param[in] name String to intern.
+ *
+ * \returns symbol of name.
+ */
+st_sym st_sym_intern(const char *name);
+
+
+/**
+ * \brief Get the string of a symbol.
+ *
+ * @param[in] sym Symbol returned by st_sym_intern.
+ *
+ * \returns interned string (never freed).
+ */
+const char *st_sym_name(st_sym sym);
+
+
+/**
+ * \brief Create an arena to allocate the nodes of a tree.
+ *
+ * Nodes and their next[] arrays are carved out of large blocks and freed
+ * all at once. The first node allocated from the arena owns it:
+ * free_st_node on that node frees the arena, on other nodes of the arena
+ * it does nothing.
+ *
+ * \returns new arena.
+ */
+st_arena *st_arena_new();
+
+
+/**
+ * \brief Allocate and initialise a node in an arena.
+ *
+ * @param[in] arena    Arena to allocate from.
+ * @param[in] type     Type of node.
+ * @param[in] role     Target role of node.
+ * @param[in] datatype Datatype of node.
+ *
+ * \returns Initialised node.
+ */
+st_node *st_arena_node(st_arena *arena, unsigned type,
+                       const char *role, const char *datatype);
+
+
+/**
+ * \brief Free all nodes of an arena at once, keeping the arena.
+ *
+ * The next node allocated owns the arena again.
+ *
+ * @param[in] arena Arena to reset.
+ */
+void st_arena_reset(st_arena *arena);
+
+
+/**
+ * \brief Free an arena and all its nodes.
+ *
+ * @param[in] arena Arena to free.
+ */
+void st_arena_free(st_arena *arena);
+
+
 /**
  * \brief Convenient function to initialise session type node.
  *
+ * For nodes allocated with malloc, see st_arena_node for arena nodes.
+ *
  * @param[in] node     Node to initialise.
  * @param[in] type     Type of node.
  * @param[in] role     Target role of node.
@@ -102,6 +189,20 @@ void print_st_node(st_node *node, unsigned indent);
 int compare_st_node(st_node *node, st_node *other);
 
 
+/**
+ * \brief Compute the structural hash of every node of a tree.
+ *
+ * Identical trees (same types, symbols and children) have the same hash.
+ * Hashes are not updated when a tree changes, compare_st_node rehashes
+ * both trees.
+ *
+ * @param[in,out] node Root of tree to hash.
+ *
+ * \returns hash of node.
+ */
+uint64_t hash_st_node(st_node *node);
+
+
 /**
  * \brief Normalise AST tree. 
  *
@@ -0,0 +1,141 @@
+/**
+ * \file
+ * Microbenchmark for the type-checking of REC bodies (compare_st_node).
+ *
+ * Generates pairs of REC bodies with thousands of interactions over a few
+ * channels, where every RECV_NODE of the protocol is overtaken by the
+ * SEND_NODE before it in the code (an allowed asynchronous reordering),
+ * and reports the time to match them with the previous matcher (baseline)
+ * and the current per-channel matcher.
+ *
+ * \headerfile "st_node.h"
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "st_node.h"
+
+#define DEFAULT_INTERACTIONS 8000
+#define NR_OF_CHANNELS 4
+
+int _asyncmsg_compare_st_node(st_node *node, st_node *other);
+
+
+/**
+ * Reference implementation of the previous matcher of REC bodies
+ * (messages only), which searches the whole body for every message.
+ */
+int baseline_asyncmsg_compare(st_node *node, st_node *other)
+{
+  int i, j;
+  int visited[node->next_sz];
+  int search_bound = 0;
+
+  for (i=0; i<node->next_sz; ++i) {
+    visited[i] = 0;
+  }
+
+  for (i=0; i<node->next_sz; ++i) {
+
+    // Search for the last permutable node.
+    search_bound = node->next_sz-1;
+    for (j=i+1; j<node->next_sz; ++j) {
+      if (node->next[j]->type != SEND_NODE && node->next[j]->type != RECV_NODE) {
+        search_bound = j;
+      }
+    }
+
+    for (j=0; j<=search_bound; ++j) {
+      // RECV_NODE may overtake SEND_NODE.
+      if (visited[j] == 0 && other->next[i]->role == node->next[j]->role
+          && (other->next[i]->type != RECV_NODE || node->next[j]->type == RECV_NODE)) {
+        if (node->next[j]->type == other->next[i]->type
+            && node->next[j]->datatype == other->next[i]->datatype
+            && node->next[j]->branchtag == other->next[i]->branchtag
+            && node->next[j]->next_sz == other->next[i]->next_sz) {
+          visited[j] = 1;
+          break;
+        }
+        return 0;
+      }
+      if (j == search_bound) return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+/**
+ * Build a REC body of interactions pairs (one SEND_NODE and one RECV_NODE
+ * per channel), RECV_NODE first if recv_first.
+ */
+st_node *build_rec(st_arena *arena, long interactions, int recv_first)
+{
+  char role[16];
+  long i;
+  st_node *rec = st_arena_node(arena, RECUR_NODE, "", "");
+
+  for (i=0; i<interactions; ++i) {
+    sprintf(role, "R%ld", i % NR_OF_CHANNELS);
+    if (recv_first) {
+      append_st_node(rec, st_arena_node(arena, RECV_NODE, role, "int"));
+      append_st_node(rec, st_arena_node(arena, SEND_NODE, role, "double"));
+    } else {
+      append_st_node(rec, st_arena_node(arena, SEND_NODE, role, "double"));
+      append_st_node(rec, st_arena_node(arena, RECV_NODE, role, "int"));
+    }
+  }
+  return rec;
+}
+
+
+void run(const char *name, int (*compare_fn)(st_node *, st_node *),
+         st_node *code, st_node *protocol)
+{
+  double start, elapsed;
+  int result;
+
+  start = now();
+  result = compare_fn(code, protocol);
+  elapsed = now() - start;
+
+  printf("%-10s %8u nodes %12.3f ms %s\n",
+          name, code->next_sz, elapsed * 1e3, result ? "match" : "NO MATCH");
+}
+
+
+int main(int argc, char *argv[])
+{
+  long interactions = DEFAULT_INTERACTIONS;
+  long size;
+  if (argc > 1) interactions = atol(argv[1]);
+
+  printf("%s: REC bodies of up to %ld interactions over %d channels\n",
+          argv[0], interactions, NR_OF_CHANNELS);
+
+  for (size=interactions/8; size<=interactions; size*=2) {
+    st_arena *arena = st_arena_new();
+    st_node *code = build_rec(arena, size, 0);
+    st_node *protocol = build_rec(arena, size, 1);
+
+    run("baseline", baseline_asyncmsg_compare, code, protocol);
+    run("channels", _asyncmsg_compare_st_node, code, protocol);
+
+    st_arena_free(arena);
+    if (size == 0) break;
+  }
+
+  return EXIT_SUCCESS;
+}
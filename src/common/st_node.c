@@ -7,6 +7,7 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,12 +28,219 @@ const char *node_type[] = {
   "recur",     // 9
 };
 
+#define SYM_PAGE_SIZE 1024 // Symbols per page of the symbol table.
+#define SYM_MAX_PAGES 4096
+#define ARENA_BLOCK_SIZE 65536 // Minimum size of an arena block.
+#define ARENA_ALIGN sizeof(void *)
+
 stackli *stack, *_stack;
 
+/**
+ * Symbol table, shared by all trees of the process.
+ * Names are in pages that never move, so st_sym_name needs no lock.
+ */
+struct {
+  const char **pages[SYM_MAX_PAGES]; // Name of each symbol.
+  st_sym nr_of_syms;
+  st_sym *slots; // Open addressing hash table of symbols, 0 is empty.
+  size_t nr_of_slots;
+} sym_table;
+pthread_mutex_t sym_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Block of an arena.
+ */
+typedef struct st_arena_block_t {
+  struct st_arena_block_t *next;
+  size_t size;
+  size_t used;
+  char *data;
+} st_arena_block;
+
+struct st_arena_t {
+  st_arena_block *blocks; // Current block first.
+  st_node *root; // First node allocated, owns the arena.
+};
+
+/**
+ * Channel (role) of messages in a REC body, see _match_messages_st_node.
+ */
+typedef struct {
+  unsigned gen; // Slot is used if gen is the current generation.
+  st_sym role;
+  int head; // First message (possibly matched), -1 if none.
+  int tail;
+  int recv; // First RECV_NODE not matched, -1 if none.
+} st_channel;
+
 int _asyncmsg_compare_st_node(st_node *node, st_node *other);
 int _compare_st_node(st_node *node, st_node *other);
 
 
+/**
+ * Helper function to hash a symbol name.
+ */
+size_t _sym_hash(const char *name)
+{
+  size_t hash = 5381;
+
+  while (*name) hash = hash * 33 + (unsigned char)*name++;
+  return hash;
+}
+
+
+/**
+ * Helper function to add a name as a new symbol (with sym_table_lock).
+ */
+st_sym _sym_add(const char *name)
+{
+  st_sym sym = sym_table.nr_of_syms;
+  char *copy;
+
+  if (sym / SYM_PAGE_SIZE >= SYM_MAX_PAGES) {
+    fprintf(stderr, "%s: Too many symbols\n", __FUNCTION__);
+    abort();
+  }
+  if (sym_table.pages[sym / SYM_PAGE_SIZE] == NULL) {
+    sym_table.pages[sym / SYM_PAGE_SIZE] = malloc(sizeof(char *) * SYM_PAGE_SIZE);
+  }
+  copy = malloc(strlen(name)+1);
+  strcpy(copy, name);
+  sym_table.pages[sym / SYM_PAGE_SIZE][sym % SYM_PAGE_SIZE] = copy;
+  sym_table.nr_of_syms++;
+  return sym;
+}
+
+
+st_sym st_sym_intern(const char *name)
+{
+  size_t slot_idx, idx, capacity;
+  st_sym sym, *slots;
+
+  if (name[0] == 0) return 0;
+
+  pthread_mutex_lock(&sym_table_lock);
+  if (sym_table.nr_of_syms == 0) { // Reserved symbols.
+    _sym_add("");
+    _sym_add(ST_ANY_DATATYPE);
+  }
+  if (strcmp(name, ST_ANY_DATATYPE) == 0) {
+    pthread_mutex_unlock(&sym_table_lock);
+    return ST_SYM_ANY;
+  }
+
+  if (2 * (sym_table.nr_of_syms + 1) > sym_table.nr_of_slots) { // Grow (and rehash).
+    capacity = sym_table.nr_of_slots == 0 ? 256 : 2 * sym_table.nr_of_slots;
+    slots = calloc(capacity, sizeof(st_sym));
+    for (slot_idx=0; slot_idx<sym_table.nr_of_slots; ++slot_idx) {
+      if ((sym = sym_table.slots[slot_idx]) != 0) {
+        idx = _sym_hash(st_sym_name(sym)) & (capacity-1);
+        while (slots[idx] != 0) idx = (idx+1) & (capacity-1);
+        slots[idx] = sym;
+      }
+    }
+    free(sym_table.slots);
+    sym_table.slots = slots;
+    sym_table.nr_of_slots = capacity;
+  }
+
+  slot_idx = _sym_hash(name) & (sym_table.nr_of_slots-1);
+  while ((sym = sym_table.slots[slot_idx]) != 0) {
+    if (strcmp(st_sym_name(sym), name) == 0) break;
+    slot_idx = (slot_idx+1) & (sym_table.nr_of_slots-1);
+  }
+  if (sym == 0) {
+    sym = _sym_add(name);
+    sym_table.slots[slot_idx] = sym;
+  }
+  pthread_mutex_unlock(&sym_table_lock);
+
+  return sym;
+}
+
+
+const char *st_sym_name(st_sym sym)
+{
+  if (sym == 0) return "";
+  if (sym == ST_SYM_ANY) return ST_ANY_DATATYPE;
+  return sym_table.pages[sym / SYM_PAGE_SIZE][sym % SYM_PAGE_SIZE];
+}
+
+
+st_arena *st_arena_new()
+{
+  st_arena *arena = malloc(sizeof(st_arena));
+
+  arena->blocks = NULL;
+  arena->root = NULL;
+  return arena;
+}
+
+
+/**
+ * Helper function to allocate size bytes in an arena.
+ */
+void *_arena_alloc(st_arena *arena, size_t size)
+{
+  st_arena_block *block = arena->blocks;
+  void *ptr;
+
+  size = (size + ARENA_ALIGN-1) & ~(ARENA_ALIGN-1);
+  if (block == NULL || block->size - block->used < size) {
+    block = malloc(sizeof(st_arena_block));
+    block->size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    block->used = 0;
+    block->data = malloc(block->size);
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+  ptr = block->data + block->used;
+  block->used += size;
+  return ptr;
+}
+
+
+st_node *st_arena_node(st_arena *arena, unsigned type,
+                       const char *role, const char *datatype)
+{
+  st_node *node = _arena_alloc(arena, sizeof(st_node));
+
+  init_st_node(node, type, role, datatype);
+  node->arena = arena;
+  if (arena->root == NULL) arena->root = node;
+  return node;
+}
+
+
+void st_arena_reset(st_arena *arena)
+{
+  st_arena_block *block;
+
+  if (arena->blocks != NULL) { // Keep the current block.
+    while ((block = arena->blocks->next) != NULL) {
+      arena->blocks->next = block->next;
+      free(block->data);
+      free(block);
+    }
+    arena->blocks->used = 0;
+  }
+  arena->root = NULL;
+}
+
+
+void st_arena_free(st_arena *arena)
+{
+  st_arena_block *block;
+
+  while ((block = arena->blocks) != NULL) {
+    arena->blocks = block->next;
+    free(block->data);
+    free(block);
+  }
+  free(arena);
+}
+
+
 /**
  * Sets up node mechanically using given parameters.
  */
@@ -40,33 +248,75 @@ st_node *init_st_node(st_node *node, unsigned type,
                       const char *role, const char *datatype)
 {
   node->type = type;
-  strncpy(node->role, role, 255);
-  strncpy(node->datatype, datatype, 255);
-  node->role[254] = 0;     // cutoff at 255 char
-  node->datatype[254] = 0; // cutoff at 255 char
-  node->branchtag[0] = 0;
+  node->role = st_sym_intern(role);
+  node->datatype = st_sym_intern(datatype);
+  node->branchtag = 0;
   
   node->next_sz = 0;
+  node->next_cap = 0;
+  node->next = NULL;
+  node->arena = NULL;
+  node->hash = 0;
   return node;
 }
 
 
 /**
  * Free the st_node tree by walking the tree and reference counting.
+ * Nodes in an arena are freed with the arena, by freeing its root.
  */
 void free_st_node(st_node *node)
 {
   unsigned i = 0;
 
   if (node) {
+    if (node->arena != NULL) {
+      if (node->arena->root == node) st_arena_free(node->arena);
+      return;
+    }
+
     for (i=0; i<node->next_sz; ++i)
       free_st_node(node->next[i]);
 
+    free(node->next);
     free(node);
   }
 }
 
 
+/**
+ * Helper function to make room for at least next_sz children.
+ * Arena nodes grow next[] in place if it is the last allocation of the
+ * current block, or else move it (the old array is freed with the arena).
+ */
+void _reserve_st_node(st_node *node, unsigned next_sz)
+{
+  unsigned next_cap;
+  st_arena_block *block;
+  st_node **next;
+
+  if (next_sz <= node->next_cap) return;
+  next_cap = node->next_cap == 0 ? 2 : 2 * node->next_cap;
+  if (next_cap < next_sz) next_cap = next_sz;
+
+  if (node->arena == NULL) {
+    node->next = (st_node **)realloc(node->next, next_cap * sizeof(st_node *));
+  } else {
+    block = node->arena->blocks;
+    if (node->next != NULL
+        && (char *)(node->next + node->next_cap) == block->data + block->used
+        && block->size - block->used >= (next_cap - node->next_cap) * sizeof(st_node *)) {
+      block->used += (next_cap - node->next_cap) * sizeof(st_node *);
+    } else {
+      next = _arena_alloc(node->arena, next_cap * sizeof(st_node *));
+      if (node->next_sz > 0) memcpy(next, node->next, node->next_sz * sizeof(st_node *));
+      node->next = next;
+    }
+  }
+  node->next_cap = next_cap;
+}
+
+
 /**
  * Grow the tree by changing the next pointers.
  * If the node already has successors, convert the node to a multi-successor
@@ -74,16 +324,8 @@ void free_st_node(st_node *node)
  */
 st_node *append_st_node(st_node *node, st_node *next)
 {
-  if (node->next_sz <= 0) {
-    node->next_sz = 1;
-    node->next = (st_node **)malloc(sizeof(st_node *));
-  } else {
-    node->next_sz++;
-    node->next = (st_node **)realloc(node->next,
-      node->next_sz * sizeof(st_node *));
-  }
-      
-  node->next[node->next_sz-1] = next;
+  _reserve_st_node(node, node->next_sz+1);
+  node->next[node->next_sz++] = next;
 
   return node; // For chaining
 }
@@ -116,8 +358,8 @@ void print_st_node(st_node *node, unsigned indent)
   if (node) {
     printf(
       "st_node <%p type=%s role=%s datatype=%s tag=%s next_sz=%d>\n",
-      (void *)node, node_type[node->type], node->role,
-      node->datatype, node->branchtag, node->next_sz);
+      (void *)node, node_type[node->type], st_sym_name(node->role),
+      st_sym_name(node->datatype), st_sym_name(node->branchtag), node->next_sz);
 
     for (i=0; i<node->next_sz; ++i)
         print_st_node(node->next[i], indent + 1);
@@ -125,6 +367,71 @@ void print_st_node(st_node *node, unsigned indent)
 }
 
 
+/**
+ * Helper function to mix a word into a hash.
+ */
+uint64_t _hash_mix(uint64_t hash, uint64_t word)
+{
+  hash ^= word + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+  hash ^= hash >> 31;
+  hash *= 0xbf58476d1ce4e5b9ULL;
+  return hash ^ (hash >> 29);
+}
+
+
+uint64_t hash_st_node(st_node *node)
+{
+  uint64_t hash;
+  unsigned i;
+
+  if (node == NULL) return 0;
+
+  hash = _hash_mix(node->type, node->role);
+  hash = _hash_mix(hash, node->datatype);
+  hash = _hash_mix(hash, node->branchtag);
+  hash = _hash_mix(hash, node->next_sz);
+  for (i=0; i<node->next_sz; ++i) {
+    hash = _hash_mix(hash, hash_st_node(node->next[i]));
+  }
+  node->hash = hash;
+  return hash;
+}
+
+
+/**
+ * Helper function to check if two hashed trees are identical (no
+ * reordering of REC children), symbols are compared as words.
+ */
+int _identical_st_node(st_node *node, st_node *other)
+{
+  unsigned i;
+
+  if (node == other) return 1;
+  if (node == NULL || other == NULL
+      || node->hash != other->hash
+      || node->type != other->type
+      || node->role != other->role
+      || node->datatype != other->datatype
+      || node->branchtag != other->branchtag
+      || node->next_sz != other->next_sz) {
+    return 0;
+  }
+  for (i=0; i<node->next_sz; ++i) {
+    if (!_identical_st_node(node->next[i], other->next[i])) return 0;
+  }
+  return 1;
+}
+
+
+/**
+ * Helper function to check if two datatypes match (ST_SYM_ANY matches any).
+ */
+int _same_datatype(st_sym datatype, st_sym other)
+{
+  return datatype == other || datatype == ST_SYM_ANY || other == ST_SYM_ANY;
+}
+
+
 /**
  * Recursive step of compare function.
  */
@@ -138,10 +445,15 @@ int _compare_st_node(st_node *node, st_node *other)
     return 0;
   }
 
+  // Identical subtrees (found by hash, then confirmed) need no search.
+  if (node->hash == other->hash && _identical_st_node(node, other)) {
+    return 1;
+  }
+
   cmp_result = (node->type == other->type
-                && (strcmp(node->role, other->role) == 0)
-                && (strcmp(node->datatype, other->datatype) == 0)
-                && (strcmp(node->branchtag, other->branchtag) == 0)
+                && node->role == other->role
+                && _same_datatype(node->datatype, other->datatype)
+                && node->branchtag == other->branchtag
                 && node->next_sz == other->next_sz);
 
   if (cmp_result) { // Node is identical.
@@ -177,155 +489,166 @@ int _compare_st_node(st_node *node, st_node *other)
 }
 
 
-int _asyncmsg_compare_st_node(st_node *node, st_node *other)
+/**
+ * Helper function to check if a node is a message (SEND_NODE/RECV_NODE).
+ */
+int _is_message_st_node(st_node *node)
 {
-  int i, j;
-  int cmp_result = 0;
-  int visited[node->next_sz];
-
-  assert(node->type == RECUR_NODE && other->type == RECUR_NODE);
-
-  // Set bounds for permuted send/recv nodes search space.
-  int search_bound = 0;
-
-  for (i=0; i<node->next_sz; ++i) {
-    visited[i] = 0;
-  }
-
-  // Run through all nodes once.
-  for (i=0; i<node->next_sz; ++i) {
-    if (node->next[i]->type == SEND_NODE || node->next[i]->type == RECV_NODE) {
-
-      // Search for the last permutable node.
-      search_bound = node->next_sz-1;
-      for (j=i+1; j<node->next_sz; ++j) {
-        if (node->next[j]->type != SEND_NODE && node->next[j]->type != RECV_NODE) {
-          search_bound = j;
-        }
-      }
-
-      // Start node: i, end node: search_bound - 1.
-
-      if (other->next[i]->type == RECV_NODE) {
-
-        //
-        // RECV_NODE may overtake SEND_NODE.
-        //
-
-        for (j=0; j<=search_bound; ++j) {
-
-          // Find next available node in the same channel.
-          if (visited[j] == 0 && strcmp(other->next[i]->role, node->next[j]->role) == 0) {
-
-            // Only look for RECV_NODE.
-            if (node->next[j]->type == RECV_NODE) {
-
-              if (strcmp(node->next[j]->datatype, other->next[i]->datatype) == 0
-                  && (strcmp(node->next[j]->branchtag, other->next[i]->branchtag) == 0)
-                  && node->next[j]->next_sz == other->next[i]->next_sz) {
-
-                // RECV_NODE found.
-                visited[j] = 1;
-                break; // Next node.
-
-              } else {
-
-                // RECV_NODE found but type error.
-                fprintf(stderr, "No matching RECV_NODE for REC child %d\n", i);
-                return 0;
+  return node->type == SEND_NODE || node->type == RECV_NODE;
+}
 
-              }
 
-            } // RECV_NODE
-          } // next node in same channel.
+/**
+ * Helper function to check if two messages of the same channel match.
+ */
+int _same_message_st_node(st_node *node, st_node *other)
+{
+  return node->type == other->type
+         && _same_datatype(node->datatype, other->datatype)
+         && node->branchtag == other->branchtag
+         && node->next_sz == other->next_sz;
+}
 
-          if (j == search_bound) {
-            // No RECV_NODE found.
-            fprintf(stderr, "No RECV_NODE found.\n");
-            return 0;
-          }
 
-        }
+/**
+ * Helper function to find (or add) the channel of role in a channel table.
+ */
+st_channel *_channel_of(st_channel *chans, unsigned nr_of_slots, unsigned gen, st_sym role)
+{
+  unsigned slot_idx = (role * 2654435761u) & (nr_of_slots-1);
 
-      } else { // other->next[i]->type == SEND_NODE
+  while (chans[slot_idx].gen == gen && chans[slot_idx].role != role) {
+    slot_idx = (slot_idx+1) & (nr_of_slots-1);
+  }
+  if (chans[slot_idx].gen != gen) { // New channel.
+    chans[slot_idx].gen = gen;
+    chans[slot_idx].role = role;
+    chans[slot_idx].head = chans[slot_idx].tail = chans[slot_idx].recv = -1;
+  }
+  return &chans[slot_idx];
+}
 
-        //
-        // SEND_NODE must not overtake RECV_NODE.
-        //
 
-        for (j=0; j<=search_bound; ++j) {
+/**
+ * Helper function to match the messages [start, end) of two REC bodies.
+ *
+ * The messages of node are queued by channel (role). Each message of other
+ * takes, in its channel, the first message not matched yet if it is a
+ * SEND_NODE (SEND_NODE must not overtake RECV_NODE), or the first RECV_NODE
+ * not matched yet (RECV_NODE may overtake SEND_NODE). Both cursors only
+ * move forward, so this is linear in end-start.
+ */
+int _match_messages_st_node(st_node *node, st_node *other, unsigned start, unsigned end,
+                            int *chan_next, char *matched,
+                            st_channel *chans, unsigned nr_of_slots, unsigned gen)
+{
+  unsigned i;
+  int j;
+  st_channel *chan;
+
+  // Queue the messages of node by channel.
+  for (i=start; i<end; ++i) {
+    chan = _channel_of(chans, nr_of_slots, gen, node->next[i]->role);
+    chan_next[i] = -1;
+    matched[i] = 0;
+    if (chan->tail < 0) {
+      chan->head = i;
+    } else {
+      chan_next[chan->tail] = i;
+    }
+    chan->tail = i;
+    if (chan->recv < 0 && node->next[i]->type == RECV_NODE) chan->recv = i;
+  }
 
-          // Find next available node in the same channel.
-          if (visited[j] == 0 && strcmp(other->next[i]->role, node->next[j]->role) == 0) {
+  for (i=start; i<end; ++i) {
+    chan = _channel_of(chans, nr_of_slots, gen, other->next[i]->role);
 
-            // Check for identical SEND_NODE.
-            if (node->next[j]->type == SEND_NODE
-                && (strcmp(node->next[j]->datatype, other->next[i]->datatype) == 0)
-                && (strcmp(node->next[j]->branchtag, other->next[i]->branchtag) == 0)
-                && node->next[j]->next_sz == other->next[i]->next_sz) {
+    if (other->next[i]->type == RECV_NODE) {
 
-              // SEND_NODE found.
-              visited[j] = 1;
-              break; // Next node.
+      if ((j = chan->recv) < 0) {
+        fprintf(stderr, "No RECV_NODE found.\n");
+        return 0;
+      }
+      if (!_same_message_st_node(node->next[j], other->next[i])) {
+        fprintf(stderr, "No matching RECV_NODE for REC child %d\n", i);
+        return 0;
+      }
+      matched[j] = 1;
+      do { // Next RECV_NODE of the channel.
+        j = chan_next[j];
+      } while (j >= 0 && node->next[j]->type != RECV_NODE);
+      chan->recv = j;
 
-            } else {
+    } else {
 
-              // SEND_NODE found but type error.
-              fprintf(stderr, "No matching SEND_NODE for REC child %d\n", i);
-              return 0;
+      while (chan->head >= 0 && matched[chan->head]) chan->head = chan_next[chan->head];
+      if ((j = chan->head) < 0) {
+        fprintf(stderr, "No SEND_NODE found.\n");
+        return 0;
+      }
+      if (node->next[j]->type != SEND_NODE
+          || !_same_message_st_node(node->next[j], other->next[i])) {
+        fprintf(stderr, "No matching SEND_NODE for REC child %d\n", i);
+        return 0;
+      }
+      matched[j] = 1;
+      chan->head = chan_next[j];
 
-            }
+    }
+  }
 
-          } // next node in same channel.
+  return 1;
+}
 
-          if (j == search_bound) {
-            // No SEND_NODE found.
-            fprintf(stderr, "No SEND_NODE found.\n");
-            return 0;
-          }
 
-        }
+/**
+ * Compare REC bodies, allowing asynchronous reordering of messages.
+ * Messages are matched per channel within each run of messages, other
+ * nodes are compared in place and are not crossed by reordering.
+ */
+int _asyncmsg_compare_st_node(st_node *node, st_node *other)
+{
+  unsigned start, end, gen = 0;
+  unsigned nr_of_slots = 16;
+  int cmp_result = 1;
+  int *chan_next;
+  char *matched;
+  st_channel *chans;
 
-      } // other->next[i]->type == SEND_NODE | RECV_NODE.
+  assert(node->type == RECUR_NODE && other->type == RECUR_NODE);
+  assert(node->next_sz == other->next_sz);
 
-    } else { // Not SEND_NODE/RECV_NODE.
+  while (nr_of_slots < 2 * node->next_sz) nr_of_slots *= 2;
+  chan_next = malloc(sizeof(int) * (node->next_sz + 1));
+  matched = malloc(sizeof(char) * (node->next_sz + 1));
+  chans = calloc(nr_of_slots, sizeof(st_channel)); // gen 0 is unused.
 
-      // TODO: Make sure other->next[i] and node->next[i] are identical.
+  for (start=0; start<node->next_sz; start=end+1) {
 
-      // Mark for checking later.
-      visited[i] = 2;
+    // Messages [start, end), up to the next other node.
+    for (end=start; end<node->next_sz && _is_message_st_node(node->next[end]); ++end);
 
+    if (end > start
+        && !_match_messages_st_node(node, other, start, end, chan_next, matched,
+                                    chans, nr_of_slots, ++gen)) {
+      cmp_result = 0;
+      break;
     }
-  }
 
+    if (end < node->next_sz) { // 'Normal' type-checking.
+      push(stack, node);
+      push(_stack, other);
 
-  // Passed async message optimisation type-checking.
-  cmp_result = 1;
-
-  // Check non SEND_NODE/RECV_NODE.
-  for (i=0; i<node->next_sz; ++i) {
-    switch (visited[i]) {
-      case 0: // Not visited.
-        fprintf(stderr, "Some nodes are not mark as visited at %d.\n", i);
-        assert(1 /*This can't be correct because node and other have the same next_sz*/);
-        return 0;
-        break;
-
-      case 1: // Visited.
-        break;
-
-      case 2: // Marked for 'normal' type-checking.
-        push(stack, node);
-        push(_stack, other);
-
-        cmp_result &= _compare_st_node(node->next[i], other->next[i]);
+      cmp_result &= _compare_st_node(node->next[end], other->next[end]);
 
-        pop(stack);
-        pop(_stack);
-        break;
+      pop(stack);
+      pop(_stack);
     }
   }
 
+  free(chan_next);
+  free(matched);
+  free(chans);
   return cmp_result;
 }
 
@@ -347,6 +670,10 @@ int compare_st_node(st_node *node, st_node *other)
   // Check if both are root node.
   if (node->type == BEGIN_NODE && other->type == BEGIN_NODE) {
 
+    if (hash_st_node(node) == hash_st_node(other) && _identical_st_node(node, other)) {
+      return 1;
+    }
+
     cmp_result = 1;
     if (node->next_sz == other->next_sz) {
 
@@ -518,9 +845,8 @@ void insert_st_node_at(st_node *node, st_node *newnode, int index)
   assert(index<node->next_sz);
 
   // Allocate new slot.
+  _reserve_st_node(node, node->next_sz+1);
   node->next_sz++;
-  node->next = (st_node **)realloc(node->next,
-                                   node->next_sz * sizeof(st_node *));
 
   // Move elements right.
   for (i=index; i<node->next_sz-1; ++i) {
@@ -542,10 +868,7 @@ void remove_st_node_at(st_node *node, int index)
     node->next[i] = node->next[i+1];
   }
 
-  // Release unused memory.
   node->next_sz--;
-  node->next = (st_node **)realloc(node->next,
-                                   node->next_sz * sizeof(st_node *));
 }
 
 
@@ -591,7 +914,7 @@ int cmp_branchtag(const void *a, const void *b)
 {
   st_node **aa = a;
   st_node **bb = b;
-  return strcmp((*aa)->branchtag, (*bb)->branchtag);
+  return strcmp(st_sym_name((*aa)->branchtag), st_sym_name((*bb)->branchtag));
 }
 
 
@@ -56,7 +56,7 @@ void top(stackli *stack,st_node **stack_node){
 
 
 void _print_st_node(st_node *node){
-  printf("st_node <%p type=%s role=%s datatype=%s tag=%s next_sz=%d >\n",(void *)node, node_type[node->type], node->role, node->datatype, node->branchtag, node->next_sz);
+  printf("st_node <%p type=%s role=%s datatype=%s tag=%s next_sz=%d >\n",(void *)node, node_type[node->type], st_sym_name(node->role), st_sym_name(node->datatype), st_sym_name(node->branchtag), node->next_sz);
 }
 
 //for testing 
@@ -7,10 +7,14 @@
  */
 
 #include <assert.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "connmgr.h"
 #include "parser.h"
@@ -132,6 +136,15 @@ int connmgr_init(conn_rec **conns, host_map **role_hosts,
       }
       cr[conn_idx].port = (port_nr==-1 ? start_port : port_nr+1);
 
+      // Co-located roles do not need the TCP stack.
+      cr[conn_idx].transport = CONN_TCP;
+      for (map_idx=0; map_idx<roles_count; ++map_idx) {
+        if (strcmp(cr[conn_idx].from, rh[map_idx].role) == 0
+            && strcmp(cr[conn_idx].host, rh[map_idx].host) == 0) {
+          cr[conn_idx].transport = CONN_IPC;
+        }
+      }
+
       ++conn_idx;
     }
   }
@@ -139,6 +152,30 @@ int connmgr_init(conn_rec **conns, host_map **role_hosts,
 }
 
 
+const char *connmgr_transport_name(int transport)
+{
+  switch (transport) {
+    case CONN_IPC:    return "ipc";
+    case CONN_INPROC: return "inproc";
+    default:          return "tcp";
+  }
+}
+
+
+/**
+ * Helper function to get a transport from its name, CONN_TCP if unknown.
+ */
+int connmgr_transport_of(const char *name)
+{
+  if (strcmp(name, "ipc") == 0) return CONN_IPC;
+  if (strcmp(name, "inproc") == 0) return CONN_INPROC;
+  if (strcmp(name, "tcp") != 0) {
+    fprintf(stderr, "Warning: Unknown transport %s, using tcp\n", name);
+  }
+  return CONN_TCP;
+}
+
+
 /**
  * Write connection record array to file.
  */
@@ -163,11 +200,12 @@ void connmgr_write(const char *outfile, const conn_rec conns[], int nr_of_conns,
   }
 
   for (conn_idx=0; conn_idx<nr_of_conns; ++conn_idx) {
-    fprintf(out_fp, "%s %s %s %d\n",
+    fprintf(out_fp, "%s %s %s %d %s\n",
               conns[conn_idx].from,
               conns[conn_idx].to,
               conns[conn_idx].host,
-              conns[conn_idx].port);
+              conns[conn_idx].port,
+              connmgr_transport_name(conns[conn_idx].transport));
   }
   if (out_fp != stdout) fclose(out_fp);
 }
@@ -181,6 +219,9 @@ int connmgr_read(const char *infile, conn_rec **conns, host_map **role_hosts, in
   FILE *in_fp;
   int conn_idx, role_idx;
   int nr_of_conns = 0;
+  int nr_of_fields;
+  char line[3*MAX_HOSTNAME_LENGTH+32];
+  char transport[16];
 
   conn_rec *cr;
   host_map *rh;
@@ -206,15 +247,27 @@ int connmgr_read(const char *infile, conn_rec **conns, host_map **role_hosts, in
 #endif
   }
 
-  for (conn_idx=0; conn_idx<nr_of_conns; ++conn_idx) {
+  // Line by line, the transport column is optional.
+  for (conn_idx=0; conn_idx<nr_of_conns && fgets(line, sizeof(line), in_fp) != NULL; ) {
     cr[conn_idx].from = malloc(sizeof(char) * MAX_HOSTNAME_LENGTH);
     cr[conn_idx].to   = malloc(sizeof(char) * MAX_HOSTNAME_LENGTH);
     cr[conn_idx].host = malloc(sizeof(char) * MAX_HOSTNAME_LENGTH);
-    fscanf(in_fp, "%s %s %s %u\n", cr[conn_idx].from, cr[conn_idx].to, cr[conn_idx].host, &cr[conn_idx].port);
+    nr_of_fields = sscanf(line, "%255s %255s %255s %u %15s",
+                            cr[conn_idx].from, cr[conn_idx].to, cr[conn_idx].host,
+                            &cr[conn_idx].port, transport);
+    if (nr_of_fields < 4) { // Blank line (eg. rest of the last role line).
+      free(cr[conn_idx].from);
+      free(cr[conn_idx].to);
+      free(cr[conn_idx].host);
+      continue;
+    }
+    cr[conn_idx].transport = (nr_of_fields == 5 ? connmgr_transport_of(transport) : CONN_TCP);
 #ifdef __DEBUG__
-    fprintf(stderr, "Debug/%s: #%d %s->%s %s:%u\n",
-                      __FUNCTION__, conn_idx, cr[conn_idx].from, cr[conn_idx].to, cr[conn_idx].host, cr[conn_idx].port);
+    fprintf(stderr, "Debug/%s: #%d %s->%s %s:%u (%s)\n",
+                      __FUNCTION__, conn_idx, cr[conn_idx].from, cr[conn_idx].to, cr[conn_idx].host, cr[conn_idx].port,
+                      connmgr_transport_name(cr[conn_idx].transport));
 #endif
+    ++conn_idx;
   }
 
   fclose(in_fp);
@@ -222,3 +275,269 @@ int connmgr_read(const char *infile, conn_rec **conns, host_map **role_hosts, in
   return conn_idx;
 }
 
+
+/**
+ * Helper function to add str to a string table (without duplicates).
+ * \returns Offset of str in the string table.
+ */
+uint32_t connmgr_add_string(char *strings, uint32_t *strings_size, const char *str)
+{
+  uint32_t offset = 0;
+
+  while (offset < *strings_size) {
+    if (strcmp(strings+offset, str) == 0) return offset;
+    offset += strlen(strings+offset) + 1;
+  }
+  strcpy(strings+offset, str);
+  *strings_size += strlen(str) + 1;
+  return offset;
+}
+
+
+/**
+ * Helper function to compare role names of role-host maps, for qsort.
+ */
+int connmgr_compare_roles(const void *a, const void *b)
+{
+  return strcmp(((const host_map *)a)->role, ((const host_map *)b)->role);
+}
+
+
+/**
+ * Helper function to get the index of role in the sorted role-host map.
+ */
+int connmgr_sorted_role(const host_map sorted[], int nr_of_roles, const char *role)
+{
+  host_map key;
+  host_map *found;
+
+  key.role = (char *)role;
+  found = bsearch(&key, sorted, nr_of_roles, sizeof(host_map), connmgr_compare_roles);
+  return found == NULL ? -1 : (int)(found - sorted);
+}
+
+
+/**
+ * Write connection record array to file, binary format.
+ */
+int connmgr_write_binary(const char *outfile, const conn_rec conns[], int nr_of_conns,
+                                              const host_map role_hosts[], int nr_of_roles)
+{
+  FILE *out_fp;
+  int conn_idx, role_idx;
+  size_t max_strings_size = 0;
+  int rc = 0;
+
+  conn_bin_header header;
+  host_map *sorted = malloc(sizeof(host_map) * nr_of_roles);
+  conn_bin_role *roles = malloc(sizeof(conn_bin_role) * nr_of_roles);
+  conn_bin_conn *cb = malloc(sizeof(conn_bin_conn) * (nr_of_conns > 0 ? nr_of_conns : 1));
+  uint32_t *adjacency = malloc(sizeof(uint32_t) * (nr_of_conns > 0 ? 2*nr_of_conns : 1));
+  char *strings;
+
+  for (role_idx=0; role_idx<nr_of_roles; ++role_idx) {
+    max_strings_size += strlen(role_hosts[role_idx].role) + strlen(role_hosts[role_idx].host) + 2;
+  }
+  for (conn_idx=0; conn_idx<nr_of_conns; ++conn_idx) {
+    max_strings_size += strlen(conns[conn_idx].host) + 1;
+  }
+  strings = malloc(max_strings_size + 1);
+
+  header.magic = CONN_BIN_MAGIC;
+  header.version = CONN_BIN_VERSION;
+  header.nr_of_roles = nr_of_roles;
+  header.nr_of_conns = nr_of_conns;
+  header.strings_size = 0;
+
+  // Sorted by name, so a role is found with a binary search.
+  memcpy(sorted, role_hosts, sizeof(host_map) * nr_of_roles);
+  qsort(sorted, nr_of_roles, sizeof(host_map), connmgr_compare_roles);
+  for (role_idx=0; role_idx<nr_of_roles; ++role_idx) {
+    roles[role_idx].role = connmgr_add_string(strings, &header.strings_size, sorted[role_idx].role);
+    roles[role_idx].host = connmgr_add_string(strings, &header.strings_size, sorted[role_idx].host);
+    roles[role_idx].first_conn = 0;
+    roles[role_idx].nr_of_conns = 0;
+  }
+
+  for (conn_idx=0; conn_idx<nr_of_conns; ++conn_idx) {
+    int from = connmgr_sorted_role(sorted, nr_of_roles, conns[conn_idx].from);
+    int to = connmgr_sorted_role(sorted, nr_of_roles, conns[conn_idx].to);
+    if (from < 0 || to < 0) {
+      fprintf(stderr, "%s: Connection %s->%s has unknown role\n",
+                        __FUNCTION__, conns[conn_idx].from, conns[conn_idx].to);
+      rc = -1;
+      goto out;
+    }
+    cb[conn_idx].from = from;
+    cb[conn_idx].to = to;
+    cb[conn_idx].host = connmgr_add_string(strings, &header.strings_size, conns[conn_idx].host);
+    cb[conn_idx].port = conns[conn_idx].port;
+    cb[conn_idx].transport = conns[conn_idx].transport;
+    roles[from].nr_of_conns++;
+    roles[to].nr_of_conns++;
+  }
+
+  // Adjacency index: connections of each role, both directions.
+  for (role_idx=1; role_idx<nr_of_roles; ++role_idx) {
+    roles[role_idx].first_conn = roles[role_idx-1].first_conn + roles[role_idx-1].nr_of_conns;
+    roles[role_idx-1].nr_of_conns = 0;
+  }
+  if (nr_of_roles > 0) roles[nr_of_roles-1].nr_of_conns = 0;
+  for (conn_idx=0; conn_idx<nr_of_conns; ++conn_idx) {
+    adjacency[roles[cb[conn_idx].from].first_conn + roles[cb[conn_idx].from].nr_of_conns++] = conn_idx;
+    adjacency[roles[cb[conn_idx].to].first_conn + roles[cb[conn_idx].to].nr_of_conns++] = conn_idx;
+  }
+
+  if ((out_fp = fopen(outfile, "wb")) == NULL) {
+    perror("fopen(connsfile)");
+    rc = -1;
+    goto out;
+  }
+  if (fwrite(&header, sizeof(header), 1, out_fp) != 1
+      || fwrite(roles, sizeof(conn_bin_role), nr_of_roles, out_fp) != (size_t)nr_of_roles
+      || fwrite(cb, sizeof(conn_bin_conn), nr_of_conns, out_fp) != (size_t)nr_of_conns
+      || fwrite(adjacency, sizeof(uint32_t), 2*nr_of_conns, out_fp) != (size_t)2*nr_of_conns
+      || fwrite(strings, 1, header.strings_size, out_fp) != header.strings_size) {
+    perror("fwrite(connsfile)");
+    rc = -1;
+  }
+  fclose(out_fp);
+
+out:
+  free(sorted);
+  free(roles);
+  free(cb);
+  free(adjacency);
+  free(strings);
+  return rc;
+}
+
+
+/**
+ * Helper function to check the records of a mapped configuration refer
+ * to roles, connections and strings in it.
+ */
+int connmgr_map_valid(const conn_map *map)
+{
+  const conn_bin_header *header = map->header;
+  uint32_t idx;
+
+  for (idx=0; idx<header->nr_of_roles; ++idx) {
+    if (map->roles[idx].role >= header->strings_size
+        || map->roles[idx].host >= header->strings_size
+        || map->roles[idx].first_conn > 2*header->nr_of_conns
+        || map->roles[idx].nr_of_conns > 2*header->nr_of_conns - map->roles[idx].first_conn
+        || map->roles[idx].nr_of_conns > header->nr_of_roles-1) return 0;
+  }
+  for (idx=0; idx<header->nr_of_conns; ++idx) {
+    if (map->conns[idx].from >= header->nr_of_roles
+        || map->conns[idx].to >= header->nr_of_roles
+        || map->conns[idx].host >= header->strings_size) return 0;
+  }
+  for (idx=0; idx<2*header->nr_of_conns; ++idx) {
+    if (map->adjacency[idx] >= header->nr_of_conns) return 0;
+  }
+  return 1;
+}
+
+
+/**
+ * Map binary connection record file into memory.
+ */
+conn_map *connmgr_map(const char *infile)
+{
+  int fd;
+  struct stat st;
+  void *addr;
+  conn_map *map;
+  const conn_bin_header *header;
+  size_t size;
+
+  if ((fd = open(infile, O_RDONLY)) < 0) return NULL;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(conn_bin_header)) {
+    close(fd);
+    return NULL;
+  }
+  addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) return NULL;
+
+  // Validated (see connmgr_map_valid), so lookups need no bounds checks.
+  header = (const conn_bin_header *)addr;
+  size = sizeof(conn_bin_header)
+          + (size_t)header->nr_of_roles * sizeof(conn_bin_role)
+          + (size_t)header->nr_of_conns * sizeof(conn_bin_conn)
+          + (size_t)header->nr_of_conns * 2 * sizeof(uint32_t);
+  if (header->magic != CONN_BIN_MAGIC || header->version != CONN_BIN_VERSION
+      || size + header->strings_size != (size_t)st.st_size
+      || header->strings_size == 0
+      || ((const char *)addr)[st.st_size-1] != 0) {
+    munmap(addr, st.st_size);
+    return NULL;
+  }
+
+  map = malloc(sizeof(conn_map));
+  map->addr = addr;
+  map->size = st.st_size;
+  map->header = header;
+  map->roles = (const conn_bin_role *)(header + 1);
+  map->conns = (const conn_bin_conn *)(map->roles + header->nr_of_roles);
+  map->adjacency = (const uint32_t *)(map->conns + header->nr_of_conns);
+  map->strings = (const char *)addr + size;
+
+  if (connmgr_map_valid(map)) {
+#ifdef __DEBUG__
+    fprintf(stderr, "Debug/%s: %u roles, %u connections\n",
+                      __FUNCTION__, header->nr_of_roles, header->nr_of_conns);
+#endif
+    return map;
+  }
+
+  fprintf(stderr, "%s: Corrupt connection configuration %s\n", __FUNCTION__, infile);
+  connmgr_unmap(map);
+  return NULL;
+}
+
+
+void connmgr_unmap(conn_map *map)
+{
+  munmap(map->addr, map->size);
+  free(map);
+}
+
+
+int connmgr_map_role(const conn_map *map, const char *role)
+{
+  int lo = 0, hi = (int)map->header->nr_of_roles - 1, mid, cmp;
+
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+    cmp = strcmp(role, map->strings + map->roles[mid].role);
+    if (cmp == 0) return mid;
+    if (cmp < 0) {
+      hi = mid - 1;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return -1;
+}
+
+
+int connmgr_map_conns(const conn_map *map, int role_idx, conn_rec **conns)
+{
+  const conn_bin_role *role = &map->roles[role_idx];
+  const conn_bin_conn *cb;
+  int nr_of_conns;
+
+  *conns = malloc(sizeof(conn_rec) * (role->nr_of_conns > 0 ? role->nr_of_conns : 1));
+  for (nr_of_conns=0; nr_of_conns<(int)role->nr_of_conns; ++nr_of_conns) {
+    cb = &map->conns[map->adjacency[role->first_conn + nr_of_conns]];
+    (*conns)[nr_of_conns].from = (char *)map->strings + map->roles[cb->from].role;
+    (*conns)[nr_of_conns].to = (char *)map->strings + map->roles[cb->to].role;
+    (*conns)[nr_of_conns].host = (char *)map->strings + cb->host;
+    (*conns)[nr_of_conns].port = cb->port;
+    (*conns)[nr_of_conns].transport = cb->transport;
+  }
+  return nr_of_conns;
+}
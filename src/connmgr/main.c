@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "connmgr.h"
 
@@ -32,5 +33,15 @@ int main(int argc, char **argv)
 
   conns_count = connmgr_init(&conns, &hosts_roles, roles, roles_count, hosts, hosts_count, 6666);
   connmgr_write(argv[3], conns, conns_count, hosts_roles, roles_count);
+
+  // Binary configuration next to it, mapped by join_session.
+  if (strcmp(argv[3], "-") != 0) {
+    char *bin_file = malloc(strlen(argv[3]) + 5);
+    sprintf(bin_file, "%s.bin", argv[3]);
+    if (connmgr_write_binary(bin_file, conns, conns_count, hosts_roles, roles_count) != 0) {
+      fprintf(stderr, "Cannot write binary connection configuration %s\n", bin_file);
+    }
+    free(bin_file);
+  }
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,113 @@
+/**
+ * \file
+ * Microbenchmark for scalar send path of libsess.
+ *
+ * Runs the AsyncMsg ping-pong pattern (send_int then recv_int) over an
+ * inproc ZMQ_PAIR channel and reports messages/sec and heap allocations
+ * per message, for the previous malloc-per-message send path (baseline)
+ * and the current send_int.
+ *
+ * Allocations are counted by linking with -Wl,--wrap=malloc, which only
+ * intercepts calls made from statically linked code (ie. libsess and this
+ * file), not from libzmq itself.
+ *
+ * \headerfile <libsess.h>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <zmq.h>
+
+#include <libsess.h>
+
+#define DEFAULT_ITERATIONS 1000000
+
+static unsigned long malloc_count = 0;
+
+void *__real_malloc(size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+  malloc_count++;
+  return __real_malloc(size);
+}
+
+
+void baseline_dealloc(void *data, void *hint)
+{
+  free(data);
+}
+
+
+/**
+ * Reference implementation of the previous send_int,
+ * which allocates a heap buffer for every message.
+ */
+int baseline_send_int(role *r, int val)
+{
+  int rc = 0;
+  zmq_msg_t msg;
+
+  int *buf = malloc(sizeof(int));
+  memcpy(buf, &val, sizeof(int));
+
+  zmq_msg_init_data(&msg, buf, sizeof(int), baseline_dealloc, NULL);
+  rc = zmq_send(r, &msg, 0);
+  zmq_msg_close(&msg);
+
+  return rc;
+}
+
+
+double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+void run(const char *name, int (*send_fn)(role *, int),
+         role *Alice, role *Bob, long iterations)
+{
+  long i;
+  int val;
+  double start, elapsed;
+  unsigned long mallocs;
+
+  malloc_count = 0;
+  start = now();
+  for (i=0; i<iterations; ++i) {
+    send_fn(Alice, (int)i);
+    recv_int(Bob, &val);
+  }
+  elapsed = now() - start;
+  mallocs = malloc_count;
+
+  printf("%-10s %12.0f msgs/sec %8.3f allocs/msg\n",
+          name, iterations / elapsed, (double)mallocs / iterations);
+}
+
+
+int main(int argc, char *argv[])
+{
+  long iterations = DEFAULT_ITERATIONS;
+  if (argc > 1) iterations = atol(argv[1]);
+
+  void *ctx = zmq_init(1);
+  role *Bob = sess_server(ctx, ZMQ_PAIR, "inproc://bench_send", "");
+  role *Alice = sess_client(ctx, ZMQ_PAIR, "inproc://bench_send", "");
+
+  printf("%s: %ld iterations of send_int/recv_int\n", argv[0], iterations);
+  run("baseline", baseline_send_int, Alice, Bob, iterations);
+  run("send_int", send_int, Alice, Bob, iterations);
+
+  zmq_close(Alice);
+  zmq_close(Bob);
+  zmq_term(ctx);
+
+  return EXIT_SUCCESS;
+}
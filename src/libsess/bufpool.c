@@ -0,0 +1,184 @@
+/**
+ * \file
+ * Size-classed message buffer pool of libsess.
+ *
+ * Each size class has two free lists: a shared list that any thread can
+ * push released buffers to with a compare-and-swap, and a local list only
+ * used by the allocating (owner) thread. The owner takes over the whole
+ * shared list with an atomic exchange when its local list runs empty, so
+ * no list is ever popped concurrently and there is no ABA problem.
+ *
+ * \headerfile "bufpool.h"
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bufpool.h"
+
+// Header in front of every buffer, 32 bytes to keep the payload aligned.
+typedef struct bufpool_block {
+  struct bufpool_block *next; // Free list link
+  bufpool *pool;              // Owning pool
+  size_t size;                // Usable size of the block
+  int size_class;             // Index of size class, -1 if oversized
+} bufpool_block;
+
+struct bufpool {
+  bufpool_block *shared[BUFPOOL_NR_OF_CLASSES]; // Pushed by any thread
+  bufpool_block *local[BUFPOOL_NR_OF_CLASSES];  // Owner thread only
+  volatile long refs; // Blocks handed out + 1 for the owner
+  volatile unsigned long allocs;
+  volatile unsigned long hits;
+  volatile size_t bytes_in_use;
+  volatile size_t peak_bytes;
+};
+
+
+/**
+ * Find the smallest size class that fits size, -1 if none.
+ */
+int _bufpool_size_class(size_t size)
+{
+  int size_class;
+  size_t class_size = BUFPOOL_MIN_SIZE;
+
+  for (size_class=0; size_class<BUFPOOL_NR_OF_CLASSES; ++size_class) {
+    if (size <= class_size) return size_class;
+    class_size <<= 2;
+  }
+  return -1;
+}
+
+
+/**
+ * Free all blocks in a free list.
+ */
+void _bufpool_free_list(bufpool_block *block)
+{
+  bufpool_block *next;
+  while (block != NULL) {
+    next = block->next;
+    free(block);
+    block = next;
+  }
+}
+
+
+/**
+ * Drop a reference to the pool, and free it with the last one.
+ */
+void _bufpool_unref(bufpool *pool)
+{
+  int size_class;
+
+  if (__sync_sub_and_fetch(&pool->refs, 1) == 0) {
+    for (size_class=0; size_class<BUFPOOL_NR_OF_CLASSES; ++size_class) {
+      _bufpool_free_list(pool->shared[size_class]);
+      _bufpool_free_list(pool->local[size_class]);
+    }
+    free(pool);
+  }
+}
+
+
+bufpool *bufpool_new()
+{
+  bufpool *pool = (bufpool *)malloc(sizeof(bufpool));
+  if (pool == NULL) return NULL;
+
+  memset(pool, 0, sizeof(bufpool));
+  pool->refs = 1;
+
+  return pool;
+}
+
+
+void bufpool_free(bufpool *pool)
+{
+  int size_class;
+
+  if (pool == NULL) return;
+
+#ifdef __DEBUG__
+  fprintf(stderr, "%s: pool <%p> allocs=%lu hits=%lu peak=%zu bytes\n",
+                    __FUNCTION__, pool, pool->allocs, pool->hits, pool->peak_bytes);
+#endif
+
+  // Cached blocks can go now, blocks in flight go when released.
+  for (size_class=0; size_class<BUFPOOL_NR_OF_CLASSES; ++size_class) {
+    _bufpool_free_list(pool->local[size_class]);
+    pool->local[size_class] = NULL;
+  }
+  _bufpool_unref(pool);
+}
+
+
+void *bufpool_alloc(bufpool *pool, size_t size)
+{
+  bufpool_block *block = NULL;
+  size_t in_use, peak;
+  int size_class = _bufpool_size_class(size);
+
+  __sync_fetch_and_add(&pool->allocs, 1);
+
+  if (size_class >= 0) {
+    if (pool->local[size_class] == NULL) {
+      pool->local[size_class]
+        = __sync_lock_test_and_set(&pool->shared[size_class], NULL);
+    }
+    block = pool->local[size_class];
+    if (block != NULL) {
+      pool->local[size_class] = block->next;
+      __sync_fetch_and_add(&pool->hits, 1);
+    }
+  }
+
+  if (block == NULL) {
+    size_t block_size = size_class >= 0 ? (size_t)BUFPOOL_MIN_SIZE << (2*size_class) : size;
+    block = (bufpool_block *)malloc(sizeof(bufpool_block) + block_size);
+    if (block == NULL) return NULL;
+    block->pool = pool;
+    block->size = block_size;
+    block->size_class = size_class;
+  }
+
+  __sync_fetch_and_add(&pool->refs, 1);
+  in_use = __sync_add_and_fetch(&pool->bytes_in_use, block->size);
+  while ((peak = pool->peak_bytes) < in_use) {
+    __sync_bool_compare_and_swap(&pool->peak_bytes, peak, in_use);
+  }
+
+  return block + 1;
+}
+
+
+void bufpool_release(void *data)
+{
+  bufpool_block *block = (bufpool_block *)data - 1;
+  bufpool_block *head;
+  bufpool *pool = block->pool;
+
+  __sync_fetch_and_sub(&pool->bytes_in_use, block->size);
+
+  if (block->size_class < 0) {
+    free(block);
+  } else {
+    do {
+      head = pool->shared[block->size_class];
+      block->next = head;
+    } while (!__sync_bool_compare_and_swap(&pool->shared[block->size_class], head, block));
+  }
+
+  _bufpool_unref(pool);
+}
+
+
+void bufpool_get_stats(const bufpool *pool, bufpool_stats *stats)
+{
+  stats->allocs       = pool->allocs;
+  stats->hits         = pool->hits;
+  stats->bytes_in_use = pool->bytes_in_use;
+  stats->peak_bytes   = pool->peak_bytes;
+}
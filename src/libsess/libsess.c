@@ -9,298 +9,3672 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include <zmq.h>
 
 #include <libsess.h>
 
+#include "bufpool.h"
 #include "connmgr.h"
 #include "parser.h"
 #include "st_node.h"
 
 #define OUTWHILE_SYNC_MAGIC 0x42
+#define START_TIMEOUT 30000 // Default timeout of the startup barrier (ms).
+#define END_TIMEOUT 5000 // Default of session.end_timeout (ms).
+#define MAX_MULTICAST_ROLES 255 // Same as size of session.all_roles.
+
+#define CTRL_COND 'C' // Header frame: loop condition of the message after it.
+#define CTRL_BATCH 'B' // Header frame: the message after it is a batch.
+#define CTRL_END 'E' // Header frame: the sender has ended the session.
+#define CTRL_HELLO 'H' // Header frame: the sender (role name after it) has joined.
+
+#define BATCH_ALIGN 8 // Alignment of messages in a batch.
+#define BATCH_SLICE_HEADER 8 // Size (uint32_t) and padding.
+#define BATCH_PAD(size) (((size) + BATCH_ALIGN-1) & ~(size_t)(BATCH_ALIGN-1))
+
+#define ENDPOINT_TABLE_MIN_SIZE 64 // Power of 2.
+#define ENDPOINT_SLOT_DELETED ((role *)-1)
+
+// Socket-to-endpoint map, for primitives which are only given a role.
+// Lookups are lock-free, updates are serialised by endpoint_table_lock.
+typedef struct {
+  role *r; // Read and written atomically.
+  endpoint_t *endpoint;
+} endpoint_slot;
+
+typedef struct endpoint_table_t {
+  unsigned size; // Power of 2.
+  unsigned nr_of_used; // Slots with an endpoint.
+  unsigned nr_of_deleted; // Slots with ENDPOINT_SLOT_DELETED.
+  struct endpoint_table_t *retired; // Smaller tables replaced by this one.
+  endpoint_slot slots[];
+} endpoint_table_t;
+
+endpoint_table_t *endpoint_table = NULL; // Read and written atomically.
+unsigned endpoint_table_seq = 0; // Odd while a table is rehashed in place.
+pthread_mutex_t endpoint_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Process-wide runtime, one ZeroMQ context shared by all sessions.
+struct {
+  void *ctx;
+  int io_threads;
+  unsigned nr_of_sessions;
+  int atexit_registered;
+  unsigned nr_of_inproc_conns; // Keeps inproc:// addresses unique.
+} runtime;
+pthread_mutex_t runtime_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Request of a non-blocking send or receive, queued on its endpoint.
+struct sess_req_t {
+  int done;
+  int rc;
+  endpoint_t *endpoint; // NULL if completed at once (role outside a session).
+  zmq_msg_t msg; // Message of a queued send.
+  void *dst; // Destination of a receive.
+  size_t elem_size;
+  size_t *length; // Array length of a receive, NULL for scalars.
+  void *hint; // Pool the request was allocated from (see _dealloc).
+  struct sess_req_t *next; // Next request of the endpoint.
+};
+
 
 /**
  * \brief Helper function to deallocate send queue.
  *
+ * hint is the buffer pool data was allocated from, or NULL for malloc.
  */
 void _dealloc(void *data, void *hint)
 {
-  free(data);
+  if (hint != NULL) {
+    bufpool_release(data);
+  } else {
+    free(data);
+  }
+}
+
+
+unsigned _endpoint_hash(const role *r, unsigned size)
+{
+  return (unsigned)(((uintptr_t)r >> 4) * 2654435761u) & (size-1);
 }
 
 
 /**
- * Helper function to lookup a role in a session.
+ * Helper function to add an endpoint to a table with a free slot
+ * (with endpoint_table_lock).
  */
-role *find_role_in_session(session *s, char *role_name)
+void _insert_endpoint(endpoint_table_t *table, endpoint_t *endpoint)
 {
-  int i;
-  for (i=0; i<s->endpoints_count; ++i) {
-    if (strcmp(s->endpoints[i]->role_name, role_name) == 0) {
-      return s->endpoints[i]->role_ptr;
-    }
-  }
+  unsigned slot_idx = _endpoint_hash(endpoint->role_ptr, table->size);
 
-  fprintf(stderr, "%s: Role %s not found in session.\n",
-                    __FUNCTION__, role_name);
-#ifdef __DEBUG__
-  dump_session(s);
-#endif
-  return NULL;
+  while (table->slots[slot_idx].r != NULL
+         && table->slots[slot_idx].r != ENDPOINT_SLOT_DELETED) {
+    slot_idx = (slot_idx+1) & (table->size-1);
+  }
+  if (table->slots[slot_idx].r == ENDPOINT_SLOT_DELETED) table->nr_of_deleted--;
+  __atomic_store_n(&table->slots[slot_idx].endpoint, endpoint, __ATOMIC_RELAXED);
+  __atomic_store_n(&table->slots[slot_idx].r, endpoint->role_ptr, __ATOMIC_RELEASE);
+  table->nr_of_used++;
 }
 
 
 /**
- * Session initiation, involves three steps:
- *  (1) Load configuration from filesystem supplied as command line argument
- *  (2) Load endpoint scribble and extract relevant configuration
- *  (3) Create a session variable with connected endpoints
+ * Helper function to make room for one more endpoint, keeping the table
+ * at most half full of endpoints and deleted slots (with endpoint_table_lock).
+ *
+ * A table mostly of deleted slots is rehashed in place (lookups retry
+ * meanwhile, see endpoint_table_seq). Otherwise the table is replaced by
+ * a larger one. Replaced tables are kept, as lookups may still read them,
+ * but they are smaller than the current table put together.
  */
-void join_session(int *argc, char ***argv, session **s, const char *scribble)
+void _reserve_endpoint_table()
 {
-  conn_rec *conns; // Array of connection records
-  host_map *role_hosts; // Role-to-host mapping
-  int nr_of_conns; // Number of connections
-  int nr_of_roles; // Number of roles
+  endpoint_table_t *table = endpoint_table, *new_table;
+  endpoint_t **endpoints;
+  unsigned size, slot_idx, nr_of_endpoints = 0;
 
-  int conn_idx;
-  int endpoint_idx; 
+  if (table != NULL && 2 * (table->nr_of_used + table->nr_of_deleted + 1) <= table->size) return;
 
-  int option;
-  char *config_file = NULL;
+  if (table != NULL && 4 * (table->nr_of_used + 1) <= table->size) {
+    endpoints = malloc(sizeof(endpoint_t *) * table->nr_of_used);
+    for (slot_idx=0; slot_idx<table->size; ++slot_idx) {
+      if (table->slots[slot_idx].r != NULL && table->slots[slot_idx].r != ENDPOINT_SLOT_DELETED) {
+        endpoints[nr_of_endpoints++] = table->slots[slot_idx].endpoint;
+      }
+    }
+    __atomic_store_n(&endpoint_table_seq, endpoint_table_seq+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (slot_idx=0; slot_idx<table->size; ++slot_idx) {
+      __atomic_store_n(&table->slots[slot_idx].r, NULL, __ATOMIC_RELAXED);
+    }
+    table->nr_of_used = table->nr_of_deleted = 0;
+    while (nr_of_endpoints > 0) _insert_endpoint(table, endpoints[--nr_of_endpoints]);
+    __atomic_store_n(&endpoint_table_seq, endpoint_table_seq+1, __ATOMIC_RELEASE);
+    free(endpoints);
+    return;
+  }
 
-  // Invoke getopt to extract arguments we need
-  while (1) {
-    static struct option long_options[] = {
-      {"conf", required_argument, 0, 'c'},
-      {0, 0, 0, 0}
-    };
+  size = table == NULL ? ENDPOINT_TABLE_MIN_SIZE : 2 * table->size;
+  new_table = calloc(1, sizeof(endpoint_table_t) + sizeof(endpoint_slot) * size);
+  new_table->size = size;
+  new_table->retired = table;
+  if (table != NULL) {
+    for (slot_idx=0; slot_idx<table->size; ++slot_idx) {
+      if (table->slots[slot_idx].r != NULL && table->slots[slot_idx].r != ENDPOINT_SLOT_DELETED) {
+        _insert_endpoint(new_table, table->slots[slot_idx].endpoint);
+      }
+    }
+  }
+  __atomic_store_n(&endpoint_table, new_table, __ATOMIC_RELEASE);
+}
 
-    int option_idx = 0;
-    option = getopt_long(*argc, *argv, "c:", long_options, &option_idx);
 
-    if (option == -1) break;
+/**
+ * Helper function to make an endpoint findable by its role pointer.
+ */
+void _register_endpoint(endpoint_t *endpoint)
+{
+  pthread_mutex_lock(&endpoint_table_lock);
+  _reserve_endpoint_table();
+  _insert_endpoint(endpoint_table, endpoint);
+  pthread_mutex_unlock(&endpoint_table_lock);
+}
 
-    switch (option) {
-      case 'c':
-        config_file = malloc(sizeof(char) * (strlen(optarg)+1));
-        strcpy(config_file, optarg);
-        fprintf(stderr, "Using configuration file %s\n", config_file);
+
+void _unregister_endpoint(endpoint_t *endpoint)
+{
+  endpoint_table_t *table;
+  unsigned slot_idx;
+
+  pthread_mutex_lock(&endpoint_table_lock);
+  if ((table = endpoint_table) != NULL) {
+    slot_idx = _endpoint_hash(endpoint->role_ptr, table->size);
+    while (table->slots[slot_idx].r != NULL) {
+      if (table->slots[slot_idx].r == endpoint->role_ptr) {
+        __atomic_store_n(&table->slots[slot_idx].r, ENDPOINT_SLOT_DELETED, __ATOMIC_RELAXED);
+        __atomic_store_n(&table->slots[slot_idx].endpoint, NULL, __ATOMIC_RELAXED);
+        table->nr_of_used--;
+        table->nr_of_deleted++;
         break;
+      }
+      slot_idx = (slot_idx+1) & (table->size-1);
     }
   }
+  pthread_mutex_unlock(&endpoint_table_lock);
+}
 
-  *argc -= optind;
-  *argv += optind;
 
-  if (config_file == NULL) {
-    config_file = malloc(sizeof(char) * 10);
-    config_file = "conn.conf"; // Default config file
+/**
+ * Helper function to lookup the endpoint of a role.
+ *
+ * \returns endpoint of r, or NULL if r was not created by join_session.
+ */
+endpoint_t *_endpoint_of(const role *r)
+{
+  endpoint_table_t *table;
+  endpoint_t *endpoint;
+  unsigned seq, i, slot_idx;
+  role *key;
+
+  do {
+    seq = __atomic_load_n(&endpoint_table_seq, __ATOMIC_ACQUIRE);
+    endpoint = NULL;
+    table = __atomic_load_n(&endpoint_table, __ATOMIC_ACQUIRE);
+    if (table != NULL && (seq & 1) == 0) {
+      slot_idx = _endpoint_hash(r, table->size);
+      for (i=0; i<table->size; ++i, slot_idx=(slot_idx+1)&(table->size-1)) {
+        key = __atomic_load_n(&table->slots[slot_idx].r, __ATOMIC_ACQUIRE);
+        if (key == r) {
+          endpoint = __atomic_load_n(&table->slots[slot_idx].endpoint, __ATOMIC_RELAXED);
+          break;
+        }
+        if (key == NULL) break;
+      }
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((seq & 1) != 0 || seq != __atomic_load_n(&endpoint_table_seq, __ATOMIC_RELAXED));
+
+  return endpoint;
+}
+
+
+/**
+ * \brief Helper function to allocate a send buffer.
+ *
+ * Uses the buffer pool of the session of r if there is one.
+ * The buffer is released by _dealloc(buf, *hint).
+ */
+void *_send_alloc(role *r, size_t size, void **hint)
+{
+  endpoint_t *endpoint = _endpoint_of(r);
+
+  if (endpoint != NULL && endpoint->sess->pool != NULL) {
+    *hint = endpoint->sess->pool;
+    return bufpool_alloc(endpoint->sess->pool, size);
   }
 
-  *s = (session *)malloc(sizeof(session));
-  session *sess = *s; // Alias
+  *hint = NULL;
+  return malloc(size);
+}
 
-  nr_of_conns = connmgr_read(config_file, &conns, &role_hosts, &nr_of_roles);
 
-  // Extract role_name from Scribble
-  char *role_name;
-  parse_rolename(scribble, &role_name);
-  sess->all_roles_count = parse_roles(scribble, sess->all_roles);
+/**
+ * \brief Helper function to send the loop condition pending on an endpoint.
+ *
+ * The condition is the header frame of a multipart message, the caller
+ * must send the message it travels with right after.
+ */
+int _send_cond_header(endpoint_t *endpoint, int flags)
+{
+  int rc = 0;
+  zmq_msg_t header;
 
-  sess->endpoints = malloc(sizeof(endpoint_t *) * (nr_of_roles-1));
+  zmq_msg_init_size(&header, 1 + sizeof(int));
+  *(char *)zmq_msg_data(&header) = CTRL_COND;
+  memcpy((char *)zmq_msg_data(&header) + 1, &endpoint->cond, sizeof(int));
+  rc = zmq_send(endpoint->role_ptr, &header, flags | ZMQ_SNDMORE);
+  zmq_msg_close(&header);
 
-  sess->ctx = zmq_init(1);
+  if (rc == 0) {
+    endpoint->cond_pending = 0;
+    endpoint->sess->nr_of_pending_conds--;
+  }
 
-  for (endpoint_idx=0, conn_idx=0; conn_idx<nr_of_conns; ++conn_idx) {
-    if (strcmp(conns[conn_idx].from, role_name) == 0) { // As a client.
-      sess->endpoints[endpoint_idx] = malloc(sizeof(endpoint_t));
-      sess->endpoints[endpoint_idx]->role_name
-          = malloc(sizeof(char) * (strlen(conns[conn_idx].to)+1));
-      strcpy(sess->endpoints[endpoint_idx]->role_name, conns[conn_idx].to);
+  return rc;
+}
 
-      sprintf(sess->endpoints[endpoint_idx]->uri,
-                "tcp://%s:%u",
-                conns[conn_idx].host,
-                conns[conn_idx].port);
-#ifdef __DEBUG__
-      fprintf(stderr, "Connection (as client) %s -> %s is %s\n",
-                        conns[conn_idx].from,
-                        conns[conn_idx].to,
-                        sess->endpoints[endpoint_idx]->uri);
-#endif
-      if ((sess->endpoints[endpoint_idx]->role_ptr = zmq_socket(sess->ctx, ZMQ_PAIR)) == NULL) {
-        perror("zmq_socket");
-      }
-      if (zmq_connect(sess->endpoints[endpoint_idx]->role_ptr, sess->endpoints[endpoint_idx]->uri) != 0) {
-        perror("zmq_connect");
-      }
-      sess->endpoints_count++;
-      endpoint_idx++;
-    }
 
-    if (strcmp(conns[conn_idx].to, role_name) == 0) { // As a server.
-      sess->endpoints[endpoint_idx] = malloc(sizeof(endpoint_t));
-      sess->endpoints[endpoint_idx]->role_name
-          = malloc(sizeof(char) * (strlen(conns[conn_idx].from)+1));
-      strcpy(sess->endpoints[endpoint_idx]->role_name, conns[conn_idx].from);
+uint64_t _now_usecs()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
-      sprintf(sess->endpoints[endpoint_idx]->uri, "tcp://*:%u",conns[conn_idx].port);
-#ifdef __DEBUG__
-      fprintf(stderr, "Connection (as server) %s -> %s is %s\n", conns[conn_idx].from, conns[conn_idx].to, sess->endpoints[endpoint_idx]->uri);
-#endif
-      if ((sess->endpoints[endpoint_idx]->role_ptr = zmq_socket(sess->ctx, ZMQ_PAIR)) == NULL) {
-        perror("zmq_socket");
-      }
-      if (zmq_bind(sess->endpoints[endpoint_idx]->role_ptr, sess->endpoints[endpoint_idx]->uri) != 0) {
-        perror("zmq_bind");
-      }
-      sess->endpoints_count++;
-      endpoint_idx++;
+
+/**
+ * \brief Helper function to add a message to the batch of an endpoint.
+ *
+ * Each slice is its size followed by the data, padded so that every slice
+ * starts BATCH_ALIGN aligned in the buffer.
+ */
+int _batch_append(endpoint_t *endpoint, zmq_msg_t *msg)
+{
+  uint32_t size = zmq_msg_size(msg);
+  size_t slice_size = BATCH_SLICE_HEADER + BATCH_PAD(size);
+  char *slice;
+
+  if (endpoint->batch_used + slice_size > endpoint->batch_limit + BATCH_SLICE_HEADER + BATCH_ALIGN) {
+    if (sess_flush(endpoint->role_ptr) != 0) return -1;
+  }
+  if (endpoint->batch == NULL) {
+    endpoint->batch = _send_alloc(endpoint->role_ptr,
+                                  endpoint->batch_limit + BATCH_SLICE_HEADER + BATCH_ALIGN,
+                                  &endpoint->batch_hint);
+    endpoint->batch_start = _now_usecs();
+    endpoint->sess->nr_of_pending_batches++;
+  }
+
+  slice = (char *)endpoint->batch + endpoint->batch_used;
+  memcpy(slice, &size, sizeof(uint32_t));
+  memcpy(slice + BATCH_SLICE_HEADER, zmq_msg_data(msg), size);
+  endpoint->batch_used += slice_size;
+
+  if (endpoint->batch_used >= endpoint->batch_limit
+      || (endpoint->batch_usecs > 0
+          && _now_usecs() - endpoint->batch_start >= endpoint->batch_usecs)) {
+    return sess_flush(endpoint->role_ptr);
+  }
+  return 0;
+}
+
+
+/**
+ * \brief Helper function to send a message ahead of queued isends.
+ *
+ * Small messages to a batching endpoint are collected, and a loop
+ * condition pending on r travels in the same ZeroMQ message as the data.
+ */
+int _send_now(endpoint_t *endpoint, role *r, zmq_msg_t *msg, int flags)
+{
+  if (endpoint != NULL && endpoint->batch_limit > 0) {
+    if (zmq_msg_size(msg) < endpoint->batch_limit) {
+      return _batch_append(endpoint, msg);
     }
+    if (endpoint->batch != NULL && sess_flush(r) != 0) return -1; // Keep order.
   }
 
-  sess->get_role = &find_role_in_session;
+  if (endpoint != NULL && endpoint->cond_pending) {
+    if (_send_cond_header(endpoint, flags) != 0) return -1;
+    flags &= ~ZMQ_NOBLOCK; // Complete the multipart message.
+  }
 
-  // TODO Implicit barrier synchronisation here.
-#ifdef __DEBUG__
-  fprintf(stderr, "Created session <%p> with %u endpoints\n", *s, (*s)->endpoints_count);
-#endif
+  return zmq_send(r, msg, flags);
 }
 
 
 /**
- * Dump the content of a session in a human readable form for debugging.
+ * \brief Helper function to send the queued isends of an endpoint.
+ *
+ * Stops at the first send that would block if flags has ZMQ_NOBLOCK.
  */
-void dump_session(const session *s)
+int _progress_sends(endpoint_t *endpoint, int flags)
+{
+  sess_req *req;
+
+  while ((req = endpoint->sends) != NULL) {
+    req->rc = _send_now(endpoint, endpoint->role_ptr, &req->msg, flags);
+    if (req->rc != 0 && errno == EAGAIN) return 0;
+
+    endpoint->sends = req->next;
+    zmq_msg_close(&req->msg);
+    req->done = 1;
+    endpoint->sess->nr_of_pending_reqs--;
+  }
+
+  return 0;
+}
+
+
+/**
+ * \brief Helper function to send a message.
+ *
+ * All sends go through here. Queued isends to r are sent first, so
+ * messages leave in the order they were posted.
+ */
+int _send_msg(role *r, zmq_msg_t *msg, int flags)
+{
+  endpoint_t *endpoint = _endpoint_of(r);
+
+  if (endpoint != NULL && endpoint->sends != NULL) {
+    _progress_sends(endpoint, 0);
+  }
+
+  return _send_now(endpoint, r, msg, flags);
+}
+
+
+/**
+ * Helper function to send the batches and the pending loop conditions of
+ * a session, before this role blocks on a peer that may be waiting for them.
+ */
+void _flush_session(session *s)
 {
   unsigned endpoint_idx;
-  printf("---- Dumping session <%p> ---- \n", s);
-  printf("Number of endpoints: %u\n", s->endpoints_count);
+  endpoint_t *endpoint;
+  zmq_msg_t msg;
+
+  if (s->nr_of_pending_batches == 0 && s->nr_of_pending_conds == 0) return;
+
   for (endpoint_idx=0; endpoint_idx<s->endpoints_count; ++endpoint_idx) {
-    printf("Endpoint %d { role_name: %s, role_ptr: <%p>, uri: %s }\n",
-              endpoint_idx,
-              s->endpoints[endpoint_idx]->role_name,
-              s->endpoints[endpoint_idx]->role_ptr,
-              s->endpoints[endpoint_idx]->uri
-    );
+    endpoint = s->endpoints[endpoint_idx];
+    if (endpoint->batch != NULL && sess_flush(endpoint->role_ptr) != 0) {
+      perror("sess_flush");
+    }
+    if (!endpoint->cond_pending) continue;
+
+    endpoint->cond_pending = 0;
+    s->nr_of_pending_conds--;
+    zmq_msg_init_size(&msg, sizeof(int));
+    memcpy(zmq_msg_data(&msg), &endpoint->cond, sizeof(int));
+    if (zmq_send(endpoint->role_ptr, &msg, 0) != 0) {
+      perror("zmq_send");
+    }
+    zmq_msg_close(&msg);
   }
-  printf("ZMQ Context: %p\n", s->ctx);
-  printf("---- End dumping session <%p> ----\n", s);
 }
 
 
+/**
+ * Helper function to initialise m as an empty message.
+ */
+void _empty_msg(sess_msg *m)
+{
+  zmq_msg_init(&m->msg);
+  m->offset = 0;
+  m->size = 0;
+}
+
 
 /**
+ * \brief Helper function to receive one ZeroMQ message.
  *
+ * Header frames in front of the data are decoded: a loop condition goes
+ * to cond (has_cond is set), a batch header sets batched. They arrive
+ * with the data, so decoding them costs no extra wait.
+ */
+int _recv_frames(role *r, sess_msg *m, int *cond, int *has_cond, int *batched)
+{
+  int rc = 0;
+  int64_t more = 0;
+  size_t more_size = sizeof(more);
+
+  *has_cond = 0;
+  *batched = 0;
+
+  zmq_msg_init(&m->msg);
+  while ((rc = zmq_recv(r, &m->msg, 0)) == 0) {
+    zmq_getsockopt(r, ZMQ_RCVMORE, &more, &more_size);
+    if (!more) break;
+
+    // Header frame.
+    if (zmq_msg_size(&m->msg) == 1 + sizeof(int)
+        && *(char *)zmq_msg_data(&m->msg) == CTRL_COND) {
+      memcpy(cond, (char *)zmq_msg_data(&m->msg) + 1, sizeof(int));
+      *has_cond = 1;
+    } else if (zmq_msg_size(&m->msg) == 1
+        && *(char *)zmq_msg_data(&m->msg) == CTRL_BATCH) {
+      *batched = 1;
+    } else {
+      fprintf(stderr, "%s: Unknown header frame (%zu bytes) dropped\n",
+                        __FUNCTION__, zmq_msg_size(&m->msg));
+    }
+    zmq_msg_close(&m->msg);
+    zmq_msg_init(&m->msg);
+  }
+  m->offset = 0;
+  m->size = zmq_msg_size(&m->msg);
+
+  return rc;
+}
+
+
+/**
+ * \brief Helper function to receive the next ZeroMQ message of an endpoint
+ * into its stash, ahead of the application asking for it.
+ */
+int _recv_ahead(endpoint_t *endpoint, int *cond, int *has_cond)
+{
+  int rc = 0;
+
+  _flush_session(endpoint->sess);
+
+  rc = _recv_frames(endpoint->role_ptr, &endpoint->stash, cond, has_cond,
+                    &endpoint->stash_batched);
+  if (rc != 0) {
+    sess_msg_release(&endpoint->stash);
+    return rc;
+  }
+  endpoint->stashed = 1;
+  if (endpoint->stash_batched && endpoint->stash.size == 0) { // Nothing in it.
+    sess_msg_release(&endpoint->stash);
+    endpoint->stashed = 0;
+  }
+
+  return 0;
+}
+
+
+/**
+ * \brief Helper function to take the next message out of an endpoint stash.
  *
+ * A slice of a batch refers to the batch buffer, which is freed with the
+ * last slice released.
  */
-void end_session(session *s)
+void _unstash(endpoint_t *endpoint, sess_msg *m)
 {
-  // TODO Do some extra checking
-  //      eg. make sure session is finished.
-  //     
-  unsigned endpoint_idx;
-  unsigned endpoints_count = s->endpoints_count;
+  uint32_t size;
+  size_t slice_size;
+  sess_msg *stash = &endpoint->stash;
+
+  if (!endpoint->stash_batched) {
+    zmq_msg_init(&m->msg);
+    zmq_msg_move(&m->msg, &stash->msg);
+    m->offset = stash->offset;
+    m->size = stash->size;
+    endpoint->stashed = 0;
+    return;
+  }
 
-  sleep(1); // XXX hack to allow connections to terminate
+  memcpy(&size, (char *)zmq_msg_data(&stash->msg) + stash->offset, sizeof(uint32_t));
+  slice_size = BATCH_SLICE_HEADER + BATCH_PAD(size);
+  assert(slice_size <= stash->size);
 
-  for (endpoint_idx=0; endpoint_idx<endpoints_count; ++endpoint_idx) {
-#ifdef __DEBUG__
-  fprintf(stderr, " -- Disconnecting endpoint %d\n", endpoint_idx);
-#endif
-    if (zmq_close(s->endpoints[endpoint_idx]->role_ptr) != 0) {
-      perror("zmq_close");
+  zmq_msg_init(&m->msg);
+  m->offset = stash->offset + BATCH_SLICE_HEADER;
+  m->size = size;
+  stash->offset += slice_size;
+  stash->size -= slice_size;
+
+  if (stash->size == 0) { // Last slice.
+    zmq_msg_move(&m->msg, &stash->msg);
+    sess_msg_release(stash);
+    endpoint->stashed = 0;
+  } else {
+    zmq_msg_copy(&m->msg, &stash->msg);
+  }
+}
+
+
+/**
+ * Helper function to copy a message to the destination of an irecv.
+ */
+void _complete_recv(sess_req *req, sess_msg *m, int rc)
+{
+  size_t size = sess_msg_size(m);
+
+  if (rc == 0 && req->length == NULL) { // Scalar.
+    if (size == req->elem_size) {
+      memcpy(req->dst, sess_msg_data(m), size);
+    } else {
+      fprintf(stderr, "%s: Received %zu bytes, expected %zu\n",
+                        __FUNCTION__, size, req->elem_size);
+      errno = EPROTO;
+      rc = -1;
+    }
+  } else if (rc == 0) {
+    if (*req->length * req->elem_size >= size) {
+      memcpy(req->dst, sess_msg_data(m), size);
+      *req->length = size / req->elem_size;
+    } else {
+      memcpy(req->dst, sess_msg_data(m), *req->length * req->elem_size);
+      fprintf(stderr,
+        "%s: Received data (%zu bytes) > memory size (%zu), data truncated\n",
+        __FUNCTION__, size, *req->length);
     }
   }
-  for (endpoint_idx=0; endpoint_idx<endpoints_count; ++endpoint_idx) {
-    free(s->endpoints[endpoint_idx]);
+  sess_msg_release(m);
+
+  req->rc = rc;
+  req->done = 1;
+}
+
+
+/**
+ * \brief Helper function to complete the posted irecvs of an endpoint.
+ *
+ * Completes them in order from the stash. If readable is set and the
+ * stash is empty, a message is received from the socket first (this
+ * blocks unless zmq_poll has reported the socket readable).
+ */
+void _progress_recvs(endpoint_t *endpoint, int readable)
+{
+  int rc = 0;
+  int cond, has_cond;
+  sess_msg m;
+  sess_req *req;
+
+  if (readable && !endpoint->stashed) {
+    rc = _recv_ahead(endpoint, &cond, &has_cond);
+    if (rc == 0 && has_cond) {
+      fprintf(stderr, "%s: Unexpected loop condition %d dropped\n",
+                        __FUNCTION__, cond);
+    }
   }
-  free(s->endpoints);
 
-  zmq_term(s->ctx);
-  s->get_role = NULL;
-  free(s);
+  while ((req = endpoint->recvs) != NULL && (endpoint->stashed || rc != 0)) {
+    endpoint->recvs = req->next;
+    endpoint->sess->nr_of_pending_reqs--;
+    if (rc != 0) {
+      _empty_msg(&m);
+      _complete_recv(req, &m, rc);
+      rc = 0;
+      continue;
+    }
+    _unstash(endpoint, &m);
+    _complete_recv(req, &m, 0);
+  }
+}
+
+
+/**
+ * \brief Helper function to receive the next message of a channel.
+ *
+ * Posted irecvs from r are completed first, so messages are delivered in
+ * the order they were asked for. A loop condition header in front of the
+ * message is decoded into cond (has_cond is set). Messages of a batch are
+ * returned one by one. On error m is left empty (it can still be released).
+ */
+int _recv_msg(role *r, sess_msg *m, int *cond, int *has_cond)
+{
+  int rc = 0;
+  int batched;
+  endpoint_t *endpoint = _endpoint_of(r);
+
+  *has_cond = 0;
+
+  while (endpoint != NULL && endpoint->recvs != NULL) {
+    _progress_recvs(endpoint, 1); // Blocks until the next message arrives.
+  }
+
+  if (endpoint == NULL) {
+    rc = _recv_frames(r, m, cond, has_cond, &batched);
+    if (rc == 0 && batched) {
+      fprintf(stderr, "%s: Batch received by a role outside a session\n",
+                        __FUNCTION__);
+      sess_msg_release(m);
+      _empty_msg(m);
+      errno = EPROTO;
+      rc = -1;
+    }
+    return rc;
+  }
+
+  if (!endpoint->stashed) {
+    while ((rc = _recv_ahead(endpoint, cond, has_cond)) == 0 && !endpoint->stashed);
+    if (rc != 0) {
+      _empty_msg(m);
+      return rc;
+    }
+  }
+  _unstash(endpoint, m);
+
+  return 0;
+}
+
+
+/**
+ * \brief Helper function to send a small fixed-size value.
+ *
+ * Messages no larger than ZMQ_MAX_VSM_SIZE are stored inline in the
+ * zmq_msg_t by zmq_msg_init_size, so scalar sends do not touch the heap.
+ */
+int _send_scalar(role *r, const void *val, size_t size)
+{
+  int rc = 0;
+  zmq_msg_t msg;
+
+  zmq_msg_init_size(&msg, size);
+  memcpy(zmq_msg_data(&msg), val, size);
+  rc = _send_msg(r, &msg, 0);
+  zmq_msg_close(&msg);
+
+  return rc;
+}
+
+
+/**
+ * \brief Helper function to send user memory without copying.
+ *
+ * ZeroMQ takes over data until ffn is called; on failure the message is
+ * closed here, which also calls ffn.
+ */
+int _send_nocopy(role *r, const void *data, size_t size,
+                 zmq_free_fn *ffn, void *hint)
+{
+  int rc = 0;
+  zmq_msg_t msg;
+
+  zmq_msg_init_data(&msg, (void *)data, size, ffn, hint);
+  rc = _send_msg(r, &msg, 0);
+  zmq_msg_close(&msg);
+
+  return rc;
+}
+
+
+/**
+ * \brief Helper function to release a reusable send buffer.
+ *
+ * Called by ZeroMQ (usually from the I/O thread) once a message is sent.
+ */
+void _sess_buf_release(void *data, void *hint)
+{
+  sess_buf *buf = (sess_buf *)hint;
+  __sync_fetch_and_sub(&buf->inflight, 1);
+}
+
+
+unsigned _role_hash(const char *role_name)
+{
+  unsigned hash = 2166136261u; // FNV-1a
+  while (*role_name) {
+    hash = (hash ^ (unsigned char)*role_name++) * 16777619u;
+  }
+  return hash;
+}
+
+
+/**
+ * Helper function to lookup a role in a session.
+ */
+role *find_role_in_session(session *s, char *role_name)
+{
+  unsigned slot_idx, endpoint_idx;
+
+  if (s->role_table != NULL) {
+    slot_idx = _role_hash(role_name) & (s->role_table_size-1);
+    while ((endpoint_idx = s->role_table[slot_idx]) != 0) {
+      if (strcmp(s->endpoints[endpoint_idx-1]->role_name, role_name) == 0) {
+        return s->endpoints[endpoint_idx-1]->role_ptr;
+      }
+      slot_idx = (slot_idx+1) & (s->role_table_size-1);
+    }
+  }
+
+  fprintf(stderr, "%s: Role %s not found in session.\n",
+                    __FUNCTION__, role_name);
+#ifdef __DEBUG__
+  dump_session(s);
+#endif
+  return NULL;
+}
+
+
+int sess_role_id(const session *s, const char *role_name)
+{
+  int id;
+  for (id=0; id<s->all_roles_count; ++id) {
+    if (strcmp(s->all_roles[id], role_name) == 0) return id;
+  }
+  return -1;
+}
+
+
+role *sess_role_by_id(const session *s, int id)
+{
+  if (id < 0 || id >= (int)s->all_roles_count) return NULL;
+  return s->roles_by_id[id];
+}
+
+
+/**
+ * Helper function to build the role name index of a session.
+ */
+void _build_role_table(session *s)
+{
+  unsigned endpoint_idx, slot_idx, id;
+
+  s->role_table_size = 4;
+  while (s->role_table_size < 2 * s->endpoints_count) {
+    s->role_table_size <<= 1;
+  }
+  s->role_table = (unsigned *)calloc(s->role_table_size, sizeof(unsigned));
+
+  for (endpoint_idx=0; endpoint_idx<s->endpoints_count; ++endpoint_idx) {
+    slot_idx = _role_hash(s->endpoints[endpoint_idx]->role_name) & (s->role_table_size-1);
+    while (s->role_table[slot_idx] != 0) {
+      slot_idx = (slot_idx+1) & (s->role_table_size-1);
+    }
+    s->role_table[slot_idx] = endpoint_idx + 1;
+  }
+
+  // Resolve declared roles once, so their ids can be used directly.
+  for (id=0; id<s->all_roles_count; ++id) {
+    s->roles_by_id[id] = find_role_in_session(s, s->all_roles[id]);
+  }
+}
+
+
+int _compare_role_names(const void *a, const void *b)
+{
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+
+/**
+ * Helper function to rank all roles of a session by name.
+ * Every role computes the same ranks, which collectives use as schedule.
+ */
+void _build_ranks(session *s)
+{
+  unsigned rank, endpoint_idx;
+
+  s->nr_of_ranks = s->endpoints_count + 1;
+  s->rank_names = (char **)malloc(sizeof(char *) * s->nr_of_ranks);
+  s->ranks = (role **)malloc(sizeof(role *) * s->nr_of_ranks);
+
+  s->rank_names[0] = s->role_name;
+  for (endpoint_idx=0; endpoint_idx<s->endpoints_count; ++endpoint_idx) {
+    s->rank_names[endpoint_idx+1] = s->endpoints[endpoint_idx]->role_name;
+  }
+  qsort(s->rank_names, s->nr_of_ranks, sizeof(char *), _compare_role_names);
+
+  for (rank=0; rank<s->nr_of_ranks; ++rank) {
+    if (strcmp(s->rank_names[rank], s->role_name) == 0) {
+      s->rank = rank;
+      s->ranks[rank] = NULL;
+    } else {
+      s->ranks[rank] = find_role_in_session(s, s->rank_names[rank]);
+    }
+  }
+}
+
+
+/**
+ * \brief Helper function to wait until all connections of a session are up.
+ *
+ * Sends HELLO with the role name to every peer as soon as its socket can
+ * take it, and waits for the HELLO of every peer. A peer's HELLO proves
+ * its end of the PAIR connection is established, so the first protocol
+ * message does not wait for connection setup or reconnect backoff.
+ *
+ * A peer still waiting for our HELLO drops any other message, so the
+ * session must not be used if this fails.
+ *
+ * \returns 0 if all peers were ready within timeout ms, non-zero otherwise.
+ */
+int _start_handshake(session *s, int timeout)
+{
+  unsigned endpoint_idx;
+  int i;
+  int nr_of_items;
+  int nr_of_waiting = 0;
+  int64_t more;
+  size_t more_size = sizeof(more);
+  unsigned max_items = s->endpoints_count > 0 ? s->endpoints_count : 1; // No zero-length arrays.
+  int said_hello[max_items];
+  int heard_hello[max_items];
+  zmq_pollitem_t items[max_items];
+  unsigned owners[max_items];
+  uint64_t now, deadline;
+  endpoint_t *endpoint;
+  zmq_msg_t msg;
+
+  for (endpoint_idx=0; endpoint_idx<s->endpoints_count; ++endpoint_idx) {
+    said_hello[endpoint_idx] = heard_hello[endpoint_idx] = 0;
+    nr_of_waiting += 2;
+  }
+
+  deadline = _now_usecs() + (uint64_t)timeout * 1000;
+  while (nr_of_waiting > 0 && (now = _now_usecs()) < deadline) {
+    nr_of_items = 0;
+    for (endpoint_idx=0; endpoint_idx<s->endpoints_count; ++endpoint_idx) {
+      if (said_hello[endpoint_idx] && heard_hello[endpoint_idx]) continue;
+      items[nr_of_items].socket = s->endpoints[endpoint_idx]->role_ptr;
+      items[nr_of_items].fd = 0;
+      items[nr_of_items].events = (said_hello[endpoint_idx] ? 0 : ZMQ_POLLOUT)
+                                | (heard_hello[endpoint_idx] ? 0 : ZMQ_POLLIN);
+      items[nr_of_items].revents = 0;
+      owners[nr_of_items] = endpoint_idx;
+      nr_of_items++;
+    }
+
+    // ZeroMQ 2.x poll timeouts are in microseconds.
+    if (zmq_poll(items, nr_of_items, deadline - now) == -1) {
+      if (errno == EINTR) continue;
+      perror("zmq_poll");
+      break;
+    }
+
+    for (i=0; i<nr_of_items; ++i) {
+      endpoint = s->endpoints[owners[i]];
+
+      if (items[i].revents & ZMQ_POLLOUT) { // Connected.
+        zmq_msg_init_size(&msg, 1);
+        *(char *)zmq_msg_data(&msg) = CTRL_HELLO;
+        if (zmq_send(endpoint->role_ptr, &msg, ZMQ_NOBLOCK | ZMQ_SNDMORE) == 0) {
+          zmq_msg_close(&msg);
+          zmq_msg_init_size(&msg, strlen(s->role_name));
+          memcpy(zmq_msg_data(&msg), s->role_name, strlen(s->role_name));
+          zmq_send(endpoint->role_ptr, &msg, 0);
+          said_hello[owners[i]] = 1;
+          nr_of_waiting--;
+        }
+        zmq_msg_close(&msg);
+      }
+
+      if (items[i].revents & ZMQ_POLLIN) {
+        zmq_msg_init(&msg);
+        if (zmq_recv(endpoint->role_ptr, &msg, 0) != 0) {
+          zmq_msg_close(&msg);
+          continue;
+        }
+        zmq_getsockopt(endpoint->role_ptr, ZMQ_RCVMORE, &more, &more_size);
+        if (more && zmq_msg_size(&msg) == 1 && *(char *)zmq_msg_data(&msg) == CTRL_HELLO) {
+          zmq_recv(endpoint->role_ptr, &msg, 0);
+          if (zmq_msg_size(&msg) != strlen(endpoint->role_name)
+              || memcmp(zmq_msg_data(&msg), endpoint->role_name, zmq_msg_size(&msg)) != 0) {
+            fprintf(stderr, "%s: Peer of %s is %.*s, check configuration\n",
+                              __FUNCTION__, endpoint->role_name,
+                              (int)zmq_msg_size(&msg), (char *)zmq_msg_data(&msg));
+          }
+          heard_hello[owners[i]] = 1;
+          nr_of_waiting--;
+        } else {
+          fprintf(stderr, "%s: Message from %s before HELLO, dropped\n",
+                            __FUNCTION__, endpoint->role_name);
+        }
+        zmq_getsockopt(endpoint->role_ptr, ZMQ_RCVMORE, &more, &more_size);
+        while (more) { // Rest of the message.
+          zmq_recv(endpoint->role_ptr, &msg, 0);
+          zmq_getsockopt(endpoint->role_ptr, ZMQ_RCVMORE, &more, &more_size);
+        }
+        zmq_msg_close(&msg);
+      }
+    }
+  }
+
+  for (endpoint_idx=0; endpoint_idx<s->endpoints_count; ++endpoint_idx) {
+    if (!said_hello[endpoint_idx] || !heard_hello[endpoint_idx]) {
+      fprintf(stderr, "%s: %s not ready within %d ms\n",
+                        __FUNCTION__, s->endpoints[endpoint_idx]->role_name, timeout);
+    }
+  }
+
+  return nr_of_waiting;
+}
+
+
+/* ----- Runtime ------------------------------------------------------------ */
+
+
+/**
+ * Helper function to read a positive integer setting from the environment.
+ */
+int _env_int(const char *name, int default_value)
+{
+  char *env = getenv(name);
+  int value;
+
+  if (env != NULL && (value = atoi(env)) > 0) return value;
+  return default_value;
+}
+
+
+void _runtime_atexit()
+{
+  pthread_mutex_lock(&runtime_lock);
+  if (runtime.ctx != NULL && runtime.nr_of_sessions == 0) {
+    zmq_term(runtime.ctx); // Would block on sockets of sessions not ended.
+    runtime.ctx = NULL;
+  }
+  pthread_mutex_unlock(&runtime_lock);
+}
+
+
+/**
+ * Helper function to create the ZeroMQ context, runtime_lock held.
+ */
+int _runtime_start(int io_threads)
+{
+  if (io_threads <= 0) io_threads = _env_int("SESS_IO_THREADS", 1);
+
+  if ((runtime.ctx = zmq_init(io_threads)) == NULL) {
+    perror("zmq_init");
+    return -1;
+  }
+  runtime.io_threads = io_threads;
+  if (!runtime.atexit_registered) {
+    atexit(_runtime_atexit);
+    runtime.atexit_registered = 1;
+  }
+#ifdef __DEBUG__
+  fprintf(stderr, "Started runtime with %d I/O threads\n", io_threads);
+#endif
+
+  return 0;
+}
+
+
+int sess_runtime_init(int io_threads)
+{
+  int rc = 0;
+
+  pthread_mutex_lock(&runtime_lock);
+  if (runtime.ctx != NULL) {
+    errno = EBUSY;
+    rc = -1;
+  } else {
+    rc = _runtime_start(io_threads);
+  }
+  pthread_mutex_unlock(&runtime_lock);
+
+  return rc;
+}
+
+
+int sess_runtime_term()
+{
+  int rc = 0;
+
+  pthread_mutex_lock(&runtime_lock);
+  if (runtime.nr_of_sessions > 0) {
+    fprintf(stderr, "%s: %u sessions not ended\n",
+                      __FUNCTION__, runtime.nr_of_sessions);
+    errno = EBUSY;
+    rc = -1;
+  } else if (runtime.ctx != NULL) {
+    rc = zmq_term(runtime.ctx);
+    runtime.ctx = NULL;
+  }
+  pthread_mutex_unlock(&runtime_lock);
+
+  return rc;
+}
+
+
+/**
+ * \brief Helper function to get the shared context for a new session.
+ *
+ * Starts the runtime with io_threads (0 for the default) if needed.
+ */
+void *_runtime_acquire(int io_threads)
+{
+  void *ctx = NULL;
+
+  pthread_mutex_lock(&runtime_lock);
+  if (runtime.ctx != NULL || _runtime_start(io_threads) == 0) {
+    runtime.nr_of_sessions++;
+    ctx = runtime.ctx;
+  }
+  pthread_mutex_unlock(&runtime_lock);
+
+  return ctx;
+}
+
+
+void _runtime_release()
+{
+  pthread_mutex_lock(&runtime_lock);
+  runtime.nr_of_sessions--;
+  pthread_mutex_unlock(&runtime_lock);
+}
+
+
+/**
+ * \brief Helper function to get the directory of the ipc:// sockets.
+ *
+ * The SESS_IPC_DIR environment variable, so jobs on the same host can be
+ * kept apart, or /tmp/sess-<uid> by default. The directory is created
+ * (mode 0700) if needed; the default one must be owned by this user.
+ *
+ * \returns 0 if successful, -1 otherwise.
+ */
+int _ipc_dir(char *dir, size_t size)
+{
+  struct stat st;
+  const char *env = getenv("SESS_IPC_DIR");
+  int is_default = (env == NULL || env[0] == '\0');
+
+  if (is_default) {
+    snprintf(dir, size, "/tmp/sess-%u", (unsigned)getuid());
+  } else {
+    snprintf(dir, size, "%s", env);
+  }
+
+  if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+    fprintf(stderr, "%s: Cannot create %s: %s\n", __FUNCTION__, dir, strerror(errno));
+    return -1;
+  }
+  if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)
+      || (is_default && st.st_uid != getuid())) {
+    fprintf(stderr, "%s: %s is not a directory of this user, set SESS_IPC_DIR\n",
+                      __FUNCTION__, dir);
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * Helper function to build the URI of a connection.
+ * Both ends of ipc:// and inproc:// connections use the same address,
+ * named after the server role and its port (ipc:// in the directory of
+ * _ipc_dir, which both ends must agree on).
+ */
+void _conn_uri(char *uri, size_t size, const conn_rec *conn, int as_server)
+{
+  char dir[256];
+
+  switch (conn->transport) {
+    case CONN_IPC:
+      _ipc_dir(dir, sizeof(dir)); // Reported, binding/connecting will fail.
+      if (snprintf(uri, size, "ipc://%s/sess-%s-%u", dir, conn->to, conn->port) >= (int)size) {
+        fprintf(stderr, "%s: ipc address of %s too long\n", __FUNCTION__, conn->to);
+        uri[0] = '\0'; // Not a truncated address of another connection.
+      }
+      break;
+    case CONN_INPROC:
+      snprintf(uri, size, "inproc://sess-%s-%u", conn->to, conn->port);
+      break;
+    default:
+      if (as_server) {
+        snprintf(uri, size, "tcp://*:%u", conn->port);
+      } else {
+        snprintf(uri, size, "tcp://%s:%u", conn->host, conn->port);
+      }
+  }
+}
+
+
+/**
+ * Helper function to connect a socket.
+ * inproc:// endpoints must be bound before they are connected, so retry
+ * until the server thread has bound it or timeout (ms) expires.
+ */
+int _connect_endpoint(endpoint_t *endpoint, int timeout)
+{
+  struct timespec delay = { 0, 1000000 }; // 1 ms
+  int waited = 0;
+
+  while (zmq_connect(endpoint->role_ptr, endpoint->uri) != 0) {
+    if (errno != ECONNREFUSED || strncmp(endpoint->uri, "inproc://", 9) != 0
+        || waited >= timeout) {
+      return -1;
+    }
+    nanosleep(&delay, NULL);
+    ++waited;
+  }
+  return 0;
+}
+
+
+/**
+ * Helper function to create the endpoints of session sess for the role of
+ * the parsed endpoint protocol, as in connection records conns.
+ * The role names are moved from protocol to sess.
+ * Servers are bound and clients connected, timeout (ms) is for inproc://
+ * clients waiting for their server to bind.
+ */
+void _setup_session(session *sess, scribble_protocol *protocol,
+                    const conn_rec conns[], int nr_of_conns, int nr_of_roles, int timeout)
+{
+  int conn_idx;
+  int endpoint_idx;
+  char *role_name = protocol->role_name;
+
+  sess->role_name = role_name;
+  protocol->role_name = NULL;
+  for (sess->all_roles_count=0; sess->all_roles_count<protocol->nr_of_roles; ++sess->all_roles_count) {
+    sess->all_roles[sess->all_roles_count] = protocol->roles[sess->all_roles_count];
+  }
+  protocol->nr_of_roles = 0;
+
+  sess->endpoints = malloc(sizeof(endpoint_t *) * (nr_of_roles-1));
+
+  sess->end_timeout = _env_int("SESS_END_TIMEOUT", END_TIMEOUT);
+  sess->pool = bufpool_new();
+
+  for (endpoint_idx=0, conn_idx=0; conn_idx<nr_of_conns; ++conn_idx) {
+    if (strcmp(conns[conn_idx].from, role_name) == 0) { // As a client.
+      sess->endpoints[endpoint_idx] = calloc(1, sizeof(endpoint_t));
+      sess->endpoints[endpoint_idx]->role_name
+          = malloc(sizeof(char) * (strlen(conns[conn_idx].to)+1));
+      strcpy(sess->endpoints[endpoint_idx]->role_name, conns[conn_idx].to);
+
+      _conn_uri(sess->endpoints[endpoint_idx]->uri, sizeof(sess->endpoints[endpoint_idx]->uri),
+                &conns[conn_idx], 0);
+#ifdef __DEBUG__
+      fprintf(stderr, "Connection (as client) %s -> %s is %s\n",
+                        conns[conn_idx].from,
+                        conns[conn_idx].to,
+                        sess->endpoints[endpoint_idx]->uri);
+#endif
+      if ((sess->endpoints[endpoint_idx]->role_ptr = zmq_socket(sess->ctx, ZMQ_PAIR)) == NULL) {
+        perror("zmq_socket");
+      }
+      if (_connect_endpoint(sess->endpoints[endpoint_idx], timeout) != 0) {
+        perror("zmq_connect");
+      }
+      sess->endpoints[endpoint_idx]->sess = sess;
+      _register_endpoint(sess->endpoints[endpoint_idx]);
+      sess->endpoints_count++;
+      endpoint_idx++;
+    }
+
+    if (strcmp(conns[conn_idx].to, role_name) == 0) { // As a server.
+      sess->endpoints[endpoint_idx] = calloc(1, sizeof(endpoint_t));
+      sess->endpoints[endpoint_idx]->role_name
+          = malloc(sizeof(char) * (strlen(conns[conn_idx].from)+1));
+      strcpy(sess->endpoints[endpoint_idx]->role_name, conns[conn_idx].from);
+
+      _conn_uri(sess->endpoints[endpoint_idx]->uri, sizeof(sess->endpoints[endpoint_idx]->uri),
+                &conns[conn_idx], 1);
+#ifdef __DEBUG__
+      fprintf(stderr, "Connection (as server) %s -> %s is %s\n", conns[conn_idx].from, conns[conn_idx].to, sess->endpoints[endpoint_idx]->uri);
+#endif
+      if ((sess->endpoints[endpoint_idx]->role_ptr = zmq_socket(sess->ctx, ZMQ_PAIR)) == NULL) {
+        perror("zmq_socket");
+      }
+      if (zmq_bind(sess->endpoints[endpoint_idx]->role_ptr, sess->endpoints[endpoint_idx]->uri) != 0) {
+        perror("zmq_bind");
+      }
+      sess->endpoints[endpoint_idx]->sess = sess;
+      _register_endpoint(sess->endpoints[endpoint_idx]);
+      sess->endpoints_count++;
+      endpoint_idx++;
+    }
+  }
+
+  _build_role_table(sess);
+  _build_ranks(sess);
+  sess->get_role = &find_role_in_session;
+}
+
+
+/**
+ * Helper function to map the binary connection configuration, either
+ * config_file itself or config_file.bin if not older than config_file.
+ * \returns Mapped configuration, or NULL to read config_file as text.
+ */
+conn_map *_map_config(const char *config_file)
+{
+  conn_map *map;
+  char *bin_file;
+  struct stat text_st, bin_st;
+
+  if ((map = connmgr_map(config_file)) != NULL) return map;
+
+  bin_file = malloc(strlen(config_file) + 5);
+  sprintf(bin_file, "%s.bin", config_file);
+  if (stat(bin_file, &bin_st) == 0
+      && (stat(config_file, &text_st) != 0 || bin_st.st_mtime >= text_st.st_mtime)) {
+    map = connmgr_map(bin_file);
+  }
+  free(bin_file);
+  return map;
+}
+
+
+/**
+ * Session initiation, involves three steps:
+ *  (1) Load configuration from filesystem supplied as command line argument
+ *  (2) Load endpoint scribble (the file scribble, or the source protocol of
+ *      size bytes if not NULL) and extract relevant configuration
+ *  (3) Create a session variable with connected endpoints
+ */
+void _join_session(int *argc, char ***argv, session **s,
+                   const char *scribble, const char *protocol_src, size_t size)
+{
+  conn_rec *conns; // Array of connection records
+  host_map *role_hosts; // Role-to-host mapping
+  int nr_of_conns; // Number of connections
+  int nr_of_roles; // Number of roles
+  conn_map *map; // Binary configuration, if any
+  int role_idx;
+
+  int option;
+  char *config_file = NULL;
+  int io_threads = 0;
+  int start_timeout = _env_int("SESS_START_TIMEOUT", START_TIMEOUT);
+  uint64_t start_time = _now_usecs();
+
+  // Invoke getopt to extract arguments we need
+  while (1) {
+    static struct option long_options[] = {
+      {"conf", required_argument, 0, 'c'},
+      {"io-threads", required_argument, 0, 'i'},
+      {"start-timeout", required_argument, 0, 't'},
+      {0, 0, 0, 0}
+    };
+
+    int option_idx = 0;
+    option = getopt_long(*argc, *argv, "c:", long_options, &option_idx);
+
+    if (option == -1) break;
+
+    switch (option) {
+      case 'c':
+        config_file = malloc(sizeof(char) * (strlen(optarg)+1));
+        strcpy(config_file, optarg);
+        fprintf(stderr, "Using configuration file %s\n", config_file);
+        break;
+      case 'i':
+        io_threads = atoi(optarg); // Only if the runtime is not started yet.
+        break;
+      case 't':
+        start_timeout = atoi(optarg);
+        break;
+    }
+  }
+
+  *argc -= optind;
+  *argv += optind;
+
+  if (config_file == NULL) {
+    config_file = malloc(sizeof(char) * 10);
+    config_file = "conn.conf"; // Default config file
+  }
+
+  *s = (session *)calloc(1, sizeof(session));
+  session *sess = *s; // Alias
+
+  // Extract role_name and roles from Scribble, parsed once
+  // (or read from the cache in directory SESS_SCRIBBLE_CACHE).
+  scribble_protocol *protocol = protocol_src != NULL
+    ? parse_protocol_buffer(protocol_src, size, scribble)
+    : parse_protocol_cached(scribble, getenv("SESS_SCRIBBLE_CACHE"));
+  if (protocol->tree == NULL) { // No role to join as.
+    fprintf(stderr, "%s: Unable to parse endpoint Scribble %s\n", __FUNCTION__, scribble);
+    exit(EXIT_FAILURE);
+  }
+  const char *role_name = protocol->role_name;
+
+  if ((map = _map_config(config_file)) != NULL) {
+    // Only the connections of this role, no parsing.
+    nr_of_roles = map->header->nr_of_roles;
+    if ((role_idx = connmgr_map_role(map, role_name)) < 0) {
+      fprintf(stderr, "%s: Role %s not in %s\n", __FUNCTION__, role_name, config_file);
+      nr_of_conns = 0;
+      conns = NULL;
+    } else {
+      nr_of_conns = connmgr_map_conns(map, role_idx, &conns);
+    }
+  } else {
+    nr_of_conns = connmgr_read(config_file, &conns, &role_hosts, &nr_of_roles);
+  }
+
+  sess->ctx = _runtime_acquire(io_threads);
+  _setup_session(sess, protocol, conns, nr_of_conns, nr_of_roles, start_timeout);
+  free_protocol(protocol);
+
+  if (map != NULL) {
+    free(conns);
+    connmgr_unmap(map); // Strings were copied by _setup_session.
+  }
+
+  // Implicit barrier: all connections are up before the protocol starts.
+  if (_start_handshake(sess, start_timeout) != 0) {
+    fprintf(stderr, "%s: Roles not ready within %d ms, giving up\n",
+                      __FUNCTION__, start_timeout);
+    exit(EXIT_FAILURE);
+  }
+  sess->startup_usecs = _now_usecs() - start_time;
+#ifdef __DEBUG__
+  fprintf(stderr, "Created session <%p> with %u endpoints in %lu us\n",
+                    *s, (*s)->endpoints_count, (unsigned long)(*s)->startup_usecs);
+#endif
+}
+
+
+void join_session(int *argc, char ***argv, session **s, const char *scribble)
+{
+  _join_session(argc, argv, s, scribble, NULL, 0);
+}
+
+
+void join_session_embedded(int *argc, char ***argv, session **s,
+                           const char *protocol, size_t size)
+{
+  _join_session(argc, argv, s, "<embedded>", protocol, size);
+}
+
+
+void sess_piggyback_conds(session *s, int enable)
+{
+  if (!enable) {
+    _flush_session(s);
+  }
+  s->piggyback_conds = enable;
+}
+
+
+/**
+ * Dump the content of a session in a human readable form for debugging.
+ */
+void dump_session(const session *s)
+{
+  unsigned endpoint_idx;
+  printf("---- Dumping session <%p> ---- \n", s);
+  printf("Number of endpoints: %u\n", s->endpoints_count);
+  for (endpoint_idx=0; endpoint_idx<s->endpoints_count; ++endpoint_idx) {
+    printf("Endpoint %d { role_name: %s, role_ptr: <%p>, uri: %s }\n",
+              endpoint_idx,
+              s->endpoints[endpoint_idx]->role_name,
+              s->endpoints[endpoint_idx]->role_ptr,
+              s->endpoints[endpoint_idx]->uri
+    );
+  }
+  printf("ZMQ Context: %p\n", s->ctx);
+  printf("Startup time: %lu us\n", (unsigned long)s->startup_usecs);
+  if (s->pool != NULL) {
+    bufpool_stats stats;
+    bufpool_get_stats(s->pool, &stats);
+    printf("Buffer pool: %lu/%lu hits, %zu bytes in use, %zu bytes peak\n",
+              stats.hits, stats.allocs, stats.bytes_in_use, stats.peak_bytes);
+  }
+  printf("---- End dumping session <%p> ----\n", s);
+}
+
+
+
+/**
+ * \brief Helper function to send END to the peer of an endpoint.
+ *
+ * Does not block, so a peer which has gone away cannot hold up the end of
+ * the session.
+ *
+ * \returns 0 if sent, -1 otherwise and set errno (EAGAIN if the socket
+ *          cannot take it yet)
+ */
+int _send_end(endpoint_t *endpoint)
+{
+  int rc = 0;
+  zmq_msg_t msg;
+
+  zmq_msg_init_size(&msg, 1);
+  *(char *)zmq_msg_data(&msg) = CTRL_END;
+  rc = zmq_send(endpoint->role_ptr, &msg, ZMQ_NOBLOCK | ZMQ_SNDMORE);
+  zmq_msg_close(&msg);
+  if (rc != 0) return rc;
+
+  zmq_msg_init(&msg);
+  rc = zmq_send(endpoint->role_ptr, &msg, ZMQ_NOBLOCK);
+  zmq_msg_close(&msg);
+
+  return rc;
+}
+
+
+/**
+ * \brief Helper function to end a session with all peers.
+ *
+ * Sends END to every peer as soon as its socket can take it, and waits
+ * for the END of every peer, all within s->end_timeout ms. END follows
+ * everything sent on the same socket, so once it has arrived both ways no
+ * message of the session is left in flight towards a socket about to be
+ * closed.
+ *
+ * \returns Number of peers which did not answer in time.
+ */
+int _end_handshake(session *s)
+{
+  unsigned endpoint_idx;
+  int i;
+  int nr_of_items;
+  int nr_of_waiting = 0;
+  int64_t more;
+  size_t more_size = sizeof(more);
+  unsigned max_items = s->endpoints_count > 0 ? s->endpoints_count : 1; // No zero-length arrays.
+  int said_end[max_items];
+  int ended[max_items];
+  zmq_pollitem_t items[max_items];
+  unsigned owners[max_items];
+  uint64_t now, deadline;
+  endpoint_t *endpoint;
+  zmq_msg_t msg;
+
+  for (endpoint_idx=0; endpoint_idx<s->endpoints_count; ++endpoint_idx) {
+    said_end[endpoint_idx] = ended[endpoint_idx] = 0;
+    if (_send_end(s->endpoints[endpoint_idx]) == 0) {
+      said_end[endpoint_idx] = 1;
+    } else if (errno != EAGAIN) {
+      perror("zmq_send");
+      said_end[endpoint_idx] = ended[endpoint_idx] = 1; // Nothing to wait for.
+      continue;
+    }
+    nr_of_waiting++;
+  }
+
+  deadline = _now_usecs() + (uint64_t)s->end_timeout * 1000;
+  while (nr_of_waiting > 0 && (now = _now_usecs()) < deadline) {
+    nr_of_items = 0;
+    for (endpoint_idx=0; endpoint_idx<s->endpoints_count; ++endpoint_idx) {
+      if (said_end[endpoint_idx] && ended[endpoint_idx]) continue;
+      items[nr_of_items].socket = s->endpoints[endpoint_idx]->role_ptr;
+      items[nr_of_items].fd = 0;
+      items[nr_of_items].events = (said_end[endpoint_idx] ? 0 : ZMQ_POLLOUT)
+                                | (ended[endpoint_idx] ? 0 : ZMQ_POLLIN);
+      items[nr_of_items].revents = 0;
+      owners[nr_of_items] = endpoint_idx;
+      nr_of_items++;
+    }
+
+    // ZeroMQ 2.x poll timeouts are in microseconds.
+    if (zmq_poll(items, nr_of_items, deadline - now) == -1) {
+      if (errno == EINTR) continue;
+      perror("zmq_poll");
+      break;
+    }
+
+    for (i=0; i<nr_of_items; ++i) {
+      endpoint = s->endpoints[owners[i]];
+
+      if (items[i].revents & ZMQ_POLLOUT) {
+        if (_send_end(endpoint) == 0) {
+          said_end[owners[i]] = 1;
+          if (ended[owners[i]]) nr_of_waiting--;
+        } else if (errno != EAGAIN) {
+          perror("zmq_send");
+          said_end[owners[i]] = ended[owners[i]] = 1; // Nothing to wait for.
+          nr_of_waiting--;
+          continue;
+        }
+      }
+
+      if (!(items[i].revents & ZMQ_POLLIN)) continue;
+
+      zmq_msg_init(&msg);
+      if (zmq_recv(endpoint->role_ptr, &msg, 0) != 0) {
+        zmq_msg_close(&msg);
+        continue;
+      }
+      zmq_getsockopt(endpoint->role_ptr, ZMQ_RCVMORE, &more, &more_size);
+      if (more && zmq_msg_size(&msg) == 1 && *(char *)zmq_msg_data(&msg) == CTRL_END) {
+        ended[owners[i]] = 1;
+        if (said_end[owners[i]]) nr_of_waiting--;
+      } else {
+        fprintf(stderr, "%s: Message from %s never received, dropped\n",
+                          __FUNCTION__, endpoint->role_name);
+      }
+      while (more) { // Rest of the message.
+        zmq_recv(endpoint->role_ptr, &msg, 0);
+        zmq_getsockopt(endpoint->role_ptr, ZMQ_RCVMORE, &more, &more_size);
+      }
+      zmq_msg_close(&msg);
+    }
+  }
+
+  if (nr_of_waiting > 0) {
+    fprintf(stderr, "%s: %d roles did not end the session within %d ms\n",
+                      __FUNCTION__, nr_of_waiting, s->end_timeout);
+  }
+
+  return nr_of_waiting;
+}
+
+
+/**
+ *
+ *
+ */
+void end_session(session *s)
+{
+  // TODO Do some extra checking
+  //      eg. make sure session is finished.
+  //     
+  unsigned endpoint_idx;
+  unsigned endpoints_count = s->endpoints_count;
+
+  _flush_session(s);
+  for (endpoint_idx=0; endpoint_idx<endpoints_count; ++endpoint_idx) {
+    if (s->endpoints[endpoint_idx]->sends != NULL) {
+      _progress_sends(s->endpoints[endpoint_idx], 0);
+    }
+  }
+
+  _end_handshake(s);
+
+  for (endpoint_idx=0; endpoint_idx<endpoints_count; ++endpoint_idx) {
+#ifdef __DEBUG__
+  fprintf(stderr, " -- Disconnecting endpoint %d\n", endpoint_idx);
+#endif
+    _unregister_endpoint(s->endpoints[endpoint_idx]);
+    if (s->endpoints[endpoint_idx]->stashed) {
+      sess_msg_release(&s->endpoints[endpoint_idx]->stash);
+    }
+    // Bound the time the shared context keeps undelivered messages.
+    zmq_setsockopt(s->endpoints[endpoint_idx]->role_ptr, ZMQ_LINGER,
+                   &s->end_timeout, sizeof(s->end_timeout));
+    if (zmq_close(s->endpoints[endpoint_idx]->role_ptr) != 0) {
+      perror("zmq_close");
+    }
+  }
+  for (endpoint_idx=0; endpoint_idx<endpoints_count; ++endpoint_idx) {
+    free(s->endpoints[endpoint_idx]->role_name);
+    free(s->endpoints[endpoint_idx]);
+  }
+  free(s->endpoints);
+  free(s->role_table);
+  free(s->rank_names);
+  free(s->ranks);
+  free(s->role_name);
+  for (endpoint_idx=0; endpoint_idx<s->all_roles_count; ++endpoint_idx) {
+    free(s->all_roles[endpoint_idx]);
+  }
+
+  _runtime_release(); // Context is shared, see sess_runtime_term.
+  bufpool_free(s->pool); // Buffers still in flight are freed on release.
+  s->get_role = NULL;
+  free(s);
+#ifdef __DEBUG__
+  fprintf(stderr, "Terminated session <%p>\n", s);
+#endif
+}
+
+
+// A role run as a thread by sess_spawn_local.
+typedef struct {
+  session *s;
+  sess_entry *entry;
+  void *arg;
+  int timeout;
+  uint64_t start_time;
+  int started;
+  int rc;
+  pthread_t thread;
+} local_role;
+
+
+/**
+ * Helper function, thread of a local role.
+ */
+void *_local_role_main(void *arg)
+{
+  local_role *lr = (local_role *)arg;
+
+  if (_start_handshake(lr->s, lr->timeout) != 0) {
+    lr->rc = -1; // Peers not ready, the session cannot be used.
+  } else {
+    lr->s->startup_usecs = _now_usecs() - lr->start_time;
+    lr->rc = lr->entry(lr->s, lr->arg);
+  }
+  end_session(lr->s);
+  return NULL;
+}
+
+
+int sess_spawn_local(int nr_of_roles, const char *scribbles[],
+                     sess_entry *entry_fns[], void *args[])
+{
+  int role_idx, role2_idx, conn_idx, from, to;
+  int nr_of_conns = nr_of_roles * (nr_of_roles-1) / 2;
+  int timeout = _env_int("SESS_START_TIMEOUT", START_TIMEOUT);
+  int rc = 0;
+  unsigned port;
+  void *ctx;
+
+  char **role_names = malloc(sizeof(char *) * nr_of_roles);
+  scribble_protocol **protocols = malloc(sizeof(scribble_protocol *) * nr_of_roles);
+  conn_rec *conns = malloc(sizeof(conn_rec) * (nr_of_conns > 0 ? 2*nr_of_conns : 1));
+  local_role *roles = calloc(nr_of_roles, sizeof(local_role));
+
+  for (role_idx=0; role_idx<nr_of_roles; ++role_idx) {
+    protocols[role_idx] = parse_protocol_cached(scribbles[role_idx], getenv("SESS_SCRIBBLE_CACHE"));
+    role_names[role_idx] = protocols[role_idx]->role_name;
+    if (protocols[role_idx]->tree == NULL) { // Before any socket is created.
+      fprintf(stderr, "%s: Unable to parse endpoint Scribble %s\n",
+                        __FUNCTION__, scribbles[role_idx]);
+      for (; role_idx>=0; --role_idx) {
+        free_protocol(protocols[role_idx]);
+      }
+      free(role_names);
+      free(protocols);
+      free(conns);
+      free(roles);
+      return -1;
+    }
+  }
+
+  // Every pair of roles, all in this process. The nr_of_roles-1
+  // connections of a role are kept together (from conns[role_idx*(nr_of_roles-1)]).
+  pthread_mutex_lock(&runtime_lock);
+  port = runtime.nr_of_inproc_conns;
+  runtime.nr_of_inproc_conns += nr_of_conns;
+  pthread_mutex_unlock(&runtime_lock);
+  for (role_idx=0, conn_idx=0; role_idx<nr_of_roles; ++role_idx) {
+    for (role2_idx=0; role2_idx<nr_of_roles; ++role2_idx) {
+      if (role2_idx == role_idx) continue;
+      from = (role_idx < role2_idx ? role_idx : role2_idx);
+      to = (role_idx < role2_idx ? role2_idx : role_idx);
+      conns[conn_idx].from = role_names[from];
+      conns[conn_idx].to = role_names[to];
+      conns[conn_idx].host = "localhost";
+      conns[conn_idx].port = port + from*nr_of_roles - from*(from+1)/2 + (to-from-1);
+      conns[conn_idx].transport = CONN_INPROC;
+      ++conn_idx;
+    }
+  }
+
+  // Sockets are created here and used by the role threads (the thread
+  // creation is the memory barrier ZeroMQ needs to migrate them).
+  // In reverse, so every to-role has bound before its from-roles connect.
+  for (role_idx=nr_of_roles-1; role_idx>=0; --role_idx) {
+    roles[role_idx].start_time = _now_usecs();
+    roles[role_idx].s = (session *)calloc(1, sizeof(session));
+    if ((ctx = _runtime_acquire(0)) == NULL) {
+      fprintf(stderr, "%s: cannot start runtime\n", __FUNCTION__);
+    }
+    roles[role_idx].s->ctx = ctx;
+    _setup_session(roles[role_idx].s, protocols[role_idx],
+                   &conns[role_idx*(nr_of_roles-1)], nr_of_roles-1, nr_of_roles, timeout);
+    roles[role_idx].entry = entry_fns[role_idx];
+    roles[role_idx].arg = (args == NULL ? NULL : args[role_idx]);
+    roles[role_idx].timeout = timeout;
+  }
+  for (role_idx=0; role_idx<nr_of_roles; ++role_idx) {
+    free_protocol(protocols[role_idx]);
+  }
+
+  for (role_idx=0; role_idx<nr_of_roles; ++role_idx) {
+    if (pthread_create(&roles[role_idx].thread, NULL, _local_role_main, &roles[role_idx]) != 0) {
+      perror("pthread_create");
+      end_session(roles[role_idx].s); // Peers time out on the startup barrier.
+      roles[role_idx].rc = -1;
+    } else {
+      roles[role_idx].started = 1;
+    }
+  }
+#ifdef __DEBUG__
+  fprintf(stderr, "Spawned %d local roles\n", nr_of_roles);
+#endif
+
+  for (role_idx=0; role_idx<nr_of_roles; ++role_idx) {
+    if (roles[role_idx].started) {
+      pthread_join(roles[role_idx].thread, NULL);
+    }
+    if (rc == 0) {
+      rc = roles[role_idx].rc;
+    }
+  }
+
+  free(role_names); // Names are freed by end_session.
+  free(protocols);
+  free(conns);
+  free(roles);
+  return rc;
+}
+
+
+/**
+ * Set up a server socket and run session initiation checks.
+ * Involves looking at Scribble files specified by both session initiation
+ * to extract the roles.
+ *
+ * This is obsolete and will be removed in a future version.
+ */
+role *sess_server(void *ctx, int type, const char *uri, const char *scribble)
+{
+#ifdef __DEBUG__
+  fprintf(stderr, " server_init\n   * bind(%s)\n   * Scribble(%s)\n", uri, scribble);
+#endif
+
+  role *r = zmq_socket(ctx, type);
+
+  if (zmq_bind(r, uri) != 0) perror(__FUNCTION__);
+
+#ifdef __DEBUG__
+  fprintf(stderr, "%s: Session initiaion\n", __FUNCTION__);
+#endif
+
+  return r;
+}
+
+
+/**
+ * Set up a client socket and run session initiation check.
+ * The actual check is done locally in \ref sess_server and this function simply
+ * forwards the Scribble filename to \ref sess_server.
+ *
+ * This is obsolete and will be removed in a future version.
+ */
+role *sess_client(void *ctx, int type, const char *uri, const char *scribble)
+{
+#ifdef __DEBUG__
+  fprintf(stderr, " client_init\n   * connect(%s)\n   * Scribble(%s)\n", uri, scribble);
+#endif
+
+  role *r = zmq_socket(ctx, type);
+
+  if (zmq_connect(r, uri) != 0) perror(__FUNCTION__);
+
+//  send_string(r, scribble); // Receive scribble filename
+
+  return r;
+}
+
+
+/* ----- Send --------------------------------------------------------------- */
+
+
+int send_int(role *r, int val)
+{
+  int rc = 0;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(%d) ", __FUNCTION__, val);
+#endif
+
+  rc = _send_scalar(r, &val, sizeof(int));
+ 
+#ifdef __DEBUG__
+  fprintf(stderr, ".\n");
+#endif
+
+  return rc;
+}
+
+
+int send_int_array(role *r, const int arr[], size_t length)
+{
+  int rc = 0;
+  zmq_msg_t msg;
+  void *hint;
+  size_t size = sizeof(int) * length;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(size=%zu) ", __FUNCTION__, size);
+#endif
+
+  // Copy to send buffer
+  int *send_buffer = (int *)_send_alloc(r, size, &hint);
+  memcpy(send_buffer, arr, size);
+
+  zmq_msg_init_data(&msg, send_buffer, size, _dealloc, hint);
+  rc = _send_msg(r, &msg, 0);
+  zmq_msg_close(&msg);
+ 
+#ifdef __DEBUG__
+  fprintf(stderr, ".\n");
+#endif
+
+  return rc;
+}
+
+
+int send_char(role *r, char val)
+{
+  int rc = 0;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(%d) ", __FUNCTION__, val);
+#endif
+
+  rc = _send_scalar(r, &val, sizeof(char));
+ 
+#ifdef __DEBUG__
+  fprintf(stderr, ".\n");
+#endif
+
+  return rc;
+}
+
+
+int send_string(role *r, const char *string)
+{
+  int rc = 0;
+  size_t size = strlen(string);
+  zmq_msg_t msg;
+  void *hint;
+
+#ifdef __DEBUG__
+  char *send_buffer = (char *)_send_alloc(r, size + 1, &hint);
+  memcpy(send_buffer, string, size);
+  send_buffer[size] = 0;
+  fprintf(stderr, " --> %s(%s/%zu) ", __FUNCTION__, send_buffer, size);
+#else
+  char *send_buffer = (char *)_send_alloc(r, size, &hint);
+  strncpy(send_buffer, string, size);
+#endif
+
+  zmq_msg_init_data(&msg, send_buffer, size, _dealloc, hint);
+  rc = _send_msg(r, &msg, 0);
+  zmq_msg_close(&msg);
+ 
+#ifdef __DEBUG__
+  fprintf(stderr, ".\n");
+#endif
+
+  return rc;
+}
+
+
+int send_float(role *r, float val)
+{
+  int rc = 0;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(%f) ", __FUNCTION__, val);
+#endif
+
+  rc = _send_scalar(r, &val, sizeof(float));
+ 
+#ifdef __DEBUG__
+  fprintf(stderr, ".\n");
+#endif
+
+  return rc;
+}
+
+
+int send_float_array(role *r, const float arr[], size_t length)
+{
+  int rc = 0;
+  zmq_msg_t msg;
+  void *hint;
+  size_t size = sizeof(float) * length;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(size=%zu) ", __FUNCTION__, size);
+#endif
+
+  // Copy to send buffer
+  float *send_buffer = (float *)_send_alloc(r, size, &hint);
+  memcpy(send_buffer, arr, size);
+
+  zmq_msg_init_data(&msg, send_buffer, size, _dealloc, hint);
+  rc = _send_msg(r, &msg, 0);
+  zmq_msg_close(&msg);
+ 
+#ifdef __DEBUG__
+  fprintf(stderr, ".\n");
+#endif
+
+  return rc;
+}
+
+
+int send_double(role *r, double val)
+{
+  int rc = 0;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(%f) ", __FUNCTION__, val);
+#endif
+
+  rc = _send_scalar(r, &val, sizeof(double));
+ 
+#ifdef __DEBUG__
+  fprintf(stderr, ".\n");
+#endif
+
+  return rc;
+}
+
+
+int send_double_array(role *r, const double arr[], size_t length)
+{
+  int rc = 0;
+  zmq_msg_t msg;
+  void *hint;
+  size_t size = sizeof(double) * length;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(size=%zu) ", __FUNCTION__, size);
+#endif
+
+  // Copy to send buffer
+  double *send_buffer = (double *)_send_alloc(r, size, &hint);
+  memcpy(send_buffer, arr, size);
+
+  zmq_msg_init_data(&msg, send_buffer, size, _dealloc, hint);
+  rc = _send_msg(r, &msg, 0);
+  zmq_msg_close(&msg);
+ 
+#ifdef __DEBUG__
+  fprintf(stderr, ".\n");
+#endif
+
+  return rc;
+}
+
+
+int send_int_array_nocopy(role *r, const int arr[], size_t length,
+                          zmq_free_fn *ffn, void *hint)
+{
+  int rc = 0;
+  size_t size = sizeof(int) * length;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(size=%zu) ", __FUNCTION__, size);
+#endif
+
+  rc = _send_nocopy(r, arr, size, ffn, hint);
+
+#ifdef __DEBUG__
+  fprintf(stderr, ".\n");
+#endif
+
+  return rc;
+}
+
+
+int send_double_array_nocopy(role *r, const double arr[], size_t length,
+                             zmq_free_fn *ffn, void *hint)
+{
+  int rc = 0;
+  size_t size = sizeof(double) * length;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(size=%zu) ", __FUNCTION__, size);
+#endif
+
+  rc = _send_nocopy(r, arr, size, ffn, hint);
+
+#ifdef __DEBUG__
+  fprintf(stderr, ".\n");
+#endif
+
+  return rc;
+}
+
+
+int send_float_array_nocopy(role *r, const float arr[], size_t length,
+                            zmq_free_fn *ffn, void *hint)
+{
+  int rc = 0;
+  size_t size = sizeof(float) * length;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(size=%zu) ", __FUNCTION__, size);
+#endif
+
+  rc = _send_nocopy(r, arr, size, ffn, hint);
+
+#ifdef __DEBUG__
+  fprintf(stderr, ".\n");
+#endif
+
+  return rc;
+}
+
+
+/* ----- Reusable send buffers ---------------------------------------------- */
+
+
+sess_buf *sess_buf_alloc(size_t size)
+{
+  sess_buf *buf = (sess_buf *)malloc(sizeof(sess_buf));
+  if (buf == NULL) return NULL;
+
+  // Cache line aligned, for halo buffers touched by compute kernels.
+  if (posix_memalign(&buf->data, 64, size) != 0) {
+    free(buf);
+    return NULL;
+  }
+  buf->size = size;
+  buf->inflight = 0;
+
+  return buf;
+}
+
+
+void sess_buf_free(sess_buf *buf)
+{
+  if (buf == NULL) return;
+  sess_buf_wait(buf);
+  free(buf->data);
+  free(buf);
+}
+
+
+int sess_buf_busy(const sess_buf *buf)
+{
+  return buf->inflight;
+}
+
+
+void sess_buf_wait(sess_buf *buf)
+{
+  while (buf->inflight > 0) {
+    sched_yield();
+  }
+  __sync_synchronize(); // Do not let writes to buf move above the wait.
+}
+
+
+int send_buf(role *r, sess_buf *buf, size_t size)
+{
+  int rc = 0;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(size=%zu) ", __FUNCTION__, size);
+#endif
+
+  if (size > buf->size) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  __sync_fetch_and_add(&buf->inflight, 1);
+  rc = _send_nocopy(r, buf->data, size, _sess_buf_release, buf);
+
+#ifdef __DEBUG__
+  fprintf(stderr, ".\n");
+#endif
+
+  return rc;
+}
+
+
+int __send_blob(role *r, const void *blob, size_t length)
+{
+  int rc = 0;
+  zmq_msg_t msg;
+  void *hint;
+  void *send_buffer;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(size=%zu) ", __FUNCTION__, length);
+#endif
+
+  send_buffer = _send_alloc(r, length, &hint);
+  memcpy(send_buffer, blob, length);
+
+  zmq_msg_init_data(&msg, send_buffer, length, _dealloc, hint);
+  rc = _send_msg(r, &msg, 0);
+  zmq_msg_close(&msg);
+
+#ifdef __DEBUG__
+  fprintf(stderr, ".\n");
+#endif
+
+  return rc;
+}
+
+
+/* ----- Batching ----------------------------------------------------------- */
+
+
+int sess_batch(role *r, size_t max_size, unsigned max_usecs)
+{
+  endpoint_t *endpoint = _endpoint_of(r);
+
+  if (endpoint == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (sess_flush(r) != 0) return -1; // Batch buffer is sized by max_size.
+
+  endpoint->batch_limit = max_size;
+  endpoint->batch_usecs = max_usecs;
+
+  return 0;
+}
+
+
+int sess_flush(role *r)
+{
+  int rc = 0;
+  zmq_msg_t header;
+  zmq_msg_t batch;
+  endpoint_t *endpoint = _endpoint_of(r);
+
+  if (endpoint == NULL || endpoint->batch == NULL) return 0;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(size=%zu) ", __FUNCTION__, endpoint->batch_used);
+#endif
+
+  if (endpoint->cond_pending && _send_cond_header(endpoint, 0) != 0) return -1;
+
+  zmq_msg_init_size(&header, 1);
+  *(char *)zmq_msg_data(&header) = CTRL_BATCH;
+  rc = zmq_send(r, &header, ZMQ_SNDMORE);
+  zmq_msg_close(&header);
+
+  zmq_msg_init_data(&batch, endpoint->batch, endpoint->batch_used,
+                    _dealloc, endpoint->batch_hint);
+  endpoint->batch = NULL;
+  endpoint->batch_used = 0;
+  endpoint->sess->nr_of_pending_batches--;
+  if (rc == 0) {
+    rc = zmq_send(r, &batch, 0);
+  }
+  zmq_msg_close(&batch);
+
+#ifdef __DEBUG__
+  fprintf(stderr, ".\n");
+#endif
+
+  return rc;
+}
+
+
+/* ----- Receive ------------------------------------------------------------ */
+
+
+int recv_view(role *r, sess_msg *m)
+{
+  int rc = 0;
+  int cond, has_cond;
+
+  rc = _recv_msg(r, m, &cond, &has_cond);
+  if (has_cond) {
+    fprintf(stderr, "%s: Unexpected loop condition %d dropped\n",
+                      __FUNCTION__, cond);
+  }
+
+  return rc;
+}
+
+
+void *sess_msg_data(sess_msg *m)
+{
+  return (char *)zmq_msg_data(&m->msg) + m->offset;
+}
+
+
+size_t sess_msg_size(const sess_msg *m)
+{
+  return m->size;
+}
+
+
+void sess_msg_release(sess_msg *m)
+{
+  zmq_msg_close(&m->msg);
+  m->offset = 0;
+  m->size = 0;
+}
+
+
+int recv_int_array_view(role *r, sess_msg *m, const int **arr, size_t *length)
+{
+  int rc = 0;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+#endif
+
+  rc = recv_view(r, m);
+  if (rc != 0) {
+    *arr = NULL;
+    *length = 0;
+    return rc;
+  }
+  *arr = (const int *)sess_msg_data(m);
+  *length = sess_msg_size(m) / sizeof(int);
+
+#ifdef __DEBUG__
+  fprintf(stderr, "[%zu] .\n", *length);
+#endif
+
+  return rc;
+}
+
+
+int recv_double_array_view(role *r, sess_msg *m, const double **arr, size_t *length)
+{
+  int rc = 0;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+#endif
+
+  rc = recv_view(r, m);
+  if (rc != 0) {
+    *arr = NULL;
+    *length = 0;
+    return rc;
+  }
+  *arr = (const double *)sess_msg_data(m);
+  *length = sess_msg_size(m) / sizeof(double);
+
+#ifdef __DEBUG__
+  fprintf(stderr, "[%zu] .\n", *length);
+#endif
+
+  return rc;
+}
+
+
+int recv_float_array_view(role *r, sess_msg *m, const float **arr, size_t *length)
+{
+  int rc = 0;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+#endif
+
+  rc = recv_view(r, m);
+  if (rc != 0) {
+    *arr = NULL;
+    *length = 0;
+    return rc;
+  }
+  *arr = (const float *)sess_msg_data(m);
+  *length = sess_msg_size(m) / sizeof(float);
+
+#ifdef __DEBUG__
+  fprintf(stderr, "[%zu] .\n", *length);
+#endif
+
+  return rc;
+}
+
+
+int receive_int(role *r, int **dst)
+{
+  int rc = 0;
+  sess_msg msg;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+#endif
+
+  rc = recv_view(r, &msg);
+  if (rc != 0) {
+    sess_msg_release(&msg);
+    return rc;
+  }
+  *dst = (int *)malloc(sizeof(int));
+  assert(sess_msg_size(&msg) == sizeof(int));
+  memcpy(*dst, (int *)sess_msg_data(&msg), sess_msg_size(&msg));
+  sess_msg_release(&msg);
+
+#ifdef __DEBUG__
+  fprintf(stderr, "[%d] .\n", **dst);
+#endif
+
+  return rc;
+}
+
+
+int recv_int(role *r, int *dst)
+{
+  int rc = 0;
+  sess_msg msg;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+#endif
+
+  rc = recv_view(r, &msg);
+  if (rc != 0) {
+    sess_msg_release(&msg);
+    return rc;
+  }
+  assert(sess_msg_size(&msg) == sizeof(int));
+  memcpy(dst, (int *)sess_msg_data(&msg), sess_msg_size(&msg));
+  sess_msg_release(&msg);
+
+#ifdef __DEBUG__
+  fprintf(stderr, "[%d] .\n", *dst);
+#endif
+
+  return rc;
+}
+
+
+int receive_int_array(role *r, int **arr, size_t *length)
+{
+  int rc = 0;
+  sess_msg msg;
+  size_t size = -1;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+#endif
+
+  rc = recv_view(r, &msg);
+  if (rc != 0) {
+    sess_msg_release(&msg);
+    return rc;
+  }
+  size = sess_msg_size(&msg);
+  *arr = (int *)malloc(size);
+  memcpy(*arr, (int *)sess_msg_data(&msg), size);
+  if (size % sizeof(int) == 0) {
+    *length = size / sizeof(int);
+  }
+  sess_msg_release(&msg);
+
+#ifdef __DEBUG__
+  fprintf(stderr, "[%d/%zu] .\n", **arr, *length);
+#endif
+
+  return rc;
+}
+
+
+int recv_int_array(role *r, int *arr, size_t *arr_size)
+{
+  int rc = 0;
+  sess_msg msg;
+  size_t size = -1;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+#endif
+
+  rc = recv_view(r, &msg);
+  if (rc != 0) {
+    sess_msg_release(&msg);
+    return rc;
+  }
+  size = sess_msg_size(&msg);
+  if (*arr_size * sizeof(int) >= size) {
+    memcpy(arr, (int *)sess_msg_data(&msg), size);
+    if (size % sizeof(int) == 0) {
+      *arr_size = size / sizeof(int);
+    }
+  } else {
+    memcpy(arr, (int *)sess_msg_data(&msg), *arr_size * sizeof(int));
+    fprintf(stderr,
+      "%s: Received data (%zu bytes) > memory size (%zu), data truncated\n",
+      __FUNCTION__, size, *arr_size);
+  }
+  sess_msg_release(&msg);
+
+#ifdef __DEBUG__
+  fprintf(stderr, "[%d/%zu] .\n", *arr, *arr_size);
+#endif
+
+  return rc;
+}
+
+
+int receive_char(role *r, char **dst)
+{
+  int rc = 0;
+  sess_msg msg;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+#endif
+
+  rc = recv_view(r, &msg);
+  if (rc != 0) {
+    sess_msg_release(&msg);
+    return rc;
+  }
+  *dst = (char *)malloc(sizeof(char));
+  assert(sess_msg_size(&msg) == sizeof(char));
+  memcpy(*dst, (char *)sess_msg_data(&msg), sess_msg_size(&msg));
+  sess_msg_release(&msg);
+
+#ifdef __DEBUG__
+  fprintf(stderr, "[%c] .\n", **dst);
+#endif
+
+  return rc;
+}
+
+
+int recv_char(role *r, char *dst)
+{
+  int rc = 0;
+  sess_msg msg;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+#endif
+
+  rc = recv_view(r, &msg);
+  if (rc != 0) {
+    sess_msg_release(&msg);
+    return rc;
+  }
+  assert(sess_msg_size(&msg) == sizeof(char));
+  memcpy(dst, (char *)sess_msg_data(&msg), sess_msg_size(&msg));
+  sess_msg_release(&msg);
+
+#ifdef __DEBUG__
+  fprintf(stderr, "[%c] .\n", *dst);
+#endif
+
+  return rc;
+}
+
+
+int receive_string(role *r, char **dst)
+{
+  int rc = 0;
+  size_t size = -1;
+  sess_msg msg;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+#endif
+
+  rc = recv_view(r, &msg);
+  if (rc != 0) {
+    sess_msg_release(&msg);
+    return rc;
+  }
+  size = sess_msg_size(&msg);
+  *dst = (char *)malloc(size + 1);
+  strncpy(*dst, sess_msg_data(&msg), size);
+  (*dst)[size] = 0; // NULL-terminate
+  sess_msg_release(&msg);
+
+#ifdef __DEBUG__
+  fprintf(stderr, "[%s/%zu] .\n", *dst, size);
+#endif
+
+  return rc;
+}
+
+
+int receive_double(role *r, double **dst)
+{
+  int rc = 0;
+  sess_msg msg;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+#endif
+
+  rc = recv_view(r, &msg);
+  if (rc != 0) {
+    sess_msg_release(&msg);
+    return rc;
+  }
+  *dst = (double *)malloc(sizeof(double));
+  assert(sess_msg_size(&msg) == sizeof(double));
+  memcpy(*dst, (double *)sess_msg_data(&msg), sess_msg_size(&msg));
+  sess_msg_release(&msg);
+
+#ifdef __DEBUG__
+  fprintf(stderr, "[%f] .\n", **dst);
+#endif
+
+  return rc;
+}
+
+
+int recv_double(role *r, double *dst)
+{
+  int rc = 0;
+  sess_msg msg;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+#endif
+
+  rc = recv_view(r, &msg);
+  if (rc != 0) {
+    sess_msg_release(&msg);
+    return rc;
+  }
+  assert(sess_msg_size(&msg) == sizeof(double));
+  memcpy(dst, (double *)sess_msg_data(&msg), sess_msg_size(&msg));
+  sess_msg_release(&msg);
+
+#ifdef __DEBUG__
+  fprintf(stderr, "[%f] .\n", *dst);
+#endif
+
+  return rc;
+}
+
+
+int receive_double_array(role *r, double **arr, size_t *length)
+{
+  int rc = 0;
+  sess_msg msg;
+  size_t size = -1;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+#endif
+
+  rc = recv_view(r, &msg);
+  if (rc != 0) {
+    sess_msg_release(&msg);
+    return rc;
+  }
+  size = sess_msg_size(&msg);
+  *arr = (double *)malloc(size);
+  memcpy(*arr, (double *)sess_msg_data(&msg), size);
+  if (size % sizeof(double) == 0) {
+    *length = size / sizeof(double);
+  }
+  sess_msg_release(&msg);
+
+#ifdef __DEBUG__
+  fprintf(stderr, "[%f/%zu] .\n", **arr, *length);
+#endif
+
+  return rc;
+}
+
+
+int recv_double_array(role *r, double *arr, size_t *arr_size)
+{
+  int rc = 0;
+  sess_msg msg;
+  size_t size = -1;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+#endif
+
+  rc = recv_view(r, &msg);
+  if (rc != 0) {
+    sess_msg_release(&msg);
+    return rc;
+  }
+  size = sess_msg_size(&msg);
+  if (*arr_size * sizeof(double) >= size) {
+    memcpy(arr, (double *)sess_msg_data(&msg), size);
+    if (size % sizeof(double) == 0) {
+      *arr_size = size / sizeof(double);
+    }
+  } else {
+    memcpy(arr, (double *)sess_msg_data(&msg), *arr_size * sizeof(double));
+    fprintf(stderr,
+      "%s: Received data (%zu bytes) > memory size (%zu), data truncated\n",
+      __FUNCTION__, size, *arr_size);
+  }
+  sess_msg_release(&msg);
+
+#ifdef __DEBUG__
+  fprintf(stderr, "[%f/%zu] .\n", *arr, *arr_size);
+#endif
+
+  return rc;
+}
+
+
+int receive_float(role *r, float **dst)
+{
+  int rc = 0;
+  sess_msg msg;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+#endif
+
+  rc = recv_view(r, &msg);
+  if (rc != 0) {
+    sess_msg_release(&msg);
+    return rc;
+  }
+  *dst = (float *)malloc(sizeof(float));
+  assert(sess_msg_size(&msg) == sizeof(float));
+  memcpy(*dst, (float *)sess_msg_data(&msg), sess_msg_size(&msg));
+  sess_msg_release(&msg);
+
+#ifdef __DEBUG__
+  fprintf(stderr, "[%f] .\n", **dst);
+#endif
+
+  return rc;
+}
+
+
+int recv_float(role *r, float *dst)
+{
+  int rc = 0;
+  sess_msg msg;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+#endif
+
+  rc = recv_view(r, &msg);
+  if (rc != 0) {
+    sess_msg_release(&msg);
+    return rc;
+  }
+  assert(sess_msg_size(&msg) == sizeof(float));
+  memcpy(dst, (float *)sess_msg_data(&msg), sess_msg_size(&msg));
+  sess_msg_release(&msg);
+
+#ifdef __DEBUG__
+  fprintf(stderr, "[%f] .\n", *dst);
+#endif
+
+  return rc;
+}
+
+
+int receive_float_array(role *r, float **arr, size_t *length)
+{
+  int rc = 0;
+  sess_msg msg;
+  size_t size = -1;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+#endif
+
+  rc = recv_view(r, &msg);
+  if (rc != 0) {
+    sess_msg_release(&msg);
+    return rc;
+  }
+  size = sess_msg_size(&msg);
+  *arr = (float *)malloc(size);
+  memcpy(*arr, (float *)sess_msg_data(&msg), size);
+  if (size % sizeof(float) == 0) {
+    *length = size / sizeof(float);
+  }
+  sess_msg_release(&msg);
+
+#ifdef __DEBUG__
+  fprintf(stderr, "[%f/%zu] .\n", **arr, *length);
+#endif
+
+  return rc;
+}
+
+
+int recv_float_array(role *r, float *arr, size_t *arr_size)
+{
+  int rc = 0;
+  sess_msg msg;
+  size_t size = -1;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+#endif
+
+  rc = recv_view(r, &msg);
+  if (rc != 0) {
+    sess_msg_release(&msg);
+    return rc;
+  }
+  size = sess_msg_size(&msg);
+  if (*arr_size * sizeof(float) >= size) {
+    memcpy(arr, (float *)sess_msg_data(&msg), size);
+    if (size % sizeof(float) == 0) {
+      *arr_size = size / sizeof(float);
+    }
+  } else {
+    memcpy(arr, (float *)sess_msg_data(&msg), *arr_size * sizeof(float));
+    fprintf(stderr,
+      "%s: Received data (%zu bytes) > memory size (%zu), data truncated\n",
+      __FUNCTION__, size, *arr_size);
+  }
+  sess_msg_release(&msg);
+
+#ifdef __DEBUG__
+  fprintf(stderr, "[%f/%zu] .\n", *arr, *arr_size);
+#endif
+
+  return rc;
+}
+
+
+int __receive_blob(role *r, void **dst, size_t *length)
+{
+  int rc = 0;
+  sess_msg msg;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+#endif
+
+  rc = recv_view(r, &msg);
+  if (rc != 0) {
+    sess_msg_release(&msg);
+    return rc;
+  }
+  *length = sess_msg_size(&msg);
+  *dst = malloc(*length);
+  memcpy(*dst, sess_msg_data(&msg), *length);
+  sess_msg_release(&msg);
+
+#ifdef __DEBUG__
+  fprintf(stderr, "[%zu] .\n", *length);
+#endif
+
+  return rc;
+}
+
+
+int __recv_blob(role *r, void *dst, size_t *length)
+{
+  int rc = 0;
+  sess_msg msg;
+  size_t size;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+#endif
+
+  rc = recv_view(r, &msg);
+  if (rc != 0) {
+    sess_msg_release(&msg);
+    return rc;
+  }
+  size = sess_msg_size(&msg);
+  if (*length >= size) {
+    memcpy(dst, sess_msg_data(&msg), size);
+    *length = size;
+  } else {
+    memcpy(dst, sess_msg_data(&msg), *length);
+    fprintf(stderr,
+      "%s: Received data (%zu bytes) > memory size (%zu), data truncated\n",
+      __FUNCTION__, size, *length);
+  }
+  sess_msg_release(&msg);
+
+#ifdef __DEBUG__
+  fprintf(stderr, "[%zu] .\n", *length);
+#endif
+
+  return rc;
+}
+
+
+/* ----- Non-blocking ------------------------------------------------------- */
+
+
+sess_req *_req_new(role *r)
+{
+  void *hint;
+  sess_req *req = (sess_req *)_send_alloc(r, sizeof(sess_req), &hint);
+
+  memset(req, 0, sizeof(sess_req));
+  req->hint = hint;
+  req->endpoint = _endpoint_of(r);
+
+  return req;
+}
+
+
+/**
+ * \brief Helper function to post a send of a copy of data.
+ *
+ * The send is tried at once without blocking, and queued on the endpoint
+ * if the socket is not ready or earlier sends are still queued.
+ */
+sess_req *_isend(role *r, const void *data, size_t size)
+{
+  zmq_msg_t msg;
+  void *hint;
+  sess_req *req = _req_new(r);
+  endpoint_t *endpoint = req->endpoint;
+
+  if (size <= ZMQ_MAX_VSM_SIZE) {
+    zmq_msg_init_size(&msg, size);
+    memcpy(zmq_msg_data(&msg), data, size);
+  } else {
+    void *send_buffer = _send_alloc(r, size, &hint);
+    memcpy(send_buffer, data, size);
+    zmq_msg_init_data(&msg, send_buffer, size, _dealloc, hint);
+  }
+
+  if (endpoint == NULL) { // Cannot be queued, send it now.
+    req->rc = zmq_send(r, &msg, 0);
+    req->done = 1;
+  } else if (endpoint->sends == NULL
+             && ((req->rc = _send_now(endpoint, r, &msg, ZMQ_NOBLOCK)) == 0
+                 || errno != EAGAIN)) {
+    req->done = 1;
+  } else {
+    zmq_msg_init(&req->msg);
+    zmq_msg_move(&req->msg, &msg);
+    req->rc = 0;
+    req->next = NULL;
+    if (endpoint->sends == NULL) {
+      endpoint->sends = req;
+    } else {
+      endpoint->sends_tail->next = req;
+    }
+    endpoint->sends_tail = req;
+    endpoint->sess->nr_of_pending_reqs++;
+  }
+  zmq_msg_close(&msg);
+
+  return req;
+}
+
+
+/**
+ * \brief Helper function to post a receive.
+ *
+ * length is NULL for a scalar of elem_size bytes, otherwise the capacity
+ * of dst in elements, updated to the number of elements received.
+ */
+sess_req *_irecv(role *r, void *dst, size_t elem_size, size_t *length)
+{
+  sess_msg m;
+  sess_req *req = _req_new(r);
+  endpoint_t *endpoint = req->endpoint;
+
+  req->dst = dst;
+  req->elem_size = elem_size;
+  req->length = length;
+
+  if (endpoint == NULL) { // Cannot be queued, receive it now.
+    _complete_recv(req, &m, recv_view(r, &m));
+    return req;
+  }
+
+  req->next = NULL;
+  if (endpoint->recvs == NULL) {
+    endpoint->recvs = req;
+  } else {
+    endpoint->recvs_tail->next = req;
+  }
+  endpoint->recvs_tail = req;
+  endpoint->sess->nr_of_pending_reqs++;
+
+  if (endpoint->stashed) { // Already here.
+    _progress_recvs(endpoint, 0);
+  }
+
+  return req;
+}
+
+
+/**
+ * \brief Helper function to make progress on the requests of a session.
+ *
+ * Polls the endpoints with queued sends or posted receives for at most
+ * timeout (as zmq_poll, -1 waits until one is ready) and serves all
+ * that are ready.
+ */
+int _progress(session *s, long timeout)
+{
+  unsigned endpoint_idx;
+  int i;
+  int nr_of_items = 0;
+  endpoint_t *endpoint;
+  zmq_pollitem_t items[s->endpoints_count];
+  endpoint_t *owners[s->endpoints_count];
+
+  if (s->nr_of_pending_reqs == 0) return 0;
+
+  for (endpoint_idx=0; endpoint_idx<s->endpoints_count; ++endpoint_idx) {
+    endpoint = s->endpoints[endpoint_idx];
+    if (endpoint->recvs != NULL && endpoint->stashed) {
+      _progress_recvs(endpoint, 0);
+      timeout = 0; // Something completed, do not wait.
+    }
+    if (endpoint->sends == NULL && endpoint->recvs == NULL) continue;
+
+    items[nr_of_items].socket = endpoint->role_ptr;
+    items[nr_of_items].fd = 0;
+    items[nr_of_items].events = (endpoint->sends != NULL ? ZMQ_POLLOUT : 0)
+                              | (endpoint->recvs != NULL ? ZMQ_POLLIN : 0);
+    items[nr_of_items].revents = 0;
+    owners[nr_of_items] = endpoint;
+    nr_of_items++;
+  }
+  if (nr_of_items == 0) return 0;
+
+  if (timeout != 0) {
+    _flush_session(s); // Peers may wait for them before we get anything.
+  }
+
+  if (zmq_poll(items, nr_of_items, timeout) == -1) {
+    if (errno == EINTR) return 0;
+    perror("zmq_poll");
+    return -1;
+  }
+
+  for (i=0; i<nr_of_items; ++i) {
+    if (items[i].revents & ZMQ_POLLOUT) {
+      _progress_sends(owners[i], ZMQ_NOBLOCK);
+    }
+    if (items[i].revents & ZMQ_POLLIN) {
+      _progress_recvs(owners[i], 1);
+    }
+  }
+
+  return 0;
+}
+
+
+sess_req *isend_int(role *r, int val)
+{
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(%d) .\n", __FUNCTION__, val);
+#endif
+  return _isend(r, &val, sizeof(int));
+}
+
+
+sess_req *isend_int_array(role *r, const int arr[], size_t length)
+{
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(size=%zu) .\n", __FUNCTION__, sizeof(int) * length);
+#endif
+  return _isend(r, arr, sizeof(int) * length);
+}
+
+
+sess_req *isend_double(role *r, double val)
+{
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(%f) .\n", __FUNCTION__, val);
+#endif
+  return _isend(r, &val, sizeof(double));
+}
+
+
+sess_req *isend_double_array(role *r, const double arr[], size_t length)
+{
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(size=%zu) .\n", __FUNCTION__, sizeof(double) * length);
+#endif
+  return _isend(r, arr, sizeof(double) * length);
+}
+
+
+sess_req *isend_float(role *r, float val)
+{
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(%f) .\n", __FUNCTION__, val);
+#endif
+  return _isend(r, &val, sizeof(float));
+}
+
+
+sess_req *isend_float_array(role *r, const float arr[], size_t length)
+{
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(size=%zu) .\n", __FUNCTION__, sizeof(float) * length);
+#endif
+  return _isend(r, arr, sizeof(float) * length);
+}
+
+
+sess_req *irecv_int(role *r, int *dst)
+{
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() .\n", __FUNCTION__);
+#endif
+  return _irecv(r, dst, sizeof(int), NULL);
+}
+
+
+sess_req *irecv_int_array(role *r, int *arr, size_t *arr_size)
+{
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() .\n", __FUNCTION__);
+#endif
+  return _irecv(r, arr, sizeof(int), arr_size);
+}
+
+
+sess_req *irecv_double(role *r, double *dst)
+{
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() .\n", __FUNCTION__);
+#endif
+  return _irecv(r, dst, sizeof(double), NULL);
+}
+
+
+sess_req *irecv_double_array(role *r, double *arr, size_t *arr_size)
+{
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() .\n", __FUNCTION__);
+#endif
+  return _irecv(r, arr, sizeof(double), arr_size);
+}
+
+
+sess_req *irecv_float(role *r, float *dst)
+{
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() .\n", __FUNCTION__);
+#endif
+  return _irecv(r, dst, sizeof(float), NULL);
+}
+
+
+sess_req *irecv_float_array(role *r, float *arr, size_t *arr_size)
+{
+#ifdef __DEBUG__
+  fprintf(stderr, " <-- %s() .\n", __FUNCTION__);
+#endif
+  return _irecv(r, arr, sizeof(float), arr_size);
+}
+
+
+int sess_test(sess_req *req)
+{
+  if (!req->done && _progress(req->endpoint->sess, 0) != 0) return -1;
+  return req->done;
+}
+
+
+int sess_wait(sess_req *req)
+{
+  int rc = 0;
+
+  while (!req->done) {
+    if (_progress(req->endpoint->sess, -1) != 0) return -1;
+  }
+  rc = req->rc;
+  _dealloc(req, req->hint);
+
+  return rc;
+}
+
+
+int sess_waitall(sess_req *reqs[], int nr_of_reqs)
+{
+  int rc = 0;
+  int i;
+
+  // Each wait serves the whole session, so later ones mostly find
+  // their requests done.
+  for (i=0; i<nr_of_reqs; ++i) {
+    if (sess_wait(reqs[i]) != 0) rc = -1;
+  }
+
+  return rc;
+}
+
+
+/* ----- Reactor ------------------------------------------------------------ */
+
+
+int sess_on_recv(session *s, role *r, sess_handler *handler, void *arg)
+{
+  endpoint_t *endpoint = _endpoint_of(r);
+
+  if (endpoint == NULL || endpoint->sess != s) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (endpoint->handler == NULL && handler != NULL) s->nr_of_handlers++;
+  if (endpoint->handler != NULL && handler == NULL) s->nr_of_handlers--;
+  endpoint->handler = handler;
+  endpoint->handler_arg = arg;
+
+  return 0;
+}
+
+
+/**
+ * \brief Helper function to pass the next message of an endpoint to its handler.
+ *
+ * Only called when the stash holds a message or the socket is readable,
+ * and no irecvs are posted, so it does not block. The handler is removed
+ * if it returns non-zero (unless it has installed another one).
+ */
+int _dispatch(endpoint_t *endpoint)
+{
+  int rc = 0;
+  int cond, has_cond;
+  sess_msg m;
+  sess_handler *handler = endpoint->handler;
+  session *s = endpoint->sess;
+
+  assert(endpoint->recvs == NULL);
+  if (!endpoint->stashed) {
+    rc = _recv_ahead(endpoint, &cond, &has_cond);
+    if (rc != 0) return rc;
+    if (has_cond) {
+      fprintf(stderr, "%s: Unexpected loop condition %d dropped\n",
+                        __FUNCTION__, cond);
+    }
+    if (!endpoint->stashed) return 0; // Empty batch, nothing to dispatch.
+  }
+
+  rc = _recv_msg(endpoint->role_ptr, &m, &cond, &has_cond);
+  if (rc != 0) {
+    sess_msg_release(&m);
+    return rc;
+  }
+  if (has_cond) {
+    fprintf(stderr, "%s: Unexpected loop condition %d dropped\n",
+                      __FUNCTION__, cond);
+  }
+
+  if (handler(s, endpoint->role_ptr, &m, endpoint->handler_arg) != 0
+      && endpoint->handler == handler) { // May have removed or replaced itself.
+    endpoint->handler = NULL;
+    s->nr_of_handlers--;
+  }
+  sess_msg_release(&m);
+
+  return 0;
+}
+
+
+int sess_run(session *s)
+{
+  int rc = 0;
+  unsigned endpoint_idx;
+  int i;
+  int nr_of_items;
+  long timeout;
+  endpoint_t *endpoint;
+  zmq_pollitem_t items[s->endpoints_count];
+  endpoint_t *owners[s->endpoints_count];
+
+  s->running = 1;
+  while (s->running && s->nr_of_handlers > 0) {
+    nr_of_items = 0;
+    timeout = -1;
+
+    for (endpoint_idx=0; endpoint_idx<s->endpoints_count; ++endpoint_idx) {
+      endpoint = s->endpoints[endpoint_idx];
+      if (endpoint->handler == NULL) continue;
+      if (endpoint->stashed) { // Rest of a batch.
+        timeout = 0;
+      }
+      items[nr_of_items].socket = endpoint->role_ptr;
+      items[nr_of_items].fd = 0;
+      items[nr_of_items].events = ZMQ_POLLIN;
+      items[nr_of_items].revents = 0;
+      owners[nr_of_items] = endpoint;
+      nr_of_items++;
+    }
+
+    if (timeout != 0) {
+      _flush_session(s); // Handlers may have sent something peers wait for.
+    }
+    if (zmq_poll(items, nr_of_items, timeout) == -1) {
+      if (errno == EINTR) continue;
+      perror("zmq_poll");
+      rc = -1;
+      break;
+    }
+
+    // One message per ready channel and round, so busy peers take turns.
+    for (i=0; i<nr_of_items && s->running; ++i) {
+      endpoint = owners[i];
+      if (endpoint->handler == NULL) continue; // Removed by a handler.
+      if (endpoint->recvs != NULL) { // Posted irecvs are served first.
+        _progress_recvs(endpoint, items[i].revents & ZMQ_POLLIN);
+        continue;
+      }
+      if (!(items[i].revents & ZMQ_POLLIN) && !endpoint->stashed) continue;
+      if (_dispatch(endpoint) != 0) {
+        rc = -1;
+        s->running = 0;
+      }
+    }
+  }
+  s->running = 0;
+
+  return rc;
+}
+
+
+void sess_stop(session *s)
+{
+  s->running = 0;
+}
+
+
+/* ----- Multicast -----------------------------------------------------------*/
+
+
+/**
+ * \brief Helper function to collect the target roles of a multicast.
+ *
+ * If nr_of_roles is _Others_idx, args holds a session and the targets are
+ * all roles declared in its endpoint Scribble, otherwise args holds
+ * nr_of_roles roles.
+ *
+ * \returns Number of roles stored in targets.
+ */
+int _collect_roles(int nr_of_roles, va_list args, role **targets)
+{
+  int i;
+  session *s;
+
+  if (nr_of_roles == _Others_idx) {
+    s = va_arg(args, session *);
+    assert(s->all_roles_count <= MAX_MULTICAST_ROLES);
+    for (i=0; i<s->all_roles_count; ++i) {
+      targets[i] = s->roles_by_id[i];
+    }
+    return s->all_roles_count;
+  }
+
+  assert(nr_of_roles <= MAX_MULTICAST_ROLES);
+  for (i=0; i<nr_of_roles; ++i) {
+    targets[i] = va_arg(args, role *);
+  }
+  return nr_of_roles;
+}
+
+
+/**
+ * Try to send a reference to msg to r without blocking.
+ */
+int _msend_try(role *r, zmq_msg_t *msg)
+{
+  int rc = 0;
+  int saved_errno;
+  zmq_msg_t copy;
+
+  zmq_msg_init(&copy);
+  zmq_msg_copy(&copy, msg); // Shares the buffer, only bumps its refcount.
+  rc = _send_msg(r, &copy, ZMQ_NOBLOCK);
+  saved_errno = errno;
+  zmq_msg_close(&copy);
+  errno = saved_errno;
+
+  return rc;
+}
+
+
+/**
+ * \brief Helper function to send one encoded message to many roles.
+ *
+ * All targets share the buffer of msg. Sends are first tried without
+ * blocking on every socket; sockets that are not ready are then served
+ * in whatever order zmq_poll reports them writable.
+ */
+int _msend_msg(zmq_msg_t *msg, role **targets, int nr_of_targets)
+{
+  int rc = 0;
+  int i;
+  int nr_of_pending = 0;
+  zmq_pollitem_t pending[MAX_MULTICAST_ROLES];
+
+  for (i=0; i<nr_of_targets; ++i) {
+    if (_msend_try(targets[i], msg) == 0) continue;
+    if (errno != EAGAIN) {
+      rc = -1;
+      continue;
+    }
+    pending[nr_of_pending].socket = targets[i];
+    pending[nr_of_pending].fd = 0;
+    pending[nr_of_pending].events = ZMQ_POLLOUT;
+    pending[nr_of_pending].revents = 0;
+    nr_of_pending++;
+  }
+
+  while (nr_of_pending > 0) {
+    if (zmq_poll(pending, nr_of_pending, -1) == -1) {
+      if (errno == EINTR) continue;
+      perror("zmq_poll");
+      return -1;
+    }
+    for (i=0; i<nr_of_pending; /* ++i only if still pending */) {
+      if (pending[i].revents & ZMQ_POLLOUT) {
+        if (_msend_try(pending[i].socket, msg) == 0) {
+          pending[i] = pending[--nr_of_pending]; // Done with this one.
+          continue;
+        }
+        if (errno != EAGAIN) {
+          rc = -1;
+          pending[i] = pending[--nr_of_pending]; // Give up on this one.
+          continue;
+        }
+      }
+      ++i;
+    }
+  }
+
+  return rc;
+}
+
+
+/**
+ * Helper function to multicast a scalar (stored inline, no allocation).
+ */
+int _msend_scalar(const void *val, size_t size, role **targets, int nr_of_targets)
+{
+  int rc = 0;
+  zmq_msg_t msg;
+
+  zmq_msg_init_size(&msg, size);
+  memcpy(zmq_msg_data(&msg), val, size);
+  rc = _msend_msg(&msg, targets, nr_of_targets);
+  zmq_msg_close(&msg);
+
+  return rc;
+}
+
+
+/**
+ * Helper function to multicast a copy of data (copied once for all targets).
+ */
+int _msend_copy(const void *data, size_t size, role **targets, int nr_of_targets)
+{
+  int rc = 0;
+  zmq_msg_t msg;
+  void *send_buffer;
+  void *hint;
+
+  if (nr_of_targets <= 0) return 0;
+
+  send_buffer = _send_alloc(targets[0], size, &hint);
+  memcpy(send_buffer, data, size);
+
+  zmq_msg_init_data(&msg, send_buffer, size, _dealloc, hint);
+  rc = _msend_msg(&msg, targets, nr_of_targets);
+  zmq_msg_close(&msg);
+
+  return rc;
+}
+
+
+int msend_int(int val, int nr_of_roles, ...)
+{
+  int rc = 0;
+  int nr_of_targets;
+  role *targets[MAX_MULTICAST_ROLES];
+  va_list roles;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(%d)@%d ", __FUNCTION__, val, nr_of_roles);
+#endif
+
+  va_start(roles, nr_of_roles);
+  nr_of_targets = _collect_roles(nr_of_roles, roles, targets);
+  va_end(roles);
+
+  rc = _msend_scalar(&val, sizeof(int), targets, nr_of_targets);
+
+#ifdef __DEBUG__
+  fprintf(stderr, ".\n");
+#endif
+
+  return rc;
+}
+
+
+int msend_int_array(const int arr[], size_t length, int nr_of_roles, ...)
+{
+  int rc = 0;
+  int nr_of_targets;
+  role *targets[MAX_MULTICAST_ROLES];
+  va_list roles;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(size=%zu)@%d ", __FUNCTION__, sizeof(int) * length, nr_of_roles);
+#endif
+
+  va_start(roles, nr_of_roles);
+  nr_of_targets = _collect_roles(nr_of_roles, roles, targets);
+  va_end(roles);
+
+  rc = _msend_copy(arr, sizeof(int) * length, targets, nr_of_targets);
+
+#ifdef __DEBUG__
+  fprintf(stderr, ".\n");
+#endif
+
+  return rc;
+}
+
+
+int msend_string(const char *str, int nr_of_roles, ...)
+{
+  int rc = 0;
+  int nr_of_targets;
+  role *targets[MAX_MULTICAST_ROLES];
+  va_list roles;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(%s)@%d ", __FUNCTION__, str, nr_of_roles);
+#endif
+
+  va_start(roles, nr_of_roles);
+  nr_of_targets = _collect_roles(nr_of_roles, roles, targets);
+  va_end(roles);
+
+  rc = _msend_copy(str, strlen(str), targets, nr_of_targets);
+
+#ifdef __DEBUG__
+  fprintf(stderr, ".\n");
+#endif
+
+  return rc;
+}
+
+
+int msend_double(double val, int nr_of_roles, ...)
+{
+  int rc = 0;
+  int nr_of_targets;
+  role *targets[MAX_MULTICAST_ROLES];
+  va_list roles;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(%f)@%d ", __FUNCTION__, val, nr_of_roles);
+#endif
+
+  va_start(roles, nr_of_roles);
+  nr_of_targets = _collect_roles(nr_of_roles, roles, targets);
+  va_end(roles);
+
+  rc = _msend_scalar(&val, sizeof(double), targets, nr_of_targets);
+
+#ifdef __DEBUG__
+  fprintf(stderr, ".\n");
+#endif
+
+  return rc;
+}
+
+
+int msend_double_array(const double arr[], size_t length, int nr_of_roles, ...)
+{
+  int rc = 0;
+  int nr_of_targets;
+  role *targets[MAX_MULTICAST_ROLES];
+  va_list roles;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(size=%zu)@%d ", __FUNCTION__, sizeof(double) * length, nr_of_roles);
+#endif
+
+  va_start(roles, nr_of_roles);
+  nr_of_targets = _collect_roles(nr_of_roles, roles, targets);
+  va_end(roles);
+
+  rc = _msend_copy(arr, sizeof(double) * length, targets, nr_of_targets);
+
+#ifdef __DEBUG__
+  fprintf(stderr, ".\n");
+#endif
+
+  return rc;
+}
+
+
+int msend_float(float val, int nr_of_roles, ...)
+{
+  int rc = 0;
+  int nr_of_targets;
+  role *targets[MAX_MULTICAST_ROLES];
+  va_list roles;
+
+#ifdef __DEBUG__
+  fprintf(stderr, " --> %s(%f)@%d ", __FUNCTION__, val, nr_of_roles);
+#endif
+
+  va_start(roles, nr_of_roles);
+  nr_of_targets = _collect_roles(nr_of_roles, roles, targets);
+  va_end(roles);
+
+  rc = _msend_scalar(&val, sizeof(float), targets, nr_of_targets);
+
 #ifdef __DEBUG__
-  fprintf(stderr, "Terminated session <%p>\n", s);
+  fprintf(stderr, ".\n");
 #endif
+
+  return rc;
 }
 
 
-/**
- * Set up a server socket and run session initiation checks.
- * Involves looking at Scribble files specified by both session initiation
- * to extract the roles.
- *
- * This is obsolete and will be removed in a future version.
- */
-role *sess_server(void *ctx, int type, const char *uri, const char *scribble)
+int msend_float_array(const float arr[], size_t length, int nr_of_roles, ...)
 {
+  int rc = 0;
+  int nr_of_targets;
+  role *targets[MAX_MULTICAST_ROLES];
+  va_list roles;
+
 #ifdef __DEBUG__
-  fprintf(stderr, " server_init\n   * bind(%s)\n   * Scribble(%s)\n", uri, scribble);
+  fprintf(stderr, " --> %s(size=%zu)@%d ", __FUNCTION__, sizeof(float) * length, nr_of_roles);
 #endif
 
-  role *r = zmq_socket(ctx, type);
+  va_start(roles, nr_of_roles);
+  nr_of_targets = _collect_roles(nr_of_roles, roles, targets);
+  va_end(roles);
 
-  if (zmq_bind(r, uri) != 0) perror(__FUNCTION__);
+  rc = _msend_copy(arr, sizeof(float) * length, targets, nr_of_targets);
 
 #ifdef __DEBUG__
-  fprintf(stderr, "%s: Session initiaion\n", __FUNCTION__);
+  fprintf(stderr, ".\n");
 #endif
 
-  return r;
+  return rc;
 }
 
 
 /**
- * Set up a client socket and run session initiation check.
- * The actual check is done locally in \ref sess_server and this function simply
- * forwards the Scribble filename to \ref sess_server.
+ * \brief Helper function to receive one message from each of many roles.
  *
- * This is obsolete and will be removed in a future version.
+ * Polls all sources and receives from whichever is ready first, storing
+ * the message from sources[i] in msgs[i], so a slow role does not delay
+ * receiving from the others.
+ *
+ * All msgs are initialised (empty) first, so they can be released even
+ * if receiving fails part way.
  */
-role *sess_client(void *ctx, int type, const char *uri, const char *scribble)
+int _mgather(role **sources, int nr_of_sources, sess_msg *msgs)
 {
-#ifdef __DEBUG__
-  fprintf(stderr, " client_init\n   * connect(%s)\n   * Scribble(%s)\n", uri, scribble);
-#endif
+  int rc = 0;
+  int i;
+  int nr_of_pending = 0;
+  int slot[MAX_MULTICAST_ROLES]; // Index in msgs of pending[i].
+  zmq_pollitem_t pending[MAX_MULTICAST_ROLES];
+  endpoint_t *endpoint;
 
-  role *r = zmq_socket(ctx, type);
+  for (i=0; i<nr_of_sources; ++i) {
+    _empty_msg(&msgs[i]);
+  }
 
-  if (zmq_connect(r, uri) != 0) perror(__FUNCTION__);
+  for (i=0; i<nr_of_sources; ++i) {
+    endpoint = _endpoint_of(sources[i]);
+    if (endpoint != NULL && endpoint->stashed) { // Received by inwhile.
+      rc |= recv_view(sources[i], &msgs[i]);
+      continue;
+    }
+    if (endpoint != NULL) {
+      _flush_session(endpoint->sess); // Peers may wait for them to send.
+    }
+    pending[nr_of_pending].socket = sources[i];
+    pending[nr_of_pending].fd = 0;
+    pending[nr_of_pending].events = ZMQ_POLLIN;
+    pending[nr_of_pending].revents = 0;
+    slot[nr_of_pending] = i;
+    nr_of_pending++;
+  }
 
-//  send_string(r, scribble); // Receive scribble filename
+  while (nr_of_pending > 0) {
+    if (zmq_poll(pending, nr_of_pending, -1) == -1) {
+      if (errno == EINTR) continue;
+      perror("zmq_poll");
+      return -1;
+    }
+    for (i=0; i<nr_of_pending; /* ++i only if still pending */) {
+      if (pending[i].revents & ZMQ_POLLIN) {
+        rc |= recv_view(pending[i].socket, &msgs[slot[i]]);
+        --nr_of_pending;
+        pending[i] = pending[nr_of_pending];
+        slot[i] = slot[nr_of_pending];
+        continue;
+      }
+      ++i;
+    }
+  }
 
-  return r;
+  return rc;
 }
 
 
-/* ----- Send --------------------------------------------------------------- */
-
-
-int send_int(role *r, int val)
+int mrecv_int(int *dst, int nr_of_roles, ...)
 {
   int rc = 0;
-  zmq_msg_t msg;
+  int i;
+  int nr_of_sources;
+  role *sources[MAX_MULTICAST_ROLES];
+  sess_msg msgs[MAX_MULTICAST_ROLES];
+  va_list roles;
 
 #ifdef __DEBUG__
-  fprintf(stderr, " --> %s(%d) ", __FUNCTION__, val);
+  fprintf(stderr, " <-- %s()@%d ", __FUNCTION__, nr_of_roles);
 #endif
 
-  int *buf = malloc(sizeof(int));
-  memcpy(buf, &val, sizeof(int));
+  va_start(roles, nr_of_roles);
+  nr_of_sources = _collect_roles(nr_of_roles, roles, sources);
+  va_end(roles);
+
+  rc = _mgather(sources, nr_of_sources, msgs);
+  for (i=0; i<nr_of_sources; ++i) {
+    if (rc == 0) {
+      assert(sess_msg_size(&msgs[i]) == sizeof(int));
+      memcpy(&dst[i], sess_msg_data(&msgs[i]), sizeof(int));
+    }
+    sess_msg_release(&msgs[i]);
+  }
 
-  zmq_msg_init_data(&msg, buf, sizeof(int), _dealloc, NULL);
-  rc = zmq_send(r, &msg, 0);
-  zmq_msg_close(&msg);
- 
 #ifdef __DEBUG__
   fprintf(stderr, ".\n");
 #endif
@@ -309,24 +3683,35 @@ int send_int(role *r, int val)
 }
 
 
-int send_int_array(role *r, const int arr[], size_t length)
+int mrecv_int_array(int *dst[], size_t length[], int nr_of_roles, ...)
 {
   int rc = 0;
-  zmq_msg_t msg;
-  size_t size = sizeof(int) * length;
+  int i;
+  int nr_of_sources;
+  size_t size;
+  role *sources[MAX_MULTICAST_ROLES];
+  sess_msg msgs[MAX_MULTICAST_ROLES];
+  va_list roles;
 
 #ifdef __DEBUG__
-  fprintf(stderr, " --> %s(size=%zu) ", __FUNCTION__, size);
+  fprintf(stderr, " <-- %s()@%d ", __FUNCTION__, nr_of_roles);
 #endif
 
-  // Copy to send buffer
-  int *send_buffer = (int *)malloc(size);
-  memcpy(send_buffer, arr, size);
+  va_start(roles, nr_of_roles);
+  nr_of_sources = _collect_roles(nr_of_roles, roles, sources);
+  va_end(roles);
+
+  rc = _mgather(sources, nr_of_sources, msgs);
+  for (i=0; i<nr_of_sources; ++i) {
+    if (rc == 0) {
+      size = sess_msg_size(&msgs[i]);
+      dst[i] = (int *)malloc(size);
+      memcpy(dst[i], sess_msg_data(&msgs[i]), size);
+      length[i] = size / sizeof(int);
+    }
+    sess_msg_release(&msgs[i]);
+  }
 
-  zmq_msg_init_data(&msg, send_buffer, size, _dealloc, NULL);
-  rc = zmq_send(r, &msg, 0);
-  zmq_msg_close(&msg);
- 
 #ifdef __DEBUG__
   fprintf(stderr, ".\n");
 #endif
@@ -335,22 +3720,35 @@ int send_int_array(role *r, const int arr[], size_t length)
 }
 
 
-int send_char(role *r, char val)
+int mrecv_string(char *dst[], int nr_of_roles, ...)
 {
   int rc = 0;
-  zmq_msg_t msg;
+  int i;
+  int nr_of_sources;
+  size_t size;
+  role *sources[MAX_MULTICAST_ROLES];
+  sess_msg msgs[MAX_MULTICAST_ROLES];
+  va_list roles;
 
 #ifdef __DEBUG__
-  fprintf(stderr, " --> %s(%d) ", __FUNCTION__, val);
+  fprintf(stderr, " <-- %s()@%d ", __FUNCTION__, nr_of_roles);
 #endif
 
-  int *buf = malloc(sizeof(char));
-  memcpy(buf, &val, sizeof(char));
+  va_start(roles, nr_of_roles);
+  nr_of_sources = _collect_roles(nr_of_roles, roles, sources);
+  va_end(roles);
+
+  rc = _mgather(sources, nr_of_sources, msgs);
+  for (i=0; i<nr_of_sources; ++i) {
+    if (rc == 0) {
+      size = sess_msg_size(&msgs[i]);
+      dst[i] = (char *)malloc(size + 1);
+      memcpy(dst[i], sess_msg_data(&msgs[i]), size);
+      dst[i][size] = 0; // NULL-terminate
+    }
+    sess_msg_release(&msgs[i]);
+  }
 
-  zmq_msg_init_data(&msg, buf, sizeof(char), _dealloc, NULL);
-  rc = zmq_send(r, &msg, 0);
-  zmq_msg_close(&msg);
- 
 #ifdef __DEBUG__
   fprintf(stderr, ".\n");
 #endif
@@ -359,26 +3757,32 @@ int send_char(role *r, char val)
 }
 
 
-int send_string(role *r, const char *string)
+int mrecv_double(double *dst, int nr_of_roles, ...)
 {
   int rc = 0;
-  size_t size = strlen(string);
-  zmq_msg_t msg;
+  int i;
+  int nr_of_sources;
+  role *sources[MAX_MULTICAST_ROLES];
+  sess_msg msgs[MAX_MULTICAST_ROLES];
+  va_list roles;
 
 #ifdef __DEBUG__
-  char *send_buffer = (char *)malloc(size + 1);
-  memcpy(send_buffer, string, size);
-  send_buffer[size] = 0;
-  fprintf(stderr, " --> %s(%s/%zu) ", __FUNCTION__, send_buffer, size);
-#else
-  char *send_buffer = (char *)malloc(size);
-  strncpy(send_buffer, string, size);
+  fprintf(stderr, " <-- %s()@%d ", __FUNCTION__, nr_of_roles);
 #endif
 
-  zmq_msg_init_data(&msg, send_buffer, size, _dealloc, NULL);
-  rc = zmq_send(r, &msg, 0);
-  zmq_msg_close(&msg);
- 
+  va_start(roles, nr_of_roles);
+  nr_of_sources = _collect_roles(nr_of_roles, roles, sources);
+  va_end(roles);
+
+  rc = _mgather(sources, nr_of_sources, msgs);
+  for (i=0; i<nr_of_sources; ++i) {
+    if (rc == 0) {
+      assert(sess_msg_size(&msgs[i]) == sizeof(double));
+      memcpy(&dst[i], sess_msg_data(&msgs[i]), sizeof(double));
+    }
+    sess_msg_release(&msgs[i]);
+  }
+
 #ifdef __DEBUG__
   fprintf(stderr, ".\n");
 #endif
@@ -387,22 +3791,35 @@ int send_string(role *r, const char *string)
 }
 
 
-int send_float(role *r, float val)
+int mrecv_double_array(double *dst[], size_t length[], int nr_of_roles, ...)
 {
   int rc = 0;
-  zmq_msg_t msg;
+  int i;
+  int nr_of_sources;
+  size_t size;
+  role *sources[MAX_MULTICAST_ROLES];
+  sess_msg msgs[MAX_MULTICAST_ROLES];
+  va_list roles;
 
 #ifdef __DEBUG__
-  fprintf(stderr, " --> %s(%f) ", __FUNCTION__, val);
+  fprintf(stderr, " <-- %s()@%d ", __FUNCTION__, nr_of_roles);
 #endif
 
-  float *buf = malloc(sizeof(float));
-  memcpy(buf, &val, sizeof(float));
+  va_start(roles, nr_of_roles);
+  nr_of_sources = _collect_roles(nr_of_roles, roles, sources);
+  va_end(roles);
+
+  rc = _mgather(sources, nr_of_sources, msgs);
+  for (i=0; i<nr_of_sources; ++i) {
+    if (rc == 0) {
+      size = sess_msg_size(&msgs[i]);
+      dst[i] = (double *)malloc(size);
+      memcpy(dst[i], sess_msg_data(&msgs[i]), size);
+      length[i] = size / sizeof(double);
+    }
+    sess_msg_release(&msgs[i]);
+  }
 
-  zmq_msg_init_data(&msg, buf, sizeof(float), _dealloc, NULL);
-  rc = zmq_send(r, &msg, 0);
-  zmq_msg_close(&msg);
- 
 #ifdef __DEBUG__
   fprintf(stderr, ".\n");
 #endif
@@ -411,24 +3828,32 @@ int send_float(role *r, float val)
 }
 
 
-int send_float_array(role *r, const float arr[], size_t length)
+int mrecv_float(float *dst, int nr_of_roles, ...)
 {
   int rc = 0;
-  zmq_msg_t msg;
-  size_t size = sizeof(float) * length;
+  int i;
+  int nr_of_sources;
+  role *sources[MAX_MULTICAST_ROLES];
+  sess_msg msgs[MAX_MULTICAST_ROLES];
+  va_list roles;
 
 #ifdef __DEBUG__
-  fprintf(stderr, " --> %s(size=%zu) ", __FUNCTION__, size);
+  fprintf(stderr, " <-- %s()@%d ", __FUNCTION__, nr_of_roles);
 #endif
 
-  // Copy to send buffer
-  float *send_buffer = (float *)malloc(size);
-  memcpy(send_buffer, arr, size);
+  va_start(roles, nr_of_roles);
+  nr_of_sources = _collect_roles(nr_of_roles, roles, sources);
+  va_end(roles);
+
+  rc = _mgather(sources, nr_of_sources, msgs);
+  for (i=0; i<nr_of_sources; ++i) {
+    if (rc == 0) {
+      assert(sess_msg_size(&msgs[i]) == sizeof(float));
+      memcpy(&dst[i], sess_msg_data(&msgs[i]), sizeof(float));
+    }
+    sess_msg_release(&msgs[i]);
+  }
 
-  zmq_msg_init_data(&msg, send_buffer, size, _dealloc, NULL);
-  rc = zmq_send(r, &msg, 0);
-  zmq_msg_close(&msg);
- 
 #ifdef __DEBUG__
   fprintf(stderr, ".\n");
 #endif
@@ -437,22 +3862,35 @@ int send_float_array(role *r, const float arr[], size_t length)
 }
 
 
-int send_double(role *r, double val)
+int mrecv_float_array(float *dst[], size_t length[], int nr_of_roles, ...)
 {
   int rc = 0;
-  zmq_msg_t msg;
+  int i;
+  int nr_of_sources;
+  size_t size;
+  role *sources[MAX_MULTICAST_ROLES];
+  sess_msg msgs[MAX_MULTICAST_ROLES];
+  va_list roles;
 
 #ifdef __DEBUG__
-  fprintf(stderr, " --> %s(%f) ", __FUNCTION__, val);
+  fprintf(stderr, " <-- %s()@%d ", __FUNCTION__, nr_of_roles);
 #endif
 
-  double *buf = malloc(sizeof(double));
-  memcpy(buf, &val, sizeof(double));
+  va_start(roles, nr_of_roles);
+  nr_of_sources = _collect_roles(nr_of_roles, roles, sources);
+  va_end(roles);
+
+  rc = _mgather(sources, nr_of_sources, msgs);
+  for (i=0; i<nr_of_sources; ++i) {
+    if (rc == 0) {
+      size = sess_msg_size(&msgs[i]);
+      dst[i] = (float *)malloc(size);
+      memcpy(dst[i], sess_msg_data(&msgs[i]), size);
+      length[i] = size / sizeof(float);
+    }
+    sess_msg_release(&msgs[i]);
+  }
 
-  zmq_msg_init_data(&msg, buf, sizeof(double), _dealloc, NULL);
-  rc = zmq_send(r, &msg, 0);
-  zmq_msg_close(&msg);
- 
 #ifdef __DEBUG__
   fprintf(stderr, ".\n");
 #endif
@@ -461,24 +3899,23 @@ int send_double(role *r, double val)
 }
 
 
-int send_double_array(role *r, const double arr[], size_t length)
+int mrecv_view(sess_msg msgs[], int nr_of_roles, ...)
 {
   int rc = 0;
-  zmq_msg_t msg;
-  size_t size = sizeof(double) * length;
+  int nr_of_sources;
+  role *sources[MAX_MULTICAST_ROLES];
+  va_list roles;
 
 #ifdef __DEBUG__
-  fprintf(stderr, " --> %s(size=%zu) ", __FUNCTION__, size);
+  fprintf(stderr, " <-- %s()@%d ", __FUNCTION__, nr_of_roles);
 #endif
 
-  // Copy to send buffer
-  double *send_buffer = (double *)malloc(size);
-  memcpy(send_buffer, arr, size);
+  va_start(roles, nr_of_roles);
+  nr_of_sources = _collect_roles(nr_of_roles, roles, sources);
+  va_end(roles);
+
+  rc = _mgather(sources, nr_of_sources, msgs);
 
-  zmq_msg_init_data(&msg, send_buffer, size, _dealloc, NULL);
-  rc = zmq_send(r, &msg, 0);
-  zmq_msg_close(&msg);
- 
 #ifdef __DEBUG__
   fprintf(stderr, ".\n");
 #endif
@@ -487,444 +3924,510 @@ int send_double_array(role *r, const double arr[], size_t length)
 }
 
 
-/* ----- Receive ------------------------------------------------------------ */
+/* ----- Collectives -------------------------------------------------------- */
 
+#define COLL_LARGE_MSG_SIZE (64*1024) // Bandwidth-optimal schedules from here.
+#define COLL_SEGMENT_SIZE (64*1024) // Pipeline unit of chain broadcasts.
 
-int receive_int(role *r, int **dst)
-{
-  int rc = 0;
-  zmq_msg_t msg;
+typedef void (*combine_fn)(void *acc, const void *in, size_t count, sess_op op);
 
-#ifdef __DEBUG__
-  fprintf(stderr, " <-- %s() ", __FUNCTION__);
-#endif
 
-  zmq_msg_init(&msg);
-  rc = zmq_recv(r, &msg, 0);
-  *dst = (int *)malloc(sizeof(int));
-  assert(zmq_msg_size(&msg) == sizeof(int));
-  memcpy(*dst, (int *)zmq_msg_data(&msg), zmq_msg_size(&msg));
-  zmq_msg_close(&msg);
+void _combine_int(void *acc, const void *in, size_t count, sess_op op)
+{
+  int *a = (int *)acc;
+  const int *b = (const int *)in;
+  size_t i;
+
+  switch (op) {
+    case SESS_SUM:
+      for (i=0; i<count; ++i) a[i] += b[i];
+      break;
+    case SESS_MIN:
+      for (i=0; i<count; ++i) if (b[i] < a[i]) a[i] = b[i];
+      break;
+    case SESS_MAX:
+      for (i=0; i<count; ++i) if (b[i] > a[i]) a[i] = b[i];
+      break;
+  }
+}
 
-#ifdef __DEBUG__
-  fprintf(stderr, "[%d] .\n", **dst);
-#endif
 
-  return rc;
+void _combine_double(void *acc, const void *in, size_t count, sess_op op)
+{
+  double *a = (double *)acc;
+  const double *b = (const double *)in;
+  size_t i;
+
+  switch (op) {
+    case SESS_SUM:
+      for (i=0; i<count; ++i) a[i] += b[i];
+      break;
+    case SESS_MIN:
+      for (i=0; i<count; ++i) if (b[i] < a[i]) a[i] = b[i];
+      break;
+    case SESS_MAX:
+      for (i=0; i<count; ++i) if (b[i] > a[i]) a[i] = b[i];
+      break;
+  }
 }
 
 
-int recv_int(role *r, int *dst)
+void _combine_float(void *acc, const void *in, size_t count, sess_op op)
 {
-  int rc = 0;
-  zmq_msg_t msg;
+  float *a = (float *)acc;
+  const float *b = (const float *)in;
+  size_t i;
+
+  switch (op) {
+    case SESS_SUM:
+      for (i=0; i<count; ++i) a[i] += b[i];
+      break;
+    case SESS_MIN:
+      for (i=0; i<count; ++i) if (b[i] < a[i]) a[i] = b[i];
+      break;
+    case SESS_MAX:
+      for (i=0; i<count; ++i) if (b[i] > a[i]) a[i] = b[i];
+      break;
+  }
+}
 
-#ifdef __DEBUG__
-  fprintf(stderr, " <-- %s() ", __FUNCTION__);
-#endif
 
-  zmq_msg_init(&msg);
-  rc = zmq_recv(r, &msg, 0);
-  assert(zmq_msg_size(&msg) == sizeof(int));
-  memcpy(dst, (int *)zmq_msg_data(&msg), zmq_msg_size(&msg));
-  zmq_msg_close(&msg);
+/**
+ * Helper function to find the rank of a role, -1 if not in the session.
+ */
+int _rank_of(const session *s, const char *role_name)
+{
+  char **found = (char **)bsearch(&role_name, s->rank_names, s->nr_of_ranks,
+                                  sizeof(char *), _compare_role_names);
+  return found == NULL ? -1 : (int)(found - s->rank_names);
+}
 
-#ifdef __DEBUG__
-  fprintf(stderr, "[%d] .\n", *dst);
-#endif
+
+/**
+ * Helper function to receive exactly size bytes from a collective peer.
+ */
+int _coll_recv(role *r, void *buf, size_t size)
+{
+  int rc = 0;
+  sess_msg msg;
+
+  rc = recv_view(r, &msg);
+  if (rc == 0 && sess_msg_size(&msg) != size) {
+    fprintf(stderr, "%s: Received %zu bytes, expected %zu\n",
+                      __FUNCTION__, sess_msg_size(&msg), size);
+    errno = EPROTO;
+    rc = -1;
+  }
+  if (rc == 0) memcpy(buf, sess_msg_data(&msg), size);
+  sess_msg_release(&msg);
 
   return rc;
 }
 
 
-int receive_int_array(role *r, int **arr, size_t *length)
+/**
+ * Helper function to receive a partial result and combine it into acc.
+ * The received buffer is combined in place unless it is misaligned.
+ */
+int _coll_recv_combine(role *r, void *acc, size_t count, size_t elem_size,
+                       combine_fn combine, sess_op op)
 {
   int rc = 0;
-  zmq_msg_t msg;
-  size_t size = -1;
-
-#ifdef __DEBUG__
-  fprintf(stderr, " <-- %s() ", __FUNCTION__);
-#endif
-
-  zmq_msg_init(&msg);
-  rc = zmq_recv(r, &msg, 0);
-  size = zmq_msg_size(&msg);
-  *arr = (int *)malloc(size);
-  memcpy(*arr, (int *)zmq_msg_data(&msg), size);
-  if (size % sizeof(int) == 0) {
-    *length = size / sizeof(int);
+  sess_msg msg;
+  void *tmp;
+
+  rc = recv_view(r, &msg);
+  if (rc == 0 && sess_msg_size(&msg) != count * elem_size) {
+    fprintf(stderr, "%s: Received %zu bytes, expected %zu\n",
+                      __FUNCTION__, sess_msg_size(&msg), count * elem_size);
+    errno = EPROTO;
+    rc = -1;
   }
-  zmq_msg_close(&msg);
-
-#ifdef __DEBUG__
-  fprintf(stderr, "[%d/%zu] .\n", **arr, *length);
-#endif
+  if (rc == 0) {
+    if ((uintptr_t)sess_msg_data(&msg) % elem_size == 0) {
+      combine(acc, sess_msg_data(&msg), count, op);
+    } else { // Small messages are stored inline in zmq_msg_t.
+      tmp = malloc(count * elem_size);
+      memcpy(tmp, sess_msg_data(&msg), count * elem_size);
+      combine(acc, tmp, count, op);
+      free(tmp);
+    }
+  }
+  sess_msg_release(&msg);
 
   return rc;
 }
 
 
-int recv_int_array(role *r, int *arr, size_t *arr_size)
+/**
+ * \brief Helper function to broadcast along a binomial tree.
+ *
+ * Ranks are renumbered so root is 0; rank v receives from v minus its
+ * lowest set bit and forwards to v + 2^k for every 2^k below that bit.
+ */
+int _bcast_binomial(session *s, unsigned root, void *buf, size_t size)
 {
   int rc = 0;
-  zmq_msg_t msg;
-  size_t size = -1;
-
-#ifdef __DEBUG__
-  fprintf(stderr, " <-- %s() ", __FUNCTION__);
-#endif
-
-  zmq_msg_init(&msg);
-  rc = zmq_recv(r, &msg, 0);
-  size = zmq_msg_size(&msg);
-  if (*arr_size * sizeof(int) >= size) {
-    memcpy(arr, (int *)zmq_msg_data(&msg), size);
-    if (size % sizeof(int) == 0) {
-      *arr_size = size / sizeof(int);
+  unsigned n = s->nr_of_ranks;
+  unsigned vrank = (s->rank + n - root) % n;
+  unsigned mask;
+  int nr_of_children = 0;
+  role *children[MAX_MULTICAST_ROLES];
+
+  for (mask=1; mask<n; mask<<=1) {
+    if (vrank & mask) {
+      rc = _coll_recv(s->ranks[(s->rank + n - mask) % n], buf, size);
+      break;
+    }
+  }
+
+  for (mask>>=1; mask>0; mask>>=1) {
+    if (vrank + mask < n) {
+      children[nr_of_children++] = s->ranks[(s->rank + mask) % n];
     }
-  } else {
-    memcpy(arr, (int *)zmq_msg_data(&msg), *arr_size * sizeof(int));
-    fprintf(stderr,
-      "%s: Received data (%zu bytes) > memory size (%zu), data truncated\n",
-      __FUNCTION__, size, *arr_size);
   }
-  zmq_msg_close(&msg);
 
-#ifdef __DEBUG__
-  fprintf(stderr, "[%d/%zu] .\n", *arr, *arr_size);
-#endif
+  if (nr_of_children > 0 && _msend_copy(buf, size, children, nr_of_children) != 0) rc = -1;
 
   return rc;
 }
 
 
-int receive_char(role *r, char **dst)
+/**
+ * \brief Helper function to broadcast along a chain of ranks.
+ *
+ * The data is cut in segments which every rank forwards as soon as it has
+ * received them, so all links of the chain are busy at the same time.
+ */
+int _bcast_chain(session *s, unsigned root, void *buf, size_t size)
 {
   int rc = 0;
-  zmq_msg_t msg;
+  unsigned n = s->nr_of_ranks;
+  unsigned vrank = (s->rank + n - root) % n;
+  role *prev = vrank > 0 ? s->ranks[(s->rank + n - 1) % n] : NULL;
+  role *next = vrank < n-1 ? s->ranks[(s->rank + 1) % n] : NULL;
+  size_t offset, segment;
+
+  for (offset=0; offset<size; offset+=segment) {
+    segment = size - offset < COLL_SEGMENT_SIZE ? size - offset : COLL_SEGMENT_SIZE;
+    if (prev != NULL && _coll_recv(prev, (char *)buf + offset, segment) != 0) rc = -1;
+    if (next != NULL && __send_blob(next, (char *)buf + offset, segment) != 0) rc = -1;
+  }
 
-#ifdef __DEBUG__
-  fprintf(stderr, " <-- %s() ", __FUNCTION__);
-#endif
+  return rc;
+}
 
-  zmq_msg_init(&msg);
-  rc = zmq_recv(r, &msg, 0);
-  *dst = (char *)malloc(sizeof(char));
-  assert(zmq_msg_size(&msg) == sizeof(char));
-  memcpy(*dst, (char *)zmq_msg_data(&msg), zmq_msg_size(&msg));
-  zmq_msg_close(&msg);
 
-#ifdef __DEBUG__
-  fprintf(stderr, "[%c] .\n", **dst);
-#endif
+int _mbcast(session *s, const char *root, void *buf, size_t size)
+{
+  int root_rank = _rank_of(s, root);
 
-  return rc;
+  if (root_rank < 0) {
+    fprintf(stderr, "%s: Role %s not found in session.\n", __FUNCTION__, root);
+    errno = EINVAL;
+    return -1;
+  }
+  if (s->nr_of_ranks < 2) return 0;
+
+  if (size < COLL_LARGE_MSG_SIZE || s->nr_of_ranks == 2) {
+    return _bcast_binomial(s, root_rank, buf, size);
+  }
+  return _bcast_chain(s, root_rank, buf, size);
 }
 
 
-int recv_char(role *r, char *dst)
+/**
+ * \brief Helper function to reduce to root along a binomial tree.
+ *
+ * The mirror image of _bcast_binomial: every rank combines the partial
+ * results of its children, then sends the sum of its subtree to its parent.
+ */
+int _mreduce(session *s, const char *root, const void *src, void *dst,
+             size_t count, size_t elem_size, combine_fn combine, sess_op op)
 {
   int rc = 0;
-  zmq_msg_t msg;
+  int root_rank = _rank_of(s, root);
+  unsigned n = s->nr_of_ranks;
+  unsigned vrank, mask;
+  size_t size = count * elem_size;
+  void *acc;
+
+  if (root_rank < 0) {
+    fprintf(stderr, "%s: Role %s not found in session.\n", __FUNCTION__, root);
+    errno = EINVAL;
+    return -1;
+  }
+  vrank = (s->rank + n - root_rank) % n;
 
-#ifdef __DEBUG__
-  fprintf(stderr, " <-- %s() ", __FUNCTION__);
-#endif
+  acc = (vrank == 0) ? dst : malloc(size);
+  memmove(acc, src, size);
 
-  zmq_msg_init(&msg);
-  rc = zmq_recv(r, &msg, 0);
-  assert(zmq_msg_size(&msg) == sizeof(char));
-  memcpy(dst, (char *)zmq_msg_data(&msg), zmq_msg_size(&msg));
-  zmq_msg_close(&msg);
+  for (mask=1; mask<n; mask<<=1) {
+    if (vrank & mask) {
+      if (__send_blob(s->ranks[(s->rank + n - mask) % n], acc, size) != 0) rc = -1;
+      break;
+    }
+    if (vrank + mask < n) {
+      if (_coll_recv_combine(s->ranks[(s->rank + mask) % n], acc, count, elem_size, combine, op) != 0) rc = -1;
+    }
+  }
 
-#ifdef __DEBUG__
-  fprintf(stderr, "[%c] .\n", *dst);
-#endif
+  if (acc != dst) free(acc);
 
   return rc;
 }
 
 
-int receive_string(role *r, char **dst)
+/**
+ * \brief Helper function for allreduce by recursive doubling.
+ *
+ * In round k every rank exchanges its partial result with the rank 2^k
+ * away, so all ranks hold the result after log2(N) rounds. With N not a
+ * power of 2, the first 2*(N-pof2) ranks pair up beforehand and the even
+ * rank of each pair waits for the result.
+ */
+int _allreduce_doubling(session *s, void *dst, size_t count, size_t elem_size,
+                        combine_fn combine, sess_op op)
 {
   int rc = 0;
-  size_t size = -1;
-  zmq_msg_t msg;
-
-#ifdef __DEBUG__
-  fprintf(stderr, " <-- %s() ", __FUNCTION__);
-#endif
+  unsigned n = s->nr_of_ranks;
+  unsigned rank = s->rank;
+  unsigned pof2, rem, mask, peer, newpeer;
+  int newrank;
+  size_t size = count * elem_size;
+
+  for (pof2=1; pof2*2<=n; pof2<<=1);
+  rem = n - pof2;
+
+  if (rank < 2*rem) {
+    if (rank % 2 == 0) {
+      if (__send_blob(s->ranks[rank+1], dst, size) != 0) rc = -1;
+      newrank = -1;
+    } else {
+      if (_coll_recv_combine(s->ranks[rank-1], dst, count, elem_size, combine, op) != 0) rc = -1;
+      newrank = rank / 2;
+    }
+  } else {
+    newrank = rank - rem;
+  }
 
-  zmq_msg_init(&msg);
-  rc = zmq_recv(r, &msg, 0);
-  size = zmq_msg_size(&msg);
-  *dst = (char *)malloc(size + 1);
-  strncpy(*dst, zmq_msg_data(&msg), size);
-  (*dst)[size] = 0; // NULL-terminate
-  zmq_msg_close(&msg);
+  if (newrank != -1) {
+    for (mask=1; mask<pof2; mask<<=1) {
+      newpeer = newrank ^ mask;
+      peer = newpeer < rem ? newpeer*2 + 1 : newpeer + rem;
+      // Sends are queued by ZeroMQ, so both peers can send first.
+      if (__send_blob(s->ranks[peer], dst, size) != 0) rc = -1;
+      if (_coll_recv_combine(s->ranks[peer], dst, count, elem_size, combine, op) != 0) rc = -1;
+    }
+  }
 
-#ifdef __DEBUG__
-  fprintf(stderr, "[%s/%zu] .\n", *dst, size);
-#endif
+  if (rank < 2*rem) {
+    if (rank % 2 == 0) {
+      if (_coll_recv(s->ranks[rank+1], dst, size) != 0) rc = -1;
+    } else {
+      if (__send_blob(s->ranks[rank-1], dst, size) != 0) rc = -1;
+    }
+  }
 
   return rc;
 }
 
 
-int receive_double(role *r, double **dst)
+/**
+ * \brief Helper function for allreduce on a ring.
+ *
+ * The array is cut in N chunks. A reduce-scatter leaves each rank with
+ * the result of one chunk after N-1 steps, an allgather then circulates
+ * the results for N-1 more steps. Every rank sends about 2*size bytes in
+ * total, independent of N.
+ */
+int _allreduce_ring(session *s, void *dst, size_t count, size_t elem_size,
+                    combine_fn combine, sess_op op)
 {
   int rc = 0;
-  zmq_msg_t msg;
-
-#ifdef __DEBUG__
-  fprintf(stderr, " <-- %s() ", __FUNCTION__);
-#endif
+  unsigned n = s->nr_of_ranks;
+  unsigned rank = s->rank;
+  unsigned step, send_idx, recv_idx;
+  role *left = s->ranks[(rank + n - 1) % n];
+  role *right = s->ranks[(rank + 1) % n];
+  size_t chunk_start[n+1];
+  size_t i;
+
+  for (i=0; i<=n; ++i) { // First count%n chunks get an extra element.
+    chunk_start[i] = i * (count / n) + (i < count % n ? i : count % n);
+  }
 
-  zmq_msg_init(&msg);
-  rc = zmq_recv(r, &msg, 0);
-  *dst = (double *)malloc(sizeof(double));
-  assert(zmq_msg_size(&msg) == sizeof(double));
-  memcpy(*dst, (double *)zmq_msg_data(&msg), zmq_msg_size(&msg));
-  zmq_msg_close(&msg);
+  for (step=0; step<n-1; ++step) {
+    send_idx = (rank + n - step) % n;
+    recv_idx = (rank + n - step - 1) % n;
+    if (__send_blob(right, (char *)dst + chunk_start[send_idx] * elem_size,
+                    (chunk_start[send_idx+1] - chunk_start[send_idx]) * elem_size) != 0) rc = -1;
+    if (_coll_recv_combine(left, (char *)dst + chunk_start[recv_idx] * elem_size,
+                           chunk_start[recv_idx+1] - chunk_start[recv_idx],
+                           elem_size, combine, op) != 0) rc = -1;
+  }
 
-#ifdef __DEBUG__
-  fprintf(stderr, "[%f] .\n", **dst);
-#endif
+  for (step=0; step<n-1; ++step) {
+    send_idx = (rank + n + 1 - step) % n;
+    recv_idx = (rank + n - step) % n;
+    if (__send_blob(right, (char *)dst + chunk_start[send_idx] * elem_size,
+                    (chunk_start[send_idx+1] - chunk_start[send_idx]) * elem_size) != 0) rc = -1;
+    if (_coll_recv(left, (char *)dst + chunk_start[recv_idx] * elem_size,
+                   (chunk_start[recv_idx+1] - chunk_start[recv_idx]) * elem_size) != 0) rc = -1;
+  }
 
   return rc;
 }
 
 
-int recv_double(role *r, double *dst)
+int _mallreduce(session *s, const void *src, void *dst,
+                size_t count, size_t elem_size, combine_fn combine, sess_op op)
+{
+  memmove(dst, src, count * elem_size);
+  if (s->nr_of_ranks < 2) return 0;
+
+  if (count * elem_size < COLL_LARGE_MSG_SIZE || count < s->nr_of_ranks) {
+    return _allreduce_doubling(s, dst, count, elem_size, combine, op);
+  }
+  return _allreduce_ring(s, dst, count, elem_size, combine, op);
+}
+
+
+int mbcast_int(session *s, const char *root, int arr[], size_t length)
 {
   int rc = 0;
-  zmq_msg_t msg;
 
 #ifdef __DEBUG__
-  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+  fprintf(stderr, " <-> %s(size=%zu)@%s ", __FUNCTION__, sizeof(int) * length, root);
 #endif
 
-  zmq_msg_init(&msg);
-  rc = zmq_recv(r, &msg, 0);
-  assert(zmq_msg_size(&msg) == sizeof(double));
-  memcpy(dst, (double *)zmq_msg_data(&msg), zmq_msg_size(&msg));
-  zmq_msg_close(&msg);
+  rc = _mbcast(s, root, arr, sizeof(int) * length);
 
 #ifdef __DEBUG__
-  fprintf(stderr, "[%f] .\n", *dst);
+  fprintf(stderr, ".\n");
 #endif
 
   return rc;
 }
 
 
-int receive_double_array(role *r, double **arr, size_t *length)
+int mbcast_double(session *s, const char *root, double arr[], size_t length)
 {
   int rc = 0;
-  zmq_msg_t msg;
-  size_t size = -1;
 
 #ifdef __DEBUG__
-  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+  fprintf(stderr, " <-> %s(size=%zu)@%s ", __FUNCTION__, sizeof(double) * length, root);
 #endif
 
-  zmq_msg_init(&msg);
-  rc = zmq_recv(r, &msg, 0);
-  size = zmq_msg_size(&msg);
-  *arr = (double *)malloc(size);
-  memcpy(*arr, (double *)zmq_msg_data(&msg), size);
-  if (size % sizeof(double) == 0) {
-    *length = size / sizeof(double);
-  }
-  zmq_msg_close(&msg);
+  rc = _mbcast(s, root, arr, sizeof(double) * length);
 
 #ifdef __DEBUG__
-  fprintf(stderr, "[%f/%zu] .\n", **arr, *length);
+  fprintf(stderr, ".\n");
 #endif
 
   return rc;
 }
 
 
-int recv_double_array(role *r, double *arr, size_t *arr_size)
+int mbcast_float(session *s, const char *root, float arr[], size_t length)
 {
   int rc = 0;
-  zmq_msg_t msg;
-  size_t size = -1;
 
 #ifdef __DEBUG__
-  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+  fprintf(stderr, " <-> %s(size=%zu)@%s ", __FUNCTION__, sizeof(float) * length, root);
 #endif
 
-  zmq_msg_init(&msg);
-  rc = zmq_recv(r, &msg, 0);
-  size = zmq_msg_size(&msg);
-  if (*arr_size * sizeof(double) >= size) {
-    memcpy(arr, (double *)zmq_msg_data(&msg), size);
-    if (size % sizeof(double) == 0) {
-      *arr_size = size / sizeof(double);
-    }
-  } else {
-    memcpy(arr, (double *)zmq_msg_data(&msg), *arr_size * sizeof(double));
-    fprintf(stderr,
-      "%s: Received data (%zu bytes) > memory size (%zu), data truncated\n",
-      __FUNCTION__, size, *arr_size);
-  }
-  zmq_msg_close(&msg);
+  rc = _mbcast(s, root, arr, sizeof(float) * length);
 
 #ifdef __DEBUG__
-  fprintf(stderr, "[%f/%zu] .\n", *arr, *arr_size);
+  fprintf(stderr, ".\n");
 #endif
 
   return rc;
 }
 
 
-int receive_float(role *r, float **dst)
+int mreduce_int(session *s, const char *root, const int src[], int dst[], size_t length, sess_op op)
 {
   int rc = 0;
-  zmq_msg_t msg;
 
 #ifdef __DEBUG__
-  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+  fprintf(stderr, " <-> %s(size=%zu, op=%d)@%s ", __FUNCTION__, sizeof(int) * length, op, root);
 #endif
 
-  zmq_msg_init(&msg);
-  rc = zmq_recv(r, &msg, 0);
-  *dst = (float *)malloc(sizeof(float));
-  assert(zmq_msg_size(&msg) == sizeof(float));
-  memcpy(*dst, (float *)zmq_msg_data(&msg), zmq_msg_size(&msg));
-  zmq_msg_close(&msg);
+  rc = _mreduce(s, root, src, dst, length, sizeof(int), _combine_int, op);
 
 #ifdef __DEBUG__
-  fprintf(stderr, "[%f] .\n", **dst);
+  fprintf(stderr, ".\n");
 #endif
 
   return rc;
 }
 
 
-int recv_float(role *r, float *dst)
+int mreduce_double(session *s, const char *root, const double src[], double dst[], size_t length, sess_op op)
 {
   int rc = 0;
-  zmq_msg_t msg;
 
 #ifdef __DEBUG__
-  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+  fprintf(stderr, " <-> %s(size=%zu, op=%d)@%s ", __FUNCTION__, sizeof(double) * length, op, root);
 #endif
 
-  zmq_msg_init(&msg);
-  rc = zmq_recv(r, &msg, 0);
-  assert(zmq_msg_size(&msg) == sizeof(float));
-  memcpy(dst, (float *)zmq_msg_data(&msg), zmq_msg_size(&msg));
-  zmq_msg_close(&msg);
+  rc = _mreduce(s, root, src, dst, length, sizeof(double), _combine_double, op);
 
 #ifdef __DEBUG__
-  fprintf(stderr, "[%f] .\n", *dst);
+  fprintf(stderr, ".\n");
 #endif
 
   return rc;
 }
 
 
-int receive_float_array(role *r, float **arr, size_t *length)
+int mreduce_float(session *s, const char *root, const float src[], float dst[], size_t length, sess_op op)
 {
   int rc = 0;
-  zmq_msg_t msg;
-  size_t size = -1;
 
 #ifdef __DEBUG__
-  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+  fprintf(stderr, " <-> %s(size=%zu, op=%d)@%s ", __FUNCTION__, sizeof(float) * length, op, root);
 #endif
 
-  zmq_msg_init(&msg);
-  rc = zmq_recv(r, &msg, 0);
-  size = zmq_msg_size(&msg);
-  *arr = (float *)malloc(size);
-  memcpy(*arr, (float *)zmq_msg_data(&msg), size);
-  if (size % sizeof(float) == 0) {
-    *length = size / sizeof(float);
-  }
-  zmq_msg_close(&msg);
+  rc = _mreduce(s, root, src, dst, length, sizeof(float), _combine_float, op);
 
 #ifdef __DEBUG__
-  fprintf(stderr, "[%f/%zu] .\n", **arr, *length);
+  fprintf(stderr, ".\n");
 #endif
 
   return rc;
 }
 
 
-int recv_float_array(role *r, float *arr, size_t *arr_size)
+int mallreduce_int(session *s, const int src[], int dst[], size_t length, sess_op op)
 {
   int rc = 0;
-  zmq_msg_t msg;
-  size_t size = -1;
 
 #ifdef __DEBUG__
-  fprintf(stderr, " <-- %s() ", __FUNCTION__);
+  fprintf(stderr, " <-> %s(size=%zu, op=%d) ", __FUNCTION__, sizeof(int) * length, op);
 #endif
 
-  zmq_msg_init(&msg);
-  rc = zmq_recv(r, &msg, 0);
-  size = zmq_msg_size(&msg);
-  if (*arr_size * sizeof(float) >= size) {
-    memcpy(arr, (float *)zmq_msg_data(&msg), size);
-    if (size % sizeof(float) == 0) {
-      *arr_size = size / sizeof(float);
-    }
-  } else {
-    memcpy(arr, (float *)zmq_msg_data(&msg), *arr_size * sizeof(float));
-    fprintf(stderr,
-      "%s: Received data (%zu bytes) > memory size (%zu), data truncated\n",
-      __FUNCTION__, size, *arr_size);
-  }
-  zmq_msg_close(&msg);
+  rc = _mallreduce(s, src, dst, length, sizeof(int), _combine_int, op);
 
 #ifdef __DEBUG__
-  fprintf(stderr, "[%f/%zu] .\n", *arr, *arr_size);
+  fprintf(stderr, ".\n");
 #endif
 
   return rc;
 }
 
 
-/* ----- Multicast -----------------------------------------------------------*/
-
-
-int msend_int(int val, int nr_of_roles, ...)
+int mallreduce_double(session *s, const double src[], double dst[], size_t length, sess_op op)
 {
   int rc = 0;
-  int i;
-  role *r;
-  va_list roles;
-  va_list sessions;
-  session *s;
-
-  if (nr_of_roles == _Others_idx) {
-    va_start(sessions, nr_of_roles);
-    s = va_arg(sessions, session *);
-    for (i=0; i<s->all_roles_count; ++i) {
-      r = s->get_role(s, s->all_roles[i]); 
-      rc |= send_int(r, val);
-    }
-    va_end(sessions);
-    return rc;
-  }
 
 #ifdef __DEBUG__
-  fprintf(stderr, " --> %s(%d)@%d ", __FUNCTION__, val, nr_of_roles);
-#endif
-  va_start(roles, nr_of_roles);
-  for (i=0; i<nr_of_roles; i++) {
-    r = va_arg(roles, role *);
-#ifdef __DEBUG__
-    fprintf(stderr, "   +");
+  fprintf(stderr, " <-> %s(size=%zu, op=%d) ", __FUNCTION__, sizeof(double) * length, op);
 #endif
-    rc |= send_int(r, val);
-  }
-  va_end(roles);
+
+  rc = _mallreduce(s, src, dst, length, sizeof(double), _combine_double, op);
 
 #ifdef __DEBUG__
   fprintf(stderr, ".\n");
@@ -934,40 +4437,15 @@ int msend_int(int val, int nr_of_roles, ...)
 }
 
 
-int mrecv_int(int *dst, int nr_of_roles, ...)
+int mallreduce_float(session *s, const float src[], float dst[], size_t length, sess_op op)
 {
   int rc = 0;
-  int i;
-  int val;
-  role *r;
-  va_list roles;
-  va_list sessions;
-  session *s;
-
-  if (nr_of_roles == _Others_idx) {
-    va_start(sessions, nr_of_roles);
-    s = va_arg(sessions, session *);
-    for (i=0; i<s->all_roles_count; ++i) {
-      r = s->get_role(s, s->all_roles[i]); 
-      rc |= recv_int(r, &val); // XXX: Order of declaration
-      dst[i] = val;
-    }
-    va_end(sessions);
-    return rc;
-  }
 
 #ifdef __DEBUG__
-  fprintf(stderr, " <-- %s()@%d ", __FUNCTION__, nr_of_roles);
+  fprintf(stderr, " <-> %s(size=%zu, op=%d) ", __FUNCTION__, sizeof(float) * length, op);
 #endif
 
-  va_start(roles, nr_of_roles);
-  for (i=0; i<nr_of_roles; i++) {
-    r = va_arg(roles, role *);
-    rc |= recv_int(r, &val);
-    dst[i] = val;
-  fprintf(stderr, "%d ", *dst);
-  }
-  va_end(roles);
+  rc = _mallreduce(s, src, dst, length, sizeof(float), _combine_float, op);
 
 #ifdef __DEBUG__
   fprintf(stderr, ".\n");
@@ -994,6 +4472,65 @@ inline int inbranch(role *r, int **choice)
 
 /* ----- Iteration ---------------------------------------------------------- */
 
+/**
+ * \brief Helper function to send a loop condition.
+ *
+ * If the session piggybacks loop conditions, a non-zero cond is left
+ * pending for the next send to r. The last condition (0) is sent at once,
+ * nothing may follow it.
+ */
+int _send_cond(role *r, int cond)
+{
+  endpoint_t *endpoint = _endpoint_of(r);
+
+  if (endpoint != NULL && endpoint->sess->piggyback_conds
+      && endpoint->batch_limit == 0 // Otherwise it joins the batch anyway.
+      && cond != 0 && !endpoint->cond_pending) {
+    endpoint->cond = cond;
+    endpoint->cond_pending = 1;
+    endpoint->sess->nr_of_pending_conds++;
+    return 0;
+  }
+
+  return _send_scalar(r, &cond, sizeof(int)); // Carries any pending one.
+}
+
+
+/**
+ * \brief Helper function to receive a loop condition.
+ *
+ * The condition is either a message on its own, or the header of a data
+ * message, which then stays in the stash of r for the next receive.
+ */
+int _recv_cond(role *r, int *cond)
+{
+  int rc = 0;
+  int has_cond = 0;
+  sess_msg msg;
+  endpoint_t *endpoint = _endpoint_of(r);
+
+  if (endpoint != NULL && !endpoint->stashed) {
+    while ((rc = _recv_ahead(endpoint, cond, &has_cond)) == 0
+            && !has_cond && !endpoint->stashed);
+    if (rc != 0 || has_cond) return rc;
+  }
+
+  rc = _recv_msg(r, &msg, cond, &has_cond);
+  if (rc == 0 && has_cond) {
+    fprintf(stderr, "%s: Piggybacked data from a role outside a session\n",
+                      __FUNCTION__);
+    errno = EPROTO;
+    rc = -1;
+  } else if (rc == 0) {
+    assert(sess_msg_size(&msg) == sizeof(int));
+    memcpy(cond, sess_msg_data(&msg), sizeof(int));
+  }
+  sess_msg_release(&msg);
+
+  return rc;
+}
+
+
 /**
  * Distributed while loop, forwards loop condition to all roles in argument.
  * Uses varyarg to take variable number of roles but need to specify how many.
@@ -1002,7 +4539,8 @@ inline int inbranch(role *r, int **choice)
 int outwhile(int cond, int nr_of_roles, ...)
 {
   int i;
-  role *r;
+  int nr_of_targets;
+  role *targets[MAX_MULTICAST_ROLES];
   va_list roles;
 
 #ifdef __DEBUG__
@@ -1010,14 +4548,15 @@ int outwhile(int cond, int nr_of_roles, ...)
 #endif
 
   va_start(roles, nr_of_roles);
-  for (i=0; i<nr_of_roles; i++) {
-    r = va_arg(roles, role *);
+  nr_of_targets = _collect_roles(nr_of_roles, roles, targets);
+  va_end(roles);
+
+  for (i=0; i<nr_of_targets; i++) {
 #ifdef __DEBUG__
     fprintf(stderr, "   +");
 #endif
-    send_int(r, cond);
+    _send_cond(targets[i], cond);
   }
-  va_end(roles);
 
 #ifdef __DEBUG__
   fprintf(stderr, " } cond=%d\n", cond);
@@ -1038,9 +4577,10 @@ int outwhile(int cond, int nr_of_roles, ...)
 int inwhile(int nr_of_roles, ...)
 {
   int i;
-  role *r;
   int cond = -1;
   int tmp_cond;
+  int nr_of_sources;
+  role *sources[MAX_MULTICAST_ROLES];
   va_list roles;
 
 #ifdef __DEBUG__
@@ -1048,20 +4588,20 @@ int inwhile(int nr_of_roles, ...)
 #endif
 
   va_start(roles, nr_of_roles);
-  for (i=0; i<nr_of_roles; i++) {
-    r = va_arg(roles, role *);
+  nr_of_sources = _collect_roles(nr_of_roles, roles, sources);
+  va_end(roles);
+
+  for (i=0; i<nr_of_sources; i++) {
 #ifdef __DEBUG__
     fprintf(stderr, "   -");
 #endif
-    recv_int(r, &tmp_cond);
+    _recv_cond(sources[i], &tmp_cond);
     if (i==0) cond = tmp_cond;
     if (cond ^ tmp_cond) {
       fprintf(stderr, "Warning: inwhile condition mismatch!\n");
-      va_end(roles); // Cleanup
       return -1;
     }
   }
-  va_end(roles);
 
   if (cond == -1) {
     fprintf(stderr, "Error: inwhile with no roles!\n");
@@ -1080,41 +4620,47 @@ int inwhile(int nr_of_roles, ...)
  * Uses varyarg to take variable number of roles but need to specify how many.
  *
  * This version synchronises between the roles by requiring a reply from all
- * roles.
+ * roles. The condition is multicast to all roles and the replies are
+ * collected in the order they arrive, so the whole exchange costs one
+ * round trip instead of one per role.
  * The dual is \ref s_inwhile.
  *
  */
 int s_outwhile(int cond, int nr_of_roles, ...)
 {
+  int rc = 0;
   int i;
-  role *r;
+  int nr_of_targets;
+  int sync_reply;
+  role *targets[MAX_MULTICAST_ROLES];
+  sess_msg sync_replies[MAX_MULTICAST_ROLES];
   va_list roles;
-  int *sync_reply = NULL;
 
 #ifdef __DEBUG__
   fprintf(stderr, " --> outwhile@%d {\n", nr_of_roles);
 #endif
 
   va_start(roles, nr_of_roles);
-  for (i=0; i<nr_of_roles; i++) {
-    r = va_arg(roles, role *);
-#ifdef __DEBUG__
-    fprintf(stderr, "   +");
-#endif
-    send_int(r, cond);
-  }
+  nr_of_targets = _collect_roles(nr_of_roles, roles, targets);
   va_end(roles);
 
-  va_start(roles, nr_of_roles);
-  for (i=0; i<nr_of_roles; i++) {
-    r = va_arg(roles, role *);
+  _msend_scalar(&cond, sizeof(int), targets, nr_of_targets);
+
 #ifdef __DEBUG__
-    fprintf(stderr, "   +s:"); // Sync step
+  fprintf(stderr, "   +s:"); // Sync step
 #endif
-    receive_int(r, &sync_reply);
-    assert(*sync_reply == OUTWHILE_SYNC_MAGIC);
+  rc = _mgather(targets, nr_of_targets, sync_replies);
+  for (i=0; i<nr_of_targets; i++) {
+    if (rc == 0) {
+      assert(sess_msg_size(&sync_replies[i]) == sizeof(int));
+      memcpy(&sync_reply, sess_msg_data(&sync_replies[i]), sizeof(int));
+      assert(sync_reply == OUTWHILE_SYNC_MAGIC);
+    }
+    sess_msg_release(&sync_replies[i]);
+  }
+  if (rc != 0) {
+    fprintf(stderr, "%s: Sync step failed\n", __FUNCTION__);
   }
-  va_end(roles);
 
 #ifdef __DEBUG__
   fprintf(stderr, " } cond=%d\n", cond);
@@ -1137,9 +4683,11 @@ int s_outwhile(int cond, int nr_of_roles, ...)
 int s_inwhile(int nr_of_roles, ...)
 {
   int i;
-  role *r;
   int cond = -1;
-  int *tmp_cond = NULL;
+  int tmp_cond;
+  int sync_magic = OUTWHILE_SYNC_MAGIC;
+  int nr_of_sources;
+  role *sources[MAX_MULTICAST_ROLES];
   va_list roles;
 
 #ifdef __DEBUG__
@@ -1147,32 +4695,25 @@ int s_inwhile(int nr_of_roles, ...)
 #endif
 
   va_start(roles, nr_of_roles);
-  for (i=0; i<nr_of_roles; i++) {
-    r = va_arg(roles, role *);
+  nr_of_sources = _collect_roles(nr_of_roles, roles, sources);
+  va_end(roles);
+
+  for (i=0; i<nr_of_sources; i++) {
 #ifdef __DEBUG__
     fprintf(stderr, "   -");
 #endif
-    receive_int(r, &tmp_cond);
-    if (i==0) cond = *tmp_cond;
-    if (cond ^ *tmp_cond) {
+    _recv_cond(sources[i], &tmp_cond);
+    if (i==0) cond = tmp_cond;
+    if (cond ^ tmp_cond) {
       fprintf(stderr, "Warning: inwhile condition mismatch!\n");
-      free(tmp_cond);
-      va_end(roles); // Cleanup
       return -1;
     }
   }
-  free(tmp_cond);
-  va_end(roles);
 
-  va_start(roles, nr_of_roles);
-  for (i=0; i<nr_of_roles; i++) {
-    r = va_arg(roles, role *);
 #ifdef __DEBUG__
-    fprintf(stderr, "   -s: ");
+  fprintf(stderr, "   -s: ");
 #endif
-    send_int(r, OUTWHILE_SYNC_MAGIC); // Synchronisation
-  }
-  va_end(roles);
+  _msend_scalar(&sync_magic, sizeof(int), sources, nr_of_sources); // Synchronisation
 
   if (cond == -1) {
     fprintf(stderr, "Error: inwhile with no roles!\n");
@@ -8,8 +8,12 @@
  */
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <antlr3interfaces.h>
 
@@ -20,15 +24,102 @@
 #include "st_node.h"
 #include "stack.h"
 
-// XXX This should not be global!!
-st_node *root;
-stackli *parents;
-char **roles_table = NULL;
-int roles_count = 0;
+#define STRING_CHUNK_SIZE 4096 // Minimum size of a string table chunk.
+
+
+/**
+ * Helper function to hash a string of len characters.
+ */
+unsigned long _text_hash(const char *text, size_t len)
+{
+  unsigned long hash = 5381;
+  size_t i;
+
+  for (i=0; i<len; ++i) {
+    hash = hash * 33 + (unsigned char)text[i];
+  }
+  return hash;
+}
+
+
+/**
+ * Helper function to intern a string of len characters in the string
+ * table of ctx (valid until the next parse with ctx).
+ */
+const char *_intern_text(scribble_parser *ctx, const char *text, size_t len)
+{
+  scribble_strtab *tab = &ctx->strings;
+  string_chunk *chunk;
+  size_t slot_idx, capacity;
+  char **slots;
+  char *str;
+
+  if (2 * (tab->nr_of_strings + 1) > tab->nr_of_slots) { // Grow (and rehash).
+    capacity = tab->nr_of_slots == 0 ? 64 : 2 * tab->nr_of_slots;
+    slots = calloc(capacity, sizeof(char *));
+    for (slot_idx=0; slot_idx<tab->nr_of_slots; ++slot_idx) {
+      if ((str = tab->slots[slot_idx]) != NULL) {
+        size_t idx = _text_hash(str, strlen(str)) & (capacity-1);
+        while (slots[idx] != NULL) idx = (idx+1) & (capacity-1);
+        slots[idx] = str;
+      }
+    }
+    free(tab->slots);
+    tab->slots = slots;
+    tab->nr_of_slots = capacity;
+  }
+
+  slot_idx = _text_hash(text, len) & (tab->nr_of_slots-1);
+  while ((str = tab->slots[slot_idx]) != NULL) {
+    if (strncmp(str, text, len) == 0 && str[len] == 0) return str;
+    slot_idx = (slot_idx+1) & (tab->nr_of_slots-1);
+  }
+
+  // Strings never move, chunks are only added.
+  chunk = tab->chunks;
+  if (chunk == NULL || chunk->size - chunk->used < len+1) {
+    capacity = len+1 > STRING_CHUNK_SIZE ? len+1 : STRING_CHUNK_SIZE;
+    chunk = malloc(sizeof(string_chunk) + capacity);
+    chunk->size = capacity;
+    chunk->used = 0;
+    chunk->next = tab->chunks;
+    tab->chunks = chunk;
+  }
+  str = chunk->chars + chunk->used;
+  memcpy(str, text, len);
+  str[len] = 0;
+  chunk->used += len+1;
+
+  tab->slots[slot_idx] = str;
+  tab->nr_of_strings++;
+  return str;
+}
+
+
+/**
+ * Helper function to get the text of an AST node.
+ * Node texts point into the input, so they are interned straight from
+ * there instead of being copied into a new ANTLR string by getText.
+ */
+const char *_node_text(scribble_parser *ctx, pANTLR3_BASE_TREE node)
+{
+  pANTLR3_COMMON_TOKEN token = node->getToken(node);
+  const char *start, *stop;
+
+  if (token != NULL) {
+    start = (const char *)token->getStartIndex(token);
+    stop = (const char *)token->getStopIndex(token);
+    if (start != NULL && stop >= start) {
+      return _intern_text(ctx, start, stop-start+1);
+    }
+  }
+  return (const char *)node->getText(node)->chars; // Imaginary (eg. nil).
+}
+
 
 // This handles a special 'nil' node
 // which groups together preamble and protocol definition
-void visit_toplevel_node(pANTLR3_BASE_TREE node)
+void visit_toplevel_node(scribble_parser *ctx, pANTLR3_BASE_TREE node)
 {
   pANTLR3_BASE_TREE tmp_node;
 
@@ -39,18 +130,18 @@ void visit_toplevel_node(pANTLR3_BASE_TREE node)
 
   for (i=0; i<child_count; ++i) {
     tmp_node = node->getChild(node, i);
-    node_name = (char *)tmp_node->getText(tmp_node)->chars;
+    node_name = (char *)_node_text(ctx, tmp_node);
     
     /* TODO Ignoring all importType importProtocol ANNOTATION */
 
     if (strcmp(node_name, "protocol") == 0) {
-      visit_protocol_node(tmp_node);
+      visit_protocol_node(ctx, tmp_node);
     }
   }
 }
 
 
-void visit_protocol_node(pANTLR3_BASE_TREE node)
+void visit_protocol_node(scribble_parser *ctx, pANTLR3_BASE_TREE node)
 {
   pANTLR3_BASE_TREE tmp_node;
 
@@ -61,14 +152,14 @@ void visit_protocol_node(pANTLR3_BASE_TREE node)
   int child_count = node->getChildCount(node);
 
   tmp_node = node->getChild(node, 0);
-  protocol_name = (char *)tmp_node->getText(tmp_node)->chars;
+  protocol_name = (char *)_node_text(ctx, tmp_node);
 
   tmp_node = node->getChild(node, 1);
-  if (strcmp((const char *)tmp_node->getText(tmp_node)->chars, "at") == 0) {
+  if (strcmp(_node_text(ctx, tmp_node), "at") == 0) {
 
     // Endpoint.
     tmp_node = node->getChild(node, 2);
-    myrole_name = (char *)tmp_node->getText(tmp_node)->chars;
+    myrole_name = (char *)_node_text(ctx, tmp_node);
 
 #ifdef __DEBUG__
     printf("Protocol %s @ %s\n", protocol_name, myrole_name);
@@ -84,47 +175,50 @@ void visit_protocol_node(pANTLR3_BASE_TREE node)
 
 
   // Initialise root node.
-  root = malloc(sizeof(st_node));
-  init_st_node(root, BEGIN_NODE, myrole_name == NULL? "" : myrole_name, "");
+  ctx->arena = st_arena_new(); // Owned by the root.
+  ctx->root = st_arena_node(ctx->arena, BEGIN_NODE, myrole_name == NULL? "" : myrole_name, "");
 
-  assert(isEmpty(parents));
-  push(parents, root);
+  assert(isEmpty(ctx->parents));
+  push(ctx->parents, ctx->root);
 
 #ifdef __DEBUG__
   fprintf(stderr, "visit_node: root st_node <%p role=%s type=%s>\n",
-          root, protocol_name, myrole_name ? myrole_name : 0);
+          ctx->root, protocol_name, myrole_name ? myrole_name : 0);
 
 #endif
 
   for (/*1 if global, 3 if endpoint*/; i<child_count; ++i) {
     tmp_node = node->getChild(node, i);
-    visit_node(tmp_node);
+    visit_node(ctx, tmp_node);
   }
 }
 
 
-void visit_role_decl(pANTLR3_BASE_TREE node)
+void visit_role_decl(scribble_parser *ctx, pANTLR3_BASE_TREE node)
 {
   pANTLR3_BASE_TREE tmp_node;
 
   char *role_name;
 
-  if (roles_table == NULL) return;
-
   tmp_node = node->getChild(node, 0);
-  role_name = (char *)tmp_node->getText(tmp_node)->chars;
+  role_name = (char *)_node_text(ctx, tmp_node);
 
-  roles_table[roles_count] = (char *)malloc(strlen(role_name));
-  strcpy(roles_table[roles_count], role_name);
+  if (ctx->roles_count == MAX_PROTOCOL_ROLES) {
+    fprintf(stderr, "Warning: More than %d roles, %s ignored\n", MAX_PROTOCOL_ROLES, role_name);
+    return;
+  }
+
+  ctx->roles[ctx->roles_count] = (char *)malloc(strlen(role_name)+1);
+  strcpy(ctx->roles[ctx->roles_count], role_name);
 #ifdef __DEBUG__
-    fprintf(stderr, "role[%d]: %s\n", roles_count, role_name);
+    fprintf(stderr, "role[%d]: %s\n", ctx->roles_count, role_name);
 #endif
 
-  roles_count++;
+  ctx->roles_count++;
 }
 
 
-void visit_inbranch_branch_node(pANTLR3_BASE_TREE node)
+void visit_inbranch_branch_node(scribble_parser *ctx, pANTLR3_BASE_TREE node)
 {
   pANTLR3_BASE_TREE tmp_node;
   st_node *br_node = NULL;
@@ -136,26 +230,25 @@ void visit_inbranch_branch_node(pANTLR3_BASE_TREE node)
   int child_count = node->getChildCount(node);
 
   tmp_node = node->getChild(node, 0);
-  branch_label_name = (char *)tmp_node->getText(tmp_node)->chars;
-  br_node = malloc(sizeof(st_node));
-  init_st_node(br_node, BRANCH_NODE, "", branch_label_name);//, "");
+  branch_label_name = (char *)_node_text(ctx, tmp_node);
+  br_node = st_arena_node(ctx->arena, BRANCH_NODE, "", branch_label_name);//, "");
 
-  top(parents, &parent_node);
+  top(ctx->parents, &parent_node);
   append_st_node(parent_node, br_node);
 
   // Set the new parent for branch body.
-  push(parents, br_node);
+  push(ctx->parents, br_node);
 
   for (i=1; i<child_count; ++i) {
     tmp_node = node->getChild(node, i);
-    visit_node(tmp_node);
+    visit_node(ctx, tmp_node);
   }
 
-  pop(parents);
+  pop(ctx->parents);
 }
 
 
-void visit_inbranch_node(pANTLR3_BASE_TREE node)
+void visit_inbranch_node(scribble_parser *ctx, pANTLR3_BASE_TREE node)
 {
   pANTLR3_BASE_TREE tmp_node;
   st_node *inbr_node = NULL;
@@ -168,13 +261,12 @@ void visit_inbranch_node(pANTLR3_BASE_TREE node)
   int child_count;
 
   tmp_node = node->getChild(node, 0);
-  role_name = (char *)tmp_node->getText(tmp_node)->chars;
+  role_name = (char *)_node_text(ctx, tmp_node);
 
   // Note: This is INBRANCH_NODE followed by BRANCH_NODEs
-  inbr_node = malloc(sizeof(st_node));
-  init_st_node(inbr_node, INBRANCH_NODE, role_name, "N/A");//, "");
+  inbr_node = st_arena_node(ctx->arena, INBRANCH_NODE, role_name, "N/A");//, "");
 
-  top(parents, &parent_node);
+  top(ctx->parents, &parent_node);
   append_st_node(parent_node, inbr_node);
 
 #ifdef __DEBUG__
@@ -183,23 +275,23 @@ void visit_inbranch_node(pANTLR3_BASE_TREE node)
 #endif
 
   // Set the new parent for BRANCH_NODEs
-  push(parents, inbr_node);
+  push(ctx->parents, inbr_node);
 
   child_count = node->getChildCount(node);
 
   for (i=2; i<child_count; ++i) {
     tmp_node = node->getChild(node, i);
-    child_node_name = (char *)tmp_node->getText(tmp_node)->chars;
+    child_node_name = (char *)_node_text(ctx, tmp_node);
     if (strcmp(child_node_name, ":") == 0) {
-      visit_inbranch_branch_node(tmp_node);
+      visit_inbranch_branch_node(ctx, tmp_node);
     }
   }
 
-  pop(parents);
+  pop(ctx->parents);
 }
 
 
-void visit_outbranch_node(pANTLR3_BASE_TREE node)
+void visit_outbranch_node(scribble_parser *ctx, pANTLR3_BASE_TREE node)
 {
   pANTLR3_BASE_TREE tmp_node;
   st_node *outbr_node = NULL;
@@ -212,13 +304,12 @@ void visit_outbranch_node(pANTLR3_BASE_TREE node)
   int child_count;
 
   tmp_node = node->getChild(node, 0);
-  role_name = (char *)tmp_node->getText(tmp_node)->chars;
+  role_name = (char *)_node_text(ctx, tmp_node);
 
   // Note: This is BRANCH_NODE followed by OUTBRANCH_NODEs
-  outbr_node = malloc(sizeof(st_node));
-  init_st_node(outbr_node, BRANCH_NODE, role_name, "N/A");//, "");
+  outbr_node = st_arena_node(ctx->arena, BRANCH_NODE, role_name, "N/A");//, "");
 
-  top(parents, &parent_node);
+  top(ctx->parents, &parent_node);
   append_st_node(parent_node, outbr_node);
 
 #ifdef __DEBUG__
@@ -227,23 +318,23 @@ void visit_outbranch_node(pANTLR3_BASE_TREE node)
 #endif
 
   // Set the new parent for BRANCH_NODEs
-  push(parents, outbr_node);
+  push(ctx->parents, outbr_node);
 
   child_count = node->getChildCount(node);
 
   for (i=2; i<child_count; ++i) {
     tmp_node = node->getChild(node, i);
-    child_node_name = (char *)tmp_node->getText(tmp_node)->chars;
+    child_node_name = (char *)_node_text(ctx, tmp_node);
     if (strcmp(child_node_name, ":") == 0) {
-      visit_outbranch_branch_node(tmp_node);
+      visit_outbranch_branch_node(ctx, tmp_node);
     }
   }
 
-  pop(parents);
+  pop(ctx->parents);
 }
 
 
-void visit_outbranch_branch_node(pANTLR3_BASE_TREE node)
+void visit_outbranch_branch_node(scribble_parser *ctx, pANTLR3_BASE_TREE node)
 {
   pANTLR3_BASE_TREE tmp_node;
   st_node *br_node = NULL;
@@ -255,26 +346,25 @@ void visit_outbranch_branch_node(pANTLR3_BASE_TREE node)
   int child_count = node->getChildCount(node);
 
   tmp_node = node->getChild(node, 0);
-  branch_label_name = (char *)tmp_node->getText(tmp_node)->chars;
-  br_node = malloc(sizeof(st_node));
-  init_st_node(br_node, OUTBRANCH_NODE, "", branch_label_name);//, "");
+  branch_label_name = (char *)_node_text(ctx, tmp_node);
+  br_node = st_arena_node(ctx->arena, OUTBRANCH_NODE, "", branch_label_name);//, "");
 
-  top(parents, &parent_node);
+  top(ctx->parents, &parent_node);
   append_st_node(parent_node, br_node);
 
   // Set the new parent for branch body.
-  push(parents, br_node);
+  push(ctx->parents, br_node);
 
   for (i=1; i<child_count; ++i) {
     tmp_node = node->getChild(node, i);
-    visit_node(tmp_node);
+    visit_node(ctx, tmp_node);
   }
 
-  pop(parents);
+  pop(ctx->parents);
 }
 
 
-void visit_recv_node(pANTLR3_BASE_TREE node)
+void visit_recv_node(scribble_parser *ctx, pANTLR3_BASE_TREE node)
 {
   pANTLR3_BASE_TREE tmp_node;
   st_node *recv_node;
@@ -284,15 +374,14 @@ void visit_recv_node(pANTLR3_BASE_TREE node)
   char *type_name;
 
   tmp_node  = node->getChild(node, 0); // Type name
-  type_name = (char *)tmp_node->getText(tmp_node)->chars;
+  type_name = (char *)_node_text(ctx, tmp_node);
 
   tmp_node  = node->getChild(node, 1); // Role name
-  role_name = (char *)tmp_node->getText(tmp_node)->chars;
+  role_name = (char *)_node_text(ctx, tmp_node);
 
-  recv_node = malloc(sizeof(st_node));
-  init_st_node(recv_node, RECV_NODE, role_name, type_name);//, "");
+  recv_node = st_arena_node(ctx->arena, RECV_NODE, role_name, type_name);//, "");
 
-  top(parents, &parent_node);
+  top(ctx->parents, &parent_node);
   append_st_node(parent_node, recv_node);
 
 #ifdef __DEBUG__
@@ -302,7 +391,7 @@ void visit_recv_node(pANTLR3_BASE_TREE node)
 }
 
 
-void visit_send_node(pANTLR3_BASE_TREE node)
+void visit_send_node(scribble_parser *ctx, pANTLR3_BASE_TREE node)
 {
   pANTLR3_BASE_TREE tmp_node;
   st_node *send_node;
@@ -316,20 +405,20 @@ void visit_send_node(pANTLR3_BASE_TREE node)
   int child_count = node->getChildCount(node);
 
   tmp_node  = node->getChild(node, 0); // Type name
-  type_name = (char *)tmp_node->getText(tmp_node)->chars;
+  type_name = (char *)_node_text(ctx, tmp_node);
 
+  role_names[0] = '\0';
   for (i=1; i<child_count; ++i) {
     tmp_node  = node->getChild(node, i); // Role name
-    child_node_name = (char *)tmp_node->getText(tmp_node)->chars;
+    child_node_name = (char *)_node_text(ctx, tmp_node);
     strncat(role_names, child_node_name, 254);
     strncat(role_names, "|", 254);
   }
   role_names[strlen(role_names)-1] = '\0';
 
-  send_node = malloc(sizeof(st_node));
-  init_st_node(send_node, SEND_NODE, role_names, type_name);//, "");
+  send_node = st_arena_node(ctx->arena, SEND_NODE, role_names, type_name);//, "");
 
-  top(parents, &parent_node);
+  top(ctx->parents, &parent_node);
   append_st_node(parent_node, send_node);
 
 #ifdef __DEBUG__
@@ -339,7 +428,7 @@ void visit_send_node(pANTLR3_BASE_TREE node)
 }
 
 
-void visit_rec_node(pANTLR3_BASE_TREE node)
+void visit_rec_node(scribble_parser *ctx, pANTLR3_BASE_TREE node)
 {
   pANTLR3_BASE_TREE tmp_node;
   st_node *rec_node;
@@ -351,15 +440,14 @@ void visit_rec_node(pANTLR3_BASE_TREE node)
   int child_count = node->getChildCount(node);
 
   tmp_node  = node->getChild(node, 0);
-  rec_name = (char *)tmp_node->getText(tmp_node)->chars;
+  rec_name = (char *)_node_text(ctx, tmp_node);
 
-  rec_node = malloc(sizeof(st_node));
-  init_st_node(rec_node, RECUR_NODE, "", "\0"/*rec_name*/);
+  rec_node = st_arena_node(ctx->arena, RECUR_NODE, "", "\0"/*rec_name*/);
 
-  top(parents, &parent_node);
+  top(ctx->parents, &parent_node);
   append_st_node(parent_node, rec_node);
 
-  push(parents, rec_node);
+  push(ctx->parents, rec_node);
 
 #ifdef __DEBUG__
   fprintf(stderr, "visit_node: rec st_node <%p rec(%s)>\n",
@@ -368,7 +456,7 @@ void visit_rec_node(pANTLR3_BASE_TREE node)
 
   for (i=1; i<child_count; ++i) {
     tmp_node = node->getChild(node, i);
-    if (strcmp((char *)tmp_node->getText(tmp_node)->chars, rec_name) == 0) {
+    if (strcmp((char *)_node_text(ctx, tmp_node), rec_name) == 0) {
       if (i < child_count - 1) {
         fprintf(stderr,
           "Warning: Reached end of rec %s with %d ignored statements\n",
@@ -376,28 +464,28 @@ void visit_rec_node(pANTLR3_BASE_TREE node)
       }
       break;
     }
-    visit_node(tmp_node);
+    visit_node(ctx, tmp_node);
   }
 
-  pop(parents);
+  pop(ctx->parents);
 }
 
-void visit_repeat_node(pANTLR3_BASE_TREE node)
+void visit_repeat_node(scribble_parser *ctx, pANTLR3_BASE_TREE node)
 {
   pANTLR3_BASE_TREE tmp_node;
 
   char *repeat_name;
 
   tmp_node = node->getChild(node, 0);
-  repeat_name = (char *)tmp_node->getText(tmp_node)->chars;
+  repeat_name = (char *)_node_text(ctx, tmp_node);
 
   if (strcmp(repeat_name, "from") == 0) { // inwhile
 
-    visit_inwhile_node(node);
+    visit_inwhile_node(ctx, node);
 
   } else if (strcmp(repeat_name, "to") == 0) { // outwhile
 
-    visit_outwhile_node(node);
+    visit_outwhile_node(ctx, node);
 
   } else {
 
@@ -408,7 +496,7 @@ void visit_repeat_node(pANTLR3_BASE_TREE node)
 }
 
 
-void visit_inwhile_node(pANTLR3_BASE_TREE node)
+void visit_inwhile_node(scribble_parser *ctx, pANTLR3_BASE_TREE node)
 {
   pANTLR3_BASE_TREE tmp_node;
   st_node *repeat_node;
@@ -423,29 +511,28 @@ void visit_inwhile_node(pANTLR3_BASE_TREE node)
   role_names[0] = '\0';
   for (i=1; i<child_count; ++i) {
     tmp_node = node->getChild(node, i);
-    child_node_name = (char *)tmp_node->getText(tmp_node)->chars;
+    child_node_name = (char *)_node_text(ctx, tmp_node);
     // This belongs to loop body.
     if (tmp_node->getChildCount(tmp_node) > 0) break;
     strncat(role_names, child_node_name, 254);
     strncat(role_names, "|", 254);
     // TODO: Sort role_names.
   }
-  repeat_node = malloc(sizeof(st_node));
-  init_st_node(repeat_node, INWHILE_NODE, role_names, "");//, "");
+  repeat_node = st_arena_node(ctx->arena, INWHILE_NODE, role_names, "");//, "");
 
-  top(parents, &parent_node);
+  top(ctx->parents, &parent_node);
   append_st_node(parent_node, repeat_node);
 
-  push(parents, repeat_node);
+  push(ctx->parents, repeat_node);
   for (i-=1; i<child_count; ++i) {
     tmp_node = node->getChild(node, i);
-    visit_node(tmp_node);
+    visit_node(ctx, tmp_node);
   }
-  pop(parents);
+  pop(ctx->parents);
 }
 
 
-void visit_outwhile_node(pANTLR3_BASE_TREE node)
+void visit_outwhile_node(scribble_parser *ctx, pANTLR3_BASE_TREE node)
 {
   pANTLR3_BASE_TREE tmp_node;
   st_node *repeat_node;
@@ -460,25 +547,24 @@ void visit_outwhile_node(pANTLR3_BASE_TREE node)
   role_names[0] = '\0';
   for (i=1; i<child_count; ++i) {
     tmp_node = node->getChild(node, i);
-    child_node_name = (char *)tmp_node->getText(tmp_node)->chars;
+    child_node_name = (char *)_node_text(ctx, tmp_node);
     // This belongs to loop body.
     if (tmp_node->getChildCount(tmp_node) > 0) break;
     strncat(role_names, child_node_name, 254);
     strncat(role_names, "|", 254);
     // TODO: Sort role_names.
   }
-  repeat_node = malloc(sizeof(st_node));
-  init_st_node(repeat_node, OUTWHILE_NODE, role_names, "");//, "");
+  repeat_node = st_arena_node(ctx->arena, OUTWHILE_NODE, role_names, "");//, "");
 
-  top(parents, &parent_node);
+  top(ctx->parents, &parent_node);
   append_st_node(parent_node, repeat_node);
 
-  push(parents, repeat_node);
+  push(ctx->parents, repeat_node);
   for (i-=1; i<child_count; ++i) {
     tmp_node = node->getChild(node, i);
-    visit_node(tmp_node);
+    visit_node(ctx, tmp_node);
   }
-  pop(parents);
+  pop(ctx->parents);
 }
 
 
@@ -490,11 +576,11 @@ void visit_outwhile_node(pANTLR3_BASE_TREE node)
  *
  * @param[in] node Node to visit.
  */
-void visit_node(pANTLR3_BASE_TREE node)
+void visit_node(scribble_parser *ctx, pANTLR3_BASE_TREE node)
 {
   pANTLR3_BASE_TREE tmp_node;
 
-  char *node_name = (char *)node->getText(node)->chars;
+  char *node_name = (char *)_node_text(ctx, node);
 
   int i;
   int child_count = node->getChildCount(node);
@@ -505,47 +591,47 @@ void visit_node(pANTLR3_BASE_TREE node)
 
   if (strcmp(node_name, "protocol") == 0) {
 
-    visit_protocol_node(node);
+    visit_protocol_node(ctx, node);
 
   } else if (strcmp(node_name, "role") == 0) {
 
-    visit_role_decl(node);
+    visit_role_decl(ctx, node);
 
   } else if (strcmp(node_name, "from") == 0) {
 
     for (i=0; i<child_count; ++i) {
       tmp_node = node->getChild(node, i);
-      if (strcmp((char *)tmp_node->getText(tmp_node)->chars, ":") == 0) {
-        visit_inbranch_node(node);
+      if (strcmp((char *)_node_text(ctx, tmp_node), ":") == 0) {
+        visit_inbranch_node(ctx, node);
         return;
       }
     }
 
-    visit_recv_node(node);
+    visit_recv_node(ctx, node);
 
   } else if (strcmp(node_name, "to") == 0) {
 
     for (i=0; i<child_count; ++i) {
       tmp_node = node->getChild(node, i);
-      if (strcmp((char *)tmp_node->getText(tmp_node)->chars, ":") == 0) {
-        visit_outbranch_node(node);
+      if (strcmp((char *)_node_text(ctx, tmp_node), ":") == 0) {
+        visit_outbranch_node(ctx, node);
         return;
       }
     }
 
-    visit_send_node(node);
+    visit_send_node(ctx, node);
 
   } else if (strcmp(node_name, "rec") == 0) {
 
-    visit_rec_node(node);
+    visit_rec_node(ctx, node);
 
   } else if (strcmp(node_name, "repeat") == 0) {
 
-    visit_repeat_node(node);
+    visit_repeat_node(ctx, node);
 
   } else if (strcmp(node_name, "nil") == 0) {
 
-    visit_toplevel_node(node);
+    visit_toplevel_node(ctx, node);
 
   } else {
 
@@ -555,17 +641,67 @@ void visit_node(pANTLR3_BASE_TREE node)
 }
 
 
+scribble_parser *scribble_parser_new()
+{
+  scribble_parser *ctx = malloc(sizeof(scribble_parser));
+
+  ctx->root = NULL;
+  ctx->arena = NULL;
+  init_stack(&ctx->parents);
+  ctx->roles = malloc(sizeof(char *) * MAX_PROTOCOL_ROLES);
+  ctx->roles_count = 0;
+  ctx->errors = 0;
+  memset(&ctx->strings, 0, sizeof(scribble_strtab));
+  return ctx;
+}
+
+
 /**
- * Entry point to parser by ANTLRv3.
+ * Helper function to free the roles and strings of the last parse.
  */
-st_node *parse(const char *filename)
+void _scribble_parser_reset(scribble_parser *ctx)
+{
+  int role_idx;
+  string_chunk *chunk;
+
+  for (role_idx=0; role_idx<ctx->roles_count; ++role_idx) {
+    free(ctx->roles[role_idx]);
+  }
+  while ((chunk = ctx->strings.chunks) != NULL) {
+    ctx->strings.chunks = chunk->next;
+    free(chunk);
+  }
+  if (ctx->strings.nr_of_strings > 0) {
+    memset(ctx->strings.slots, 0, sizeof(char *) * ctx->strings.nr_of_slots);
+    ctx->strings.nr_of_strings = 0;
+  }
+  ctx->roles_count = 0;
+  ctx->root = NULL;
+  ctx->arena = NULL;
+  ctx->errors = 0;
+  free_stack(ctx->parents);
+}
+
+
+void scribble_parser_free(scribble_parser *ctx)
+{
+  _scribble_parser_reset(ctx);
+  free(ctx->parents);
+  free(ctx->roles);
+  free(ctx->strings.slots);
+  free(ctx);
+}
+
+
+/**
+ * Helper function to parse an input stream (closed when done).
+ */
+st_node *_scribble_parse_stream(scribble_parser *ctx, pANTLR3_INPUT_STREAM input)
 {
   //
   // Input data structures generated by ANTLR3
   //
 
-  pANTLR3_UINT8  source_filename;
-  pANTLR3_INPUT_STREAM  input;
   pANTLR3_COMMON_TOKEN_STREAM  tokens;
 
   //
@@ -576,24 +712,6 @@ st_node *parse(const char *filename)
   pScribbleProtocolParser  parser;
   ScribbleProtocolParser_description_return  ast;
 
-  //
-  // Local variables
-  //
-
-
-  source_filename = (pANTLR3_UINT8)filename;
-
-  //
-  // Step 1: Open the source file.
-  //
-
-  input = antlr3AsciiFileStreamNew(source_filename);
-  if (input == NULL) {
-    fprintf(stderr, "Error: Unable to open file '%s'\n",
-        (char *)source_filename);
-    exit(ANTLR3_ERR_NOMEM);
-  }
-
   //
   // Step 2: Invoke lexer on source stream.
   //
@@ -633,10 +751,10 @@ st_node *parse(const char *filename)
   if (parser->pParser->rec->state->errorCount > 0) {
     fprintf(stderr, "Error: Parser returned %d errors\n",
         parser->pParser->rec->state->errorCount);
+    ctx->errors = parser->pParser->rec->state->errorCount;
   } else {
 
-    init_stack(&parents);
-    visit_node(ast.tree);
+    visit_node(ctx, ast.tree);
   }
 
   parser->free(parser);
@@ -651,23 +769,393 @@ st_node *parse(const char *filename)
   input->close(input);
   input = NULL;
 
+  return ctx->root;
+}
+
+
+/**
+ * Entry point to parser by ANTLRv3, from a file.
+ */
+st_node *scribble_parse(scribble_parser *ctx, const char *filename)
+{
+  pANTLR3_UINT8  source_filename;
+  pANTLR3_INPUT_STREAM  input;
+
+  source_filename = (pANTLR3_UINT8)filename;
+  _scribble_parser_reset(ctx);
+
+  //
+  // Step 1: Open the source file.
+  //
+
+  input = antlr3AsciiFileStreamNew(source_filename);
+  if (input == NULL) {
+    fprintf(stderr, "Error: Unable to open file '%s'\n",
+        (char *)source_filename);
+    ctx->errors = -1;
+    return NULL;
+  }
+
+  return _scribble_parse_stream(ctx, input);
+}
+
+
+/**
+ * Entry point to parser by ANTLRv3, from memory (no copy of src).
+ */
+st_node *scribble_parse_buffer(scribble_parser *ctx, const char *src, size_t len, const char *name)
+{
+  pANTLR3_INPUT_STREAM  input;
+
+  _scribble_parser_reset(ctx);
+
+  input = antlr3NewAsciiStringInPlaceStream((pANTLR3_UINT8)src, (ANTLR3_UINT32)len,
+                                            (pANTLR3_UINT8)(name == NULL ? "<buffer>" : name));
+  if (input == NULL) {
+    fprintf(stderr, "Error: Unable to create input stream (Out of memory)\n");
+    ctx->errors = -1;
+    return NULL;
+  }
+
+  return _scribble_parse_stream(ctx, input);
+}
+
+
+st_node *parse(const char *filename)
+{
+  scribble_parser *ctx = scribble_parser_new();
+  st_node *root = scribble_parse(ctx, filename);
+
+  if (ctx->errors < 0) {
+    exit(ANTLR3_ERR_NOMEM);
+  }
+  scribble_parser_free(ctx);
   return root;
 }
 
 int parse_roles(const char *filename, char *roles[])
 {
-  roles_table = roles;
-  parse(filename);
+  int role_idx, nr_of_roles;
+  scribble_protocol *protocol = parse_protocol(filename);
 
-  return roles_count;
+  nr_of_roles = protocol->nr_of_roles;
+  for (role_idx=0; role_idx<nr_of_roles; ++role_idx) {
+    roles[role_idx] = protocol->roles[role_idx];
+  }
+  protocol->nr_of_roles = 0; // Role names are now owned by roles[].
+  free_protocol(protocol);
+
+  return nr_of_roles;
 }
 
 void parse_rolename(const char *filename, char **rolename)
 {
-  parse(filename);
-  if (root->type == BEGIN_NODE) {
-    *rolename = malloc(sizeof(char) * (strlen(root->role)+1));
-    strcpy(*rolename, root->role);
+  scribble_protocol *protocol = parse_protocol(filename);
+
+  *rolename = protocol->role_name;
+  protocol->role_name = NULL;
+  free_protocol(protocol);
+}
+
+
+st_node *parse_buffer(const char *src, size_t len)
+{
+  scribble_parser *ctx = scribble_parser_new();
+  st_node *root = scribble_parse_buffer(ctx, src, len, NULL);
+
+  scribble_parser_free(ctx);
+  return root;
+}
+
+
+/**
+ * Helper function to make a protocol of a parse with ctx.
+ */
+scribble_protocol *_protocol_of(scribble_parser *ctx, st_node *tree)
+{
+  scribble_protocol *protocol = malloc(sizeof(scribble_protocol));
+
+  protocol->tree = tree;
+
+  // Roles are moved from ctx to protocol.
+  protocol->roles = ctx->roles;
+  protocol->nr_of_roles = ctx->roles_count;
+  ctx->roles = malloc(sizeof(char *));
+  ctx->roles_count = 0;
+
+  if (protocol->tree != NULL && protocol->tree->type == BEGIN_NODE) {
+    protocol->role_name = malloc(sizeof(char) * (strlen(st_sym_name(protocol->tree->role))+1));
+    strcpy(protocol->role_name, st_sym_name(protocol->tree->role));
+  } else {
+    protocol->role_name = calloc(1, sizeof(char));
+  }
+
+  return protocol;
+}
+
+
+scribble_protocol *parse_protocol(const char *filename)
+{
+  scribble_parser *ctx = scribble_parser_new();
+  scribble_protocol *protocol = _protocol_of(ctx, scribble_parse(ctx, filename));
+
+  scribble_parser_free(ctx);
+  return protocol;
+}
+
+
+scribble_protocol *parse_protocol_buffer(const char *src, size_t len, const char *name)
+{
+  scribble_parser *ctx = scribble_parser_new();
+  scribble_protocol *protocol = _protocol_of(ctx, scribble_parse_buffer(ctx, src, len, name));
+
+  scribble_parser_free(ctx);
+  return protocol;
+}
+
+
+void free_protocol(scribble_protocol *protocol)
+{
+  int role_idx;
+
+  for (role_idx=0; role_idx<protocol->nr_of_roles; ++role_idx) {
+    free(protocol->roles[role_idx]);
+  }
+  free(protocol->roles);
+  free(protocol->role_name);
+  if (protocol->tree != NULL) free_st_node(protocol->tree);
+  free(protocol);
+}
+
+
+// ---------- Protocol cache ----------
+
+#define PROTOCOL_CACHE_MAGIC   0x43525053 // "SPRC"
+#define PROTOCOL_CACHE_VERSION 1
+
+// Header of a cache file, followed by the role name, the roles and the
+// tree (preorder), in host byte order.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t mtime;
+  uint64_t size;
+  uint64_t hash; // FNV-1a of the Scribble file.
+} protocol_cache_header;
+
+
+/**
+ * Helper function to hash a buffer (64-bit FNV-1a).
+ */
+uint64_t _protocol_hash(const unsigned char *buf, size_t len)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  size_t i;
+
+  for (i=0; i<len; ++i) {
+    hash ^= buf[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+
+void _cache_write_string(FILE *fp, const char *str)
+{
+  uint32_t len = strlen(str);
+  fwrite(&len, sizeof(len), 1, fp);
+  fwrite(str, 1, len, fp);
+}
+
+
+/**
+ * Helper function to read a string of at most max_len characters.
+ * \returns 0 if successful, -1 otherwise.
+ */
+int _cache_read_string(FILE *fp, char *str, uint32_t max_len)
+{
+  uint32_t len;
+
+  if (fread(&len, sizeof(len), 1, fp) != 1 || len > max_len) return -1;
+  if (fread(str, 1, len, fp) != len) return -1;
+  str[len] = 0;
+  return 0;
+}
+
+
+void _cache_write_st_node(FILE *fp, const st_node *node)
+{
+  uint32_t type = node->type;
+  uint32_t next_sz = node->next_sz;
+  unsigned child;
+
+  fwrite(&type, sizeof(type), 1, fp);
+  _cache_write_string(fp, st_sym_name(node->role));
+  _cache_write_string(fp, st_sym_name(node->datatype));
+  _cache_write_string(fp, st_sym_name(node->branchtag));
+  fwrite(&next_sz, sizeof(next_sz), 1, fp);
+  for (child=0; child<node->next_sz; ++child) {
+    _cache_write_st_node(fp, node->next[child]);
+  }
+}
+
+
+/**
+ * Helper function to read a tree written by _cache_write_st_node, into
+ * arena (freed by the caller on errors).
+ * \returns the tree, or NULL if the cache file is truncated or corrupt.
+ */
+st_node *_cache_read_st_node(FILE *fp, st_arena *arena, int depth)
+{
+  uint32_t type, next_sz, child;
+  st_node *node, *next;
+  char role[255], datatype[255], branchtag[255];
+
+  if (depth > 1000 || fread(&type, sizeof(type), 1, fp) != 1
+      || _cache_read_string(fp, role, sizeof(role)-1) != 0
+      || _cache_read_string(fp, datatype, sizeof(datatype)-1) != 0
+      || _cache_read_string(fp, branchtag, sizeof(branchtag)-1) != 0
+      || fread(&next_sz, sizeof(next_sz), 1, fp) != 1) {
+    return NULL;
+  }
+
+  node = st_arena_node(arena, type, role, datatype);
+  node->branchtag = st_sym_intern(branchtag);
+  for (child=0; child<next_sz; ++child) {
+    if ((next = _cache_read_st_node(fp, arena, depth+1)) == NULL) {
+      return NULL;
+    }
+    append_st_node(node, next);
   }
+  return node;
+}
+
+
+/**
+ * Helper function to read a cache file.
+ * \returns the protocol, or NULL if the cache file is missing or stale.
+ */
+scribble_protocol *_cache_read(const char *cache_file, const protocol_cache_header *key)
+{
+  FILE *fp;
+  protocol_cache_header header;
+  scribble_protocol *protocol = NULL;
+  st_arena *arena;
+  char name[255];
+  uint32_t nr_of_roles;
+
+  if ((fp = fopen(cache_file, "rb")) == NULL) return NULL;
+  if (fread(&header, sizeof(header), 1, fp) != 1
+      || header.magic != key->magic || header.version != key->version
+      || header.mtime != key->mtime || header.size != key->size || header.hash != key->hash
+      || _cache_read_string(fp, name, sizeof(name)-1) != 0
+      || fread(&nr_of_roles, sizeof(nr_of_roles), 1, fp) != 1
+      || nr_of_roles > MAX_PROTOCOL_ROLES) {
+    fclose(fp);
+    return NULL;
+  }
+
+  protocol = malloc(sizeof(scribble_protocol));
+  protocol->role_name = malloc(sizeof(char) * (strlen(name)+1));
+  strcpy(protocol->role_name, name);
+  protocol->roles = malloc(sizeof(char *) * MAX_PROTOCOL_ROLES);
+  protocol->tree = NULL;
+  for (protocol->nr_of_roles=0; protocol->nr_of_roles<(int)nr_of_roles; ++protocol->nr_of_roles) {
+    if (_cache_read_string(fp, name, sizeof(name)-1) != 0) break;
+    protocol->roles[protocol->nr_of_roles] = malloc(sizeof(char) * (strlen(name)+1));
+    strcpy(protocol->roles[protocol->nr_of_roles], name);
+  }
+  if (protocol->nr_of_roles == (int)nr_of_roles) {
+    arena = st_arena_new(); // Owned by the root.
+    if ((protocol->tree = _cache_read_st_node(fp, arena, 0)) == NULL) {
+      st_arena_free(arena);
+    }
+  }
+  if (protocol->tree == NULL) {
+    free_protocol(protocol);
+    protocol = NULL;
+  }
+
+  fclose(fp);
+  return protocol;
+}
+
+
+/**
+ * Helper function to write a cache file, atomically so concurrent
+ * launches never see a partial file.
+ */
+void _cache_write(const char *cache_file, const protocol_cache_header *key,
+                  const scribble_protocol *protocol)
+{
+  FILE *fp;
+  char *tmp_file = malloc(strlen(cache_file) + 32);
+  uint32_t nr_of_roles = protocol->nr_of_roles;
+  int role_idx;
+
+  sprintf(tmp_file, "%s.%ld.tmp", cache_file, (long)getpid());
+  if ((fp = fopen(tmp_file, "wb")) == NULL) {
+    free(tmp_file);
+    return;
+  }
+  fwrite(key, sizeof(protocol_cache_header), 1, fp);
+  _cache_write_string(fp, protocol->role_name);
+  fwrite(&nr_of_roles, sizeof(nr_of_roles), 1, fp);
+  for (role_idx=0; role_idx<protocol->nr_of_roles; ++role_idx) {
+    _cache_write_string(fp, protocol->roles[role_idx]);
+  }
+  _cache_write_st_node(fp, protocol->tree);
+
+  if (fclose(fp) != 0 || rename(tmp_file, cache_file) != 0) {
+    perror("Warning: protocol cache");
+    unlink(tmp_file);
+  }
+  free(tmp_file);
+}
+
+
+scribble_protocol *parse_protocol_cached(const char *filename, const char *cache_dir)
+{
+  struct stat st;
+  protocol_cache_header key;
+  scribble_protocol *protocol;
+  unsigned char *buf;
+  char *cache_file;
+  FILE *fp;
+
+  if (cache_dir == NULL || stat(filename, &st) != 0) return parse_protocol(filename);
+
+  // Key: size, mtime and content of the file.
+  if ((fp = fopen(filename, "rb")) == NULL) return parse_protocol(filename);
+  buf = malloc(st.st_size > 0 ? st.st_size : 1);
+  if (fread(buf, 1, st.st_size, fp) != (size_t)st.st_size) {
+    fclose(fp);
+    free(buf);
+    return parse_protocol(filename);
+  }
+  fclose(fp);
+  key.magic = PROTOCOL_CACHE_MAGIC;
+  key.version = PROTOCOL_CACHE_VERSION;
+  key.mtime = st.st_mtime;
+  key.size = st.st_size;
+  key.hash = _protocol_hash(buf, st.st_size);
+  free(buf);
+
+  cache_file = malloc(strlen(cache_dir) + 32);
+  sprintf(cache_file, "%s/%016llx.sprc", cache_dir,
+          (unsigned long long)_protocol_hash((const unsigned char *)filename, strlen(filename)));
+
+  if ((protocol = _cache_read(cache_file, &key)) == NULL) {
+#ifdef __DEBUG__
+    fprintf(stderr, "%s: %s not in cache %s\n", __FUNCTION__, filename, cache_file);
+#endif
+    protocol = parse_protocol(filename);
+    if (protocol->tree != NULL) {
+      _cache_write(cache_file, &key, protocol);
+    }
+  }
+
+  free(cache_file);
+  return protocol;
 }
 
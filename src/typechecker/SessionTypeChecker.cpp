@@ -31,6 +31,7 @@
 
 extern "C" {
   st_node *parse(const char *filename);
+  st_node *parse_buffer(const char *src, size_t len);
 }
 
 using namespace clang;
@@ -54,6 +55,7 @@ namespace {
     TranslationUnitDecl *tu_decl_;
 
     // Local fields for building session type tree.
+    st_arena *arena_; // Nodes of root_ (owned by root_).
     st_node *root_;
     st_node *scribble_root_;
     std::stack< st_node * > appendto_node;
@@ -78,7 +80,9 @@ namespace {
         tu_decl_ = context_->getTranslationUnitDecl();
 
         // Session Type tree root.
-        root_ = (st_node *)malloc(sizeof(st_node));
+        arena_ = st_arena_new();
+        root_ = st_arena_node(arena_, BEGIN_NODE, "", "");
+        scribble_root_ = NULL;
 
         chain_count = 0;
         caseState = 0;
@@ -105,6 +109,13 @@ namespace {
           BaseDeclVisitor::Visit(decl);
         }
 
+        if (scribble_root_ == NULL) {
+          llvm::outs() << "\n[Session Type Checker] "
+                       << "No Scribble description, code NOT type checked\n\n";
+          free_st_node(root_);
+          return;
+        }
+
         // Normalise.
         normalise(root_);
 
@@ -268,7 +279,27 @@ namespace {
             BaseStmtVisitor::Visit(func_call_stmt);
 
             // ---------- Initialisation ----------
-            if (func_name.find("join_session") != std::string::npos) {
+            if (func_name == "join_session_embedded") {
+              std::string scribble_src;
+
+              // Parse the Scribble compiled into the program.
+              if (embeddedScribbleOf(callExpr->getArg(3), scribble_src)) {
+                scribble_root_ = parse_buffer(scribble_src.data(), scribble_src.size());
+                if (scribble_root_ == NULL) { // ie. parse failed
+                  llvm::errs() << "ERROR: Unable to parse embedded Scribble.\n";
+                }
+              } else {
+                llvm::errs() << "Warn: Embedded Scribble of join_session_embedded "
+                             << "is not a constant array, skipping type checking\n";
+              }
+
+              st_arena_reset(arena_);
+              root_ = st_arena_node(arena_, BEGIN_NODE, "", "");
+              appendto_node.push(root_);
+              return;
+            }
+
+            if (func_name == "join_session") {
               Expr *value = callExpr->getArg(3);
               if (ImplicitCastExpr *ICE = dyn_cast<ImplicitCastExpr>(value)) {
                 if (ImplicitCastExpr *ICE2 = dyn_cast<ImplicitCastExpr>(ICE->getSubExpr())) {
@@ -286,7 +317,8 @@ namespace {
                 return;
               }
 
-              init_st_node(root_, BEGIN_NODE, "", "");
+              st_arena_reset(arena_);
+              root_ = st_arena_node(arena_, BEGIN_NODE, "", "");
               appendto_node.push(root_);
               return;
             }
@@ -309,10 +341,10 @@ namespace {
               addtoBranch_counter();
 
               // Extract the datatype (last segment of function name).
-              datatype = func_name.substr(func_name.find("_") + 1, std::string::npos);
+              datatype = datatypeOf(func_name);
 
-              // Extract the roles (3rd argument onwards).
-              for (unsigned arg = 2, arg_end = callExpr->getNumArgs();
+              // Extract the roles (3rd argument onwards, 4th for arrays).
+              for (unsigned arg = firstRoleArgOf(datatype), arg_end = callExpr->getNumArgs();
                   arg < arg_end; ++arg) {
                 Expr *expr = callExpr->getArg(arg);
                 if (ImplicitCastExpr *ICE = dyn_cast<ImplicitCastExpr>(expr)) {
@@ -324,8 +356,7 @@ namespace {
                 }
               }
 
-              st_node *node = (st_node *)malloc(sizeof(st_node));
-              init_st_node(node, SEND_NODE, role.substr(0, role.size()-1).c_str(), datatype.c_str());
+              st_node *node = st_arena_node(arena_, SEND_NODE, role.substr(0, role.size()-1).c_str(), datatype.c_str());
 
               // Put new ST node in position (ie. child of previous_node).
               st_node * previous_node = appendto_node.top();
@@ -341,7 +372,7 @@ namespace {
               addtoBranch_counter();
 
               // Extract the datatype (last segment of function name).
-              datatype = func_name.substr(func_name.find("_") + 1, std::string::npos);
+              datatype = datatypeOf(func_name);
 
               // Extract the role (first argument).
               Expr *expr = callExpr->getArg(0);
@@ -366,8 +397,7 @@ namespace {
               }
 
               // Construct the ST node.
-              st_node *node = (st_node *)malloc(sizeof(st_node));
-              init_st_node(node, SEND_NODE, role.c_str(), datatype.c_str());
+              st_node *node = st_arena_node(arena_, SEND_NODE, role.c_str(), datatype.c_str());
 
               // Put new ST node in position (ie. child of previous_node).
               st_node * previous_node = appendto_node.top();
@@ -383,10 +413,10 @@ namespace {
               addtoBranch_counter();
 
               // Extract the datatype (last segment of function name).
-              datatype = func_name.substr(func_name.find("_") + 1, std::string::npos);
+              datatype = datatypeOf(func_name);
 
-              // Extract the roles (3rd argument onwards).
-              for (unsigned arg = 2, arg_end = callExpr->getNumArgs();
+              // Extract the roles (3rd argument onwards, 4th for arrays).
+              for (unsigned arg = firstRoleArgOf(datatype), arg_end = callExpr->getNumArgs();
                   arg < arg_end; ++arg) {
                 Expr *expr = callExpr->getArg(arg);
                 if (ImplicitCastExpr *ICE = dyn_cast<ImplicitCastExpr>(expr)) {
@@ -398,8 +428,7 @@ namespace {
                 }
               }
 
-              st_node *node = (st_node *)malloc(sizeof(st_node));
-              init_st_node(node, RECV_NODE, role.substr(0, role.size()-1).c_str(), datatype.c_str());
+              st_node *node = st_arena_node(arena_, RECV_NODE, role.substr(0, role.size()-1).c_str(), datatype.c_str());
 
               // Put new ST node in position (ie. child of previous_node).
               st_node * previous_node = appendto_node.top();
@@ -416,8 +445,7 @@ namespace {
                 addtoBranch_counter();
 
                 // Extract the datatype (last segment of function name).
-                datatype = func_name.substr(func_name.find("_") + 1,
-                                            std::string::npos);
+                datatype = datatypeOf(func_name);
 
                 // Extract the role (first argument).
                 Expr *expr = callExpr->getArg(0);
@@ -430,8 +458,7 @@ namespace {
                 }
 
                 // Construct the ST node.
-                st_node *node = (st_node *)malloc(sizeof(st_node));
-                init_st_node(node, RECV_NODE, role.c_str(), datatype.c_str());
+                st_node *node = st_arena_node(arena_, RECV_NODE, role.c_str(), datatype.c_str());
 
                 // Put new ST node in position (ie. child of previous_node).
                 st_node * previous_node = appendto_node.top();
@@ -473,8 +500,7 @@ namespace {
                 role_str += *it + "|";
                 }
 
-                st_node *node = (st_node *)malloc(sizeof(st_node));
-                init_st_node(node, OUTWHILE_NODE, role_str.c_str(), "");
+                st_node *node = st_arena_node(arena_, OUTWHILE_NODE, role_str.c_str(), "");
 
                 st_node * previous_node = appendto_node.top();
                 append_st_node(previous_node, node);
@@ -517,8 +543,7 @@ namespace {
                 role_str += *it + "|";
                 }
 
-                st_node *node = (st_node *)malloc(sizeof(st_node));
-                init_st_node(node, INWHILE_NODE, role_str.c_str(), "");
+                st_node *node = st_arena_node(arena_, INWHILE_NODE, role_str.c_str(), "");
 
                 st_node * previous_node = appendto_node.top();
                 append_st_node(previous_node, node);
@@ -558,9 +583,8 @@ namespace {
                 }
                 }
 
-                st_node *node = (st_node *)malloc(sizeof(st_node));
-                init_st_node(node, OUTBRANCH_NODE, role.c_str(), "");
-                strncpy(node->branchtag, branchtag.c_str(), branchtag.size() < 255 ? branchtag.size() : 254);
+                st_node *node = st_arena_node(arena_, OUTBRANCH_NODE, role.c_str(), "");
+                node->branchtag = st_sym_intern(branchtag.c_str());
 
                 st_node * previous_node = appendto_node.top();
                 append_st_node(previous_node, node);
@@ -598,8 +622,7 @@ namespace {
                 }
                 }
 
-                st_node *node = (st_node *)malloc(sizeof(st_node));
-                init_st_node(node, INBRANCH_NODE, role.c_str(), "");
+                st_node *node = st_arena_node(arena_, INBRANCH_NODE, role.c_str(), "");
 
                 st_node * previous_node = appendto_node.top();
                 append_st_node(previous_node, node);
@@ -634,8 +657,7 @@ namespace {
           }
 
           SwitchCase *switchCase = cast<SwitchCase>(stmt);
-          st_node *appendnode = (st_node *)malloc(sizeof(st_node));
-          init_st_node(appendnode, BRANCH_NODE, "", "");
+          st_node *appendnode = st_arena_node(arena_, BRANCH_NODE, "", "");
 
           st_node * previous_node = appendto_node.top();
           append_st_node(previous_node, appendnode);
@@ -703,8 +725,7 @@ namespace {
             } 
           } else { // Not callExpr and callExpr not inwhile/outwhile.
 
-            st_node *node = (st_node *)malloc(sizeof(st_node));
-            init_st_node(node, RECUR_NODE, "", "");
+            st_node *node = st_arena_node(arena_, RECUR_NODE, "", "");
 
             st_node *previous_node = appendto_node.top();
             append_st_node(previous_node, node);
@@ -735,8 +756,7 @@ namespace {
           // We assume there is branch by default
           // so build BRANCH_NODE (remove if not needed by normalisation).
 
-          st_node *node = (st_node *)malloc(sizeof(st_node));
-          init_st_node(node, BRANCH_NODE, "", "");
+          st_node *node = st_arena_node(arena_, BRANCH_NODE, "", "");
 
           st_node *previous_node = appendto_node.top();
           append_st_node(previous_node, node);
@@ -804,6 +824,75 @@ namespace {
       }
 
 
+      // Extract the datatype (last segment of function name),
+      // treating zero-copy variants (_nocopy, _view) as their base type.
+      // Untyped messages (recv_view, mrecv_view, send_buf) match any datatype.
+      std::string datatypeOf(const std::string &func_name) {
+        std::string datatype = func_name.substr(func_name.find("_") + 1, std::string::npos);
+        if (datatype == "view" || datatype == "buf") {
+          return ST_ANY_DATATYPE;
+        }
+        const char *suffixes[] = { "_nocopy", "_view" };
+        for (unsigned i = 0; i < sizeof(suffixes)/sizeof(suffixes[0]); ++i) {
+          std::string suffix(suffixes[i]);
+          if (datatype.size() > suffix.size()
+              && datatype.compare(datatype.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            datatype.erase(datatype.size() - suffix.size());
+          }
+        }
+        return datatype;
+      }
+
+
+      // Source of the Scribble passed to join_session_embedded, from the
+      // initializer of the array it points to (a string literal, or a list
+      // of character codes as generated by xxd -i).
+      bool embeddedScribbleOf(Expr *expr, std::string &src) {
+        DeclRefExpr *ref = dyn_cast<DeclRefExpr>(expr->IgnoreParenCasts());
+        if (ref == NULL) return false;
+
+        VarDecl *var = dyn_cast<VarDecl>(ref->getDecl());
+        const Expr *init = NULL;
+        if (var == NULL || var->getAnyInitializer() == NULL) return false;
+        init = var->getAnyInitializer()->IgnoreParenImpCasts();
+
+        if (const StringLiteral *SL = dyn_cast<StringLiteral>(init)) {
+          src = SL->getString();
+          return true;
+        }
+
+        const InitListExpr *ILE = dyn_cast<InitListExpr>(init);
+        if (ILE == NULL) return false;
+        src.clear();
+        for (unsigned i = 0, i_end = ILE->getNumInits(); i < i_end; ++i) {
+          const Expr *elem = ILE->getInit(i)->IgnoreParenImpCasts();
+          if (const IntegerLiteral *IL = dyn_cast<IntegerLiteral>(elem)) {
+            src += (char)IL->getValue().getZExtValue();
+          } else if (const CharacterLiteral *CL = dyn_cast<CharacterLiteral>(elem)) {
+            src += (char)CL->getValue();
+          } else {
+            return false;
+          }
+        }
+        while (!src.empty() && src[src.size() - 1] == '\0') { // NUL-terminated copy.
+          src.erase(src.size() - 1);
+        }
+        return true;
+      }
+
+
+      // Position of the first role argument of a multicast primitive,
+      // array variants take an extra length argument.
+      unsigned firstRoleArgOf(const std::string &datatype) {
+        std::string suffix("_array");
+        if (datatype.size() > suffix.size()
+            && datatype.compare(datatype.size() - suffix.size(), suffix.size(), suffix) == 0) {
+          return 3;
+        }
+        return 2;
+      }
+
+
       // Add to branch counter if it is inside the IF statement block (including THEN and ELSE)
       int addtoBranch_counter() {
         if (ifState == 1) {